@@ -2,58 +2,860 @@
  * Program Name: babysh.c
  * Author: Kevin Pardew
  * Description: This program is a shell to run command line instructions
- *   and return the results. This shell allows for the redirection of
- *   standard input and output, and supports foreground and background
- *   processes. The shell supports three built in commands: exit, cd, and
- *   status. The shell also supports comments, which are lines beginning
- *   with the # character.
+ *   and return the results. This shell allows for the redirection of any
+ *   descriptor from 0 to 9 to files ("<", ">", ">>", "&>") or to copies
+ *   of other descriptors ("2>&1"), here-documents ("<<" and "<<-") and
+ *   here-strings ("<<<"), pipelines of commands separated by "|", lists
+ *   of commands separated by ";" or "&", the compound commands if, while
+ *   and for, and supports foreground and background processes. Arguments
+ *   may be quoted with single or double quotes or escaped with a
+ *   backslash, and the parameters $NAME, ${NAME}, $?, $$ and $! are
+ *   expanded outside single quotes, as are command substitutions
+ *   "$(...)" and the patterns "*", "?" and "[...]" into the paths that
+ *   match them. The shell supports the built in commands exit, cd,
+ *   status, stats, hash, history, exec, the job control commands jobs,
+ *   wait, fg, bg and kill, which act on the process group each job
+ *   started with "&" is given, parallel, which runs a list of commands a
+ *   few at a time, and batch, which runs a command with as many of a
+ *   list of arguments at a time as the system allows, as well as the
+ *   prefix time, which measures the resources a command used, the
+ *   prefixes pin, numa, limit and cgroup, which choose the CPUs, NUMA
+ *   node, resource limits and cgroup a command runs with, and runs the
+ *   common utilities echo, pwd, true, false, test ([) and printf without
+ *   starting a process. A plain cat or tee in the foreground is also run
+ *   by the shell, which moves its data in the kernel. The shell also
+ *   supports comments, which begin with a word starting with the #
+ *   character. Commands are read from the string given with -c or the
+ *   script named on the command line, if any, or from clients of a
+ *   server started with -s, and the prompt is only shown when reading
+ *   from a terminal. The last command of a script or string replaces the
+ *   shell. With BABYSH_CACHE set, a script is compiled once and later
+ *   run from the compiled copy kept in the cache. With BABYSH_STATS set,
+ *   counters of the processes the shell starts are kept in shared
+ *   memory, where the stats command of any shell can read them. Commands
+ *   found on PATH are remembered so that PATH is only searched once per
+ *   command. Lines read from a terminal are added to a history file
+ *   shared by every session, which is mapped rather than read. A command
+ *   of NAME=value words sets those variables of the environment.
  ************************************************************************/
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <poll.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
-#define MAX_LINE_LENGTH 2048
-#define MAX_ARGS 512
-#define MAX_PROCESSES 100
-#define PROCESS_INVALID -1
-#define PROCESS_IS_FINISHED 0
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#define INPUT_BLOCK 65536
+#define INLINE_ARGS 512
+#define MAX_STAGES 256
+#define JOBS_INITIAL 16
+#define JOB_INDEX_BITS 6
+#define NO_JOB -1
+#define RUN_PARALLEL 2
+#define RUN_REQUEST 3
+#define OUTPUT_BUFFER 8192
 #define TRUE 1
+#define HASH_BUCKETS 64
+#define DEFAULT_PATH "/bin:/usr/bin"
+#define TRACE_BUCKETS 496
+#define HERE_PIPE_LIMIT 65536
+#define MAX_REDIRECTS 64
+#define ARENA_SIZE 1073741824
+#define ARENA_KEEP 1048576
+#define BATCH_HEADROOM 2048
+#define DIR_CACHE_SIZE 16
+#define DIR_READ 131072
+#define MAX_SUBSTITUTIONS 16
+#define CAPTURE_READ 65536
+#define CAPTURE_PIPE 1048576
+#define REDIRECT_FDS 10
+#define MAX_LIMITS 6
+#define NUMA_NODES 64
+#define SCRIPT_BLOCK 65536
+#define SCRIPT_START sizeof(struct scriptHeader)
+#define SCRIPT_MAGIC "babysh\0\2"
+#define STATS_MAGIC "babystat"
+#define STATS_VERSION 1
+#define STATS_BUCKETS 32
+#define CACHE_LINE 64
+#define SCAN_STOPS 16
+#define SCAN_START 16
+#define STREAM_CHUNK 65536
+#define EXIT_GRACE 200
+#define REQUEST_TIMEOUT 1000
+#define HISTORY_SIZE 1000
+#define HISTORY_COMPACT 128
+
+extern char **environ;
+
+// A command name and the absolute path it was found at on PATH
+struct hashEntry {
+	struct hashEntry *next;
+	char *name;
+	char *path;
+	int hits;
+};
+
+// Table of previously located commands. pathCopy holds the value of
+// PATH the entries were resolved against, so a change to PATH can be
+// detected and the table flushed.
+struct pathHash {
+	struct hashEntry *buckets[HASH_BUCKETS];
+	char *pathCopy;
+};
+
+// A background command started by the shell. A pipeline is a single
+// job made up of several processes.
+struct job {
+	pid_t pid;                      // Reported pid, 0 if the slot is free
+	int processes;                  // Number of processes still running
+	int waitStatus;                 // Status of the reported process
+	int nextFree;                   // Next free slot, while this one is free
+	struct timespec start;          // Time the job was started
+	char *command;                  // Command line that started the job
+	int parallel;                   // Whether the job belongs to parallel
+	int client;                     // Socket the job replies to, or -1
+	int timed;                      // Whether usage is reported at the end
+	struct rusage usage;            // Resources used by finished processes
+	pid_t group;                    // Process group of a job started with "&"
+	int stopped;                    // Whether the job was stopped by a signal
+};
+
+// Position of a process in the table of jobs
+struct jobIndex {
+	pid_t pid;                      // Process id, 0 if the entry is empty
+	int slot;                       // Slot of the job the process belongs to
+};
+
+// Table of background jobs. The slots grow as needed, and free slots
+// are chained together so adding and removing a job takes constant
+// time. Every process is found through an open addressed hash of pids.
+struct jobTable {
+	struct job *jobs;
+	int capacity;                   // Number of slots in jobs
+	int freeSlot;                   // First free slot, or NO_JOB
+	struct jobIndex *index;
+	int indexBits;                  // The index holds 1 << indexBits entries
+	int indexCount;                 // Number of processes in the index
+	pid_t lastPid;                  // Reported pid of the last job, or 0
+	struct stats *stats;            // Counters of BABYSH_STATS, or NULL
+	pid_t watchPid;                 // Job waited for, -1 for any, or 0
+	int watchStops;                 // Whether the wait ends if it stops
+	int watchStatus;                // Status the job waited for ended with
+};
+
+// Commands built into the shell. Those from BUILTIN_ECHO on are common
+// utilities that are also available as programs.
+enum builtin {
+	BUILTIN_NONE,
+	BUILTIN_CD,
+	BUILTIN_STATUS,
+	BUILTIN_STATS,
+	BUILTIN_EXIT,
+	BUILTIN_HASH,
+	BUILTIN_HISTORY,
+	BUILTIN_PARALLEL,
+	BUILTIN_BATCH,
+	BUILTIN_EXEC,
+	BUILTIN_JOBS,
+	BUILTIN_WAIT,
+	BUILTIN_FG,
+	BUILTIN_BG,
+	BUILTIN_KILL,
+	BUILTIN_ECHO,
+	BUILTIN_PWD,
+	BUILTIN_TRUE,
+	BUILTIN_FALSE,
+	BUILTIN_TEST,
+	BUILTIN_PRINTF
+};
+
+// Binary operators of the test command
+enum testCompare {
+	TEST_NONE,
+	TEST_STRING_EQ,
+	TEST_STRING_NE,
+	TEST_STRING_LT,
+	TEST_STRING_GT,
+	TEST_NEWER,
+	TEST_OLDER,
+	TEST_SAME_FILE,
+	TEST_EQ,
+	TEST_NE,
+	TEST_LT,
+	TEST_LE,
+	TEST_GT,
+	TEST_GE
+};
+
+// Input that has not yet been returned by getInput(). The buffer grows
+// to hold a line of any length. A script file is mapped in full rather
+// than read.
+struct inputBuffer {
+	char *data;
+	size_t size;                    // Bytes allocated for data
+	size_t start;                   // Offset of the next unreturned byte
+	size_t end;                     // Offset just past the buffered input
+	int fd;                         // Descriptor read from, -1 at its end
+	int mapped;                     // Whether data maps the whole file
+};
+
+// Messages for the user that have not yet been written to stdout
+struct outputBuffer {
+	char data[OUTPUT_BUFFER];
+	size_t length;                  // Number of bytes waiting in data
+	int fd;                         // Where the messages are written
+};
+
+// Progress of the parallel command. Its jobs are counted here instead
+// of being reported when they finish.
+struct parallelRun {
+	int running;                    // Number of jobs still running
+	int started;                    // Number of command lines run
+	int succeeded;                  // Jobs that exited with status 0
+	int failed;                     // Jobs that exited with another status
+	int signaled;                   // Jobs that were terminated by a signal
+	int interrupted;                // Whether a job was stopped by SIGINT
+};
+
+// Stages of running a command that are timed by BABYSH_TRACE
+enum traceStage {
+	TRACE_READ,
+	TRACE_PARSE,
+	TRACE_REDIRECT,
+	TRACE_SPAWN,
+	TRACE_EXEC,
+	TRACE_WAIT,
+	TRACE_STAGES
+};
+
+// Latency histograms of the stages. Each power of two nanoseconds is
+// split into eight buckets, so a reported percentile is within 12.5%.
+struct trace {
+	unsigned long counts[TRACE_STAGES][TRACE_BUCKETS];
+	unsigned long samples[TRACE_STAGES];    // Number of times timed
+	long long max[TRACE_STAGES];            // Longest time, in nanoseconds
+	int fd;                                 // Where the report is written
+	int cache;                              // What runCached() did
+};
+
+// Counters kept in shared memory by BABYSH_STATS, so that the stats
+// command of another shell can read them while this one runs. Counters
+// updated at different points of running a command are on different
+// cache lines. The shell only ever adds to them with relaxed atomics,
+// and a child started with fork() counts its own failure to exec.
+struct stats {
+	char magic[8];                  // STATS_MAGIC
+	unsigned int version;           // STATS_VERSION
+	pid_t pid;                      // The shell updating the counters
+	_Alignas(CACHE_LINE)
+	unsigned long long commands;    // Commands started by cmdExecute()
+	_Alignas(CACHE_LINE)
+	unsigned long long forks;       // Processes started
+	unsigned long long execFailures;        // Commands that could not exec
+	_Alignas(CACHE_LINE)
+	unsigned long long builtins;    // Built in commands run by the shell
+	_Alignas(CACHE_LINE)
+	unsigned long long jobsActive;  // Background jobs in the job table
+	unsigned long long jobsPeak;    // Most jobs at once
+	_Alignas(CACHE_LINE)
+	unsigned long long childUser;   // CPU time of waited for children, in
+	unsigned long long childSystem; // nanoseconds
+	_Alignas(CACHE_LINE)
+	unsigned long long latency[STATS_BUCKETS];      // Times from launch to
+	                                // exec, by their length in bits of ns
+};
+
+// How BABYSH_CACHE has a script run from its compiled form
+enum cacheMode {
+	CACHE_OFF,                      // Scripts are run a line at a time
+	CACHE_ON,                       // The compiled script is kept
+	CACHE_REFRESH                   // It is compiled again and replaced
+};
+
+// What runCached() did, for the trace report
+enum cacheResult {
+	CACHE_UNUSED,
+	CACHE_HIT,                      // The compiled script was run
+	CACHE_MISS,                     // It was compiled, but not saved
+	CACHE_SAVED,                    // It was compiled and saved
+	CACHE_FAILED                    // It was run a line at a time
+};
+
+// Words of the current line that were expanded, as they may be longer
+// than the input they replace, and the arguments of a line too long for
+// its command. The arena is emptied for every line. Its ARENA_SIZE bytes
+// are only address space until they are used, so the words never move.
+struct arena {
+	char *data;                     // ARENA_SIZE bytes, mapped once
+	size_t used;                    // Bytes holding finished words
+	size_t peak;                    // Most bytes used since last emptied
+};
+
+// Output of the command substitutions being run. The memory is kept for
+// the next substitution.
+struct capture {
+	char *data;
+	size_t size;                    // Bytes allocated for data
+	size_t length;                  // Bytes of output in data
+};
+
+// A directory listed by dirList(). The listing is found by offsets into
+// the names of struct dirCache, as the names move when they grow.
+struct cachedDir {
+	size_t path;                    // Offset of the path of the directory
+	size_t first;                   // Offset of its first name
+	size_t end;                     // Offset just past its last name
+};
+
+// Directories read while matching the patterns of the current line. The
+// names are emptied for every line, but keep their memory.
+struct dirCache {
+	char *names;                    // Paths and names, each ending in '\0'
+	size_t size;                    // Bytes allocated for names
+	size_t used;                    // Bytes holding listings
+	struct cachedDir dirs[DIR_CACHE_SIZE];
+	int count;                      // Number of directories listed
+};
+
+// Characters that end a run of ordinary characters, which parseInput()
+// copies at once, outside quotes and inside double or single quotes
+enum scanSet {
+	SCAN_PLAIN,
+	SCAN_DOUBLE,
+	SCAN_SINGLE,
+	SCAN_SETS
+};
+
+// How the runs are found, chosen by scanInit() for the CPU. Every kernel
+// ends a run at the same characters, '\0' being one of them in each set.
+struct scanner {
+	size_t (*run)(struct scanner *scan, const char *text, int set);
+	unsigned char classes[256];     // Bit 1 << set for each ending character
+	int counts[SCAN_SETS];          // Number of characters ending a run
+	_Alignas(32)
+	unsigned char stops[SCAN_SETS][SCAN_STOPS][16]; // Each one 16 times, for SSE2
+	_Alignas(32)
+	unsigned char nibbles[SCAN_SETS][2][32];        // Classes by low and high
+	                                // nibble, twice over, for AVX2
+};
+
+// How parseInput() treats the words of a line
+enum parseMode {
+	PARSE_LINE,                     // Words are expanded and globbed
+	PARSE_RAW,                      // Words are kept as written, to compile
+	PARSE_WORD,                     // A word of a compiled command, with
+	                                // the words before it kept in the arena
+	PARSE_TARGET                    // A redirection target, not globbed
+};
+
+// Lines compiled by runCompound(). Everything in data is found by its
+// offset rather than by a pointer, so the data may move as it grows, and
+// a whole compiled script can be saved and mapped again by runCached().
+struct script {
+	char *data;
+	size_t used;                    // Bytes holding nodes, from SCRIPT_START
+	size_t size;                    // Bytes allocated for data
+};
+
+// The start of a script saved by runCached(), which is only run again if
+// the script it was compiled from has not changed
+struct scriptHeader {
+	char magic[8];                  // SCRIPT_MAGIC
+	unsigned long long device;      // Where the script is
+	unsigned long long inode;
+	unsigned long long size;        // Size of the script
+	long long mtime;                // When the script was last changed
+	long long mtimeNsec;
+	unsigned long long used;        // Size of the compiled script
+	unsigned int first;             // Offset of the first node
+	unsigned int pad;
+	unsigned long long checksum;    // scriptChecksum() of the nodes
+};
+
+// Lines read from the terminal, kept in an append-only file that every
+// shell using it adds to. The file is mapped when the shell starts, but
+// its lines are only found once the history is read, and then only the
+// last ones, as many as the ring holds.
+struct history {
+	char *path;                     // History file, or NULL if history is off
+	int fd;                         // The file, opened for appending
+	char *data;                     // The file mapped read only, or NULL
+	size_t mapped;                  // Bytes of the file mapped
+	size_t indexed;                 // Bytes of the file looked through
+	size_t *offsets;                // Ring of the offsets of the lines kept
+	int size;                       // Number of lines the ring holds
+	int first;                      // Position of the oldest line in the ring
+	int count;                      // Number of lines in the ring
+	int record;                     // Whether the lines read are added
+};
+
+// State of the shell that is kept by main() and shared with the commands
+struct shell {
+	int status;                     // Returned status of process, if any
+	int termination;                // Termination value of process, if any
+	struct jobTable jobs;           // Background jobs that are running
+	struct pathHash hash;           // Locations of commands found on PATH
+	int useFork;                    // Start processes with fork() and exec()
+	int pipeSize;                   // Capacity of pipeline pipes, 0 if default
+	int childFd;                    // signalfd reporting SIGCHLD
+	struct inputBuffer input;       // Pending input from stdin or a script
+	int interactive;                // Whether a prompt is shown
+	struct outputBuffer output;     // Pending messages for stdout
+	struct parallelRun *parallel;   // The running parallel command, or NULL
+	struct rusage *usage;           // Totals for a timed command, or NULL
+	int timeJobs;                   // Report usage of every background job
+	int cache;                      // How a script uses the cache
+	struct trace *trace;            // Latencies of the shell, or NULL
+	struct stats *stats;            // Shared counters of the shell, or NULL
+	int statsOwned;                 // Whether stats is removed at exit
+	int execLast;                   // Whether the line is the last to run
+	int client;                     // Socket of the request being run, or -1
+	int clientJob;                  // Whether a job was started for it
+	int devNull;                    // "/dev/null", opened when first needed
+	struct arena arena;             // Expanded words of the current line
+	struct dirCache dirs;           // Directories read for the current line
+	struct capture capture;         // Output of command substitutions
+	int substituting;               // Depth of command substitutions run
+	int parseMode;                  // How parseInput() treats words
+	struct script script;           // Compound command being run
+	struct scanner scan;            // Finds the runs parseInput() copies
+	struct history history;         // Commands read from the terminal
+};
+
+// Kinds of redirection. The here-documents come last.
+enum redirectKind {
+	REDIRECT_INPUT,                 // "<", from the named file
+	REDIRECT_OUTPUT,                // ">", to the named file
+	REDIRECT_APPEND,                // ">>", to the end of the named file
+	REDIRECT_BOTH,                  // "&>", stdout and stderr to the file
+	REDIRECT_BOTH_APPEND,           // "&>>", to the end of the file
+	REDIRECT_DUP,                   // ">&" or "<&", a copy of a descriptor
+	HERE_DOC,                       // "<<", the lines up to a delimiter
+	HERE_DOC_TABS,                  // "<<-", with leading tabs removed
+	HERE_STRING                     // "<<<", a single word
+};
+
+// One redirection of a stage. Redirections are made in the order they
+// are written.
+struct redirect {
+	int kind;                       // How target is used
+	int fd;                         // Descriptor redirected, 0 to 9
+	char *target;                   // File name, descriptor number or
+	                                // "-", delimiter of a here-document,
+	                                // or the here-string
+	int hereFd;                     // Here-document contents, or -1
+	int quoted;                     // Whether the target was quoted or
+	                                // escaped
+};
+
+// One command of a pipeline, with its redirections
+struct stage {
+	char **argv;                    // Arguments, ending with NULL
+	struct redirect *redirects;     // First redirection of the stage
+	int redirectCount;              // Number of redirections
+};
+
+// A line of input parsed into a pipeline. The arguments of every stage
+// are stored one after the other in args, and the redirections of every
+// stage one after the other in redirects. The arguments are kept in
+// argSpace until there are more than it holds, and then in the arena.
+struct command {
+	char **args;
+	int argSize;                    // Number of entries args can hold
+	char *argSpace[INLINE_ARGS];
+	struct stage stages[MAX_STAGES];
+	struct redirect redirects[MAX_REDIRECTS];
+	int stageCount;                 // Number of stages, 0 for a blank line
+	int redirectCount;              // Redirections of every stage
+	int background;                 // 1 if the line ended with "&",
+	                                // RUN_PARALLEL for a parallel job, or
+	                                // RUN_REQUEST for a server request
+	int timed;                      // Whether the line began with "time"
+	struct placement *placement;    // Given by the prefixes, or NULL
+};
+
+// Where the processes of a command run and what they may use, given by
+// the prefixes pin, numa, limit and cgroup
+struct placement {
+	cpu_set_t cpus;                 // CPUs the processes run on
+	int pinned;                     // Whether cpus is used
+	int node;                       // NUMA node memory is taken from, or -1
+	struct {
+		int resource;           // RLIMIT_ value
+		rlim_t value;
+	} limits[MAX_LIMITS];           // At most one of each resource
+	int limitCount;
+	char *cgroup;                   // cgroup v2 group to join, or NULL
+};
+
+// The descriptors a process is started with, worked out by
+// planRedirects(). A replacement below REDIRECT_FDS is never itself
+// replaced, so the descriptors can be set up in any order.
+struct fdPlan {
+	int fds[REDIRECT_FDS];          // Replacement of each descriptor, or
+	                                // -1 to close it
+	unsigned int changed;           // Bit n set if descriptor n is replaced
+	int opened[MAX_REDIRECTS + REDIRECT_FDS];   // Opened for the plan
+	int openedCount;
+};
+
+// Description of a process to be started by launchProcess()
+struct launch {
+	char **argv;                    // Arguments, beginning with the command
+	char *path;                     // File to execute, NULL if not on PATH
+	struct fdPlan *plan;            // Descriptors to replace
+	struct placement *placement;    // Placement of the process, or NULL
+	int background;                 // Whether SIGINT stays ignored
+	pid_t group;                    // Group to join, 0 for a new one, or -1
+};
+
+// Kinds of the nodes of a compiled script
+enum nodeKind {
+	NODE_COMMAND,                   // first is a struct compiledCommand
+	NODE_IF,                        // first, second and third are the
+	                                // condition, then and else lists
+	NODE_WHILE,                     // first and second are the condition
+	                                // and the body
+	NODE_FOR                        // first is the name of the variable,
+	                                // second the body and third the words
+};
+
+// A node of a compiled script. The nodes of a list are chained through
+// next, and the members are offsets, with 0 for nothing.
+struct node {
+	int kind;
+	unsigned int next;
+	unsigned int first;
+	unsigned int second;
+	unsigned int third;
+};
+
+// A simple command of a compiled script. It is followed by the stages,
+// then the words of every stage, and then the redirections.
+struct compiledCommand {
+	int stageCount;
+	int wordCount;
+	int redirectCount;
+	int background;
+};
+
+struct compiledStage {
+	int wordCount;
+	int redirectCount;
+};
+
+struct compiledWord {
+	unsigned int text;              // Offset of the word
+	int expand;                     // Whether it is kept as written, to
+	                                // be expanded each time it runs
+};
+
+struct compiledRedirect {
+	int kind;
+	int fd;
+	unsigned int target;            // Offset of the target, as a word
+	int expand;
+	unsigned int body;              // Offset of a here-document, or 0
+	unsigned int bodyLength;
+};
+
+// State of compileList() while it reads the commands of a line, and of
+// the lines after it inside a compound command
+struct compiler {
+	struct shell *sh;
+	struct script *script;          // Where the nodes are added
+	char *line;                     // Copy of the line being compiled
+	char *rest;                     // Text after the last ";", or NULL
+	char *pending;                  // Command after a reserved word, or NULL
+	int depth;                      // Compound commands not yet ended
+	int readLines;                  // Whether more lines may be read
+	int whole;                      // Whether to read every line
+	int background;                 // Whether the command ended with "&"
+	int found;                      // Index of the reserved word that
+	                                // ended the last list
+	int error;                      // Whether an error was reported
+};
 
 // Function prototypes
-void getInput(char input[]);
-void parseInput(char input[], char *args[]);
-void processArgs(char *args[], int *status, int *termination, pid_t bgOpen[]);
-void cmdChangeDir(char *args[], int *status);
-void cmdStatus(int status, int termination);
-void cmdExit(pid_t bgOpen[]);
-void cmdExecute(char *args[], int *status, int *termination, pid_t bgOpen[]);
+char *getInput(struct shell *sh);
+void readSettings(struct shell *sh);
+int openInput(char *file, struct inputBuffer *in);
+void closeInput(struct inputBuffer *in);
+void reapBackground(struct shell *sh);
+int parseInput(char input[], struct command *cmd, struct shell *sh);
+void copyRun(char **next, char **out, int set, struct shell *sh);
+void scanInit(struct scanner *scan, char *choice);
+size_t scanNone(struct scanner *scan, const char *text, int set);
+size_t scanScalar(struct scanner *scan, const char *text, int set);
+size_t scanStart(struct scanner *scan, const char *text, int set);
+#ifdef __SSE2__
+size_t scanSse2(struct scanner *scan, const char *text, int set);
+size_t scanAvx2(struct scanner *scan, const char *text, int set);
+#endif
+int expandParameter(char **next, char **word, char **out, char **inPlace,
+	struct shell *sh);
+int keepExpansion(char **next, char **out, struct shell *sh);
+int arenaReserve(char **word, char **out, char **inPlace, size_t length, char *rest,
+	struct shell *sh);
+int arenaInit(struct shell *sh);
+char *arenaAlloc(size_t length, size_t align, struct shell *sh);
+void arenaReset(struct shell *sh);
+void argInit(struct command *cmd);
+int argAdd(struct command *cmd, int *position, char *word, struct shell *sh);
+int substituteCommand(char **next, char **word, char **out, char **inPlace,
+	struct shell *sh);
+char *fieldSplit(char *start, char *end);
+int fieldsAdd(char *word, char *end, int glob, int quoted, struct command *cmd,
+	int *position, struct shell *sh);
+char *substitutionEnd(char *text);
+int runSubstitution(char *text, struct shell *sh);
+int runSubshell(char *text, struct command *cmd, struct shell *sh);
+void captureRead(int fd, struct shell *sh);
+int captureGrow(struct capture *capture, size_t length);
+int globWord(char *word, struct command *cmd, int *position, struct shell *sh);
+int globWalk(char *path, size_t length, char *rest, struct command *cmd, int *position,
+	struct shell *sh);
+int globAdd(char *path, size_t length, struct command *cmd, int *position,
+	struct shell *sh);
+int globCompare(const void *a, const void *b);
+int isPattern(char *text, char *end);
+int dirList(char *path, struct shell *sh);
+int readHereDocs(struct command *cmd, int readLines, struct shell *sh);
+char *hereBody(struct redirect *redirect, size_t *length, struct shell *sh);
+char *hereExpand(char *body, size_t *length, struct shell *sh);
+int hereInput(char *data, size_t length);
+void closeHereDocs(struct command *cmd);
+int isCompound(char *line);
+void runCompound(char *line, struct script *script, int readLines, struct shell *sh);
+int runCached(char *file, struct shell *sh);
+int cachePath(char *path, size_t size, struct stat *fileInfo, int create);
+unsigned long long scriptChecksum(const char *data, size_t length);
+int compileScript(char *file, struct script *script, unsigned int *first,
+	struct shell *sh);
+void runScript(struct script *script, unsigned int first, struct shell *sh);
+unsigned int compileList(struct compiler *compiler, char **stops);
+unsigned int compileIf(struct compiler *compiler, char *rest);
+unsigned int compileWhile(struct compiler *compiler, char *rest);
+unsigned int compileFor(struct compiler *compiler, char *rest);
+int compileEnd(struct compiler *compiler, char *word);
+unsigned int compileNode(struct compiler *compiler, int kind, unsigned int first,
+	unsigned int second, unsigned int third);
+unsigned int compileCommand(struct compiler *compiler, char *text);
+int shellInput(struct stage *stage);
+unsigned int compileWord(struct compiler *compiler, char *word, int *expand);
+char *nextPiece(struct compiler *compiler);
+char *keywordRest(char *text, char *keyword);
+unsigned int scriptAdd(struct script *script, const void *data, size_t length,
+	size_t align);
+int runList(struct script *script, unsigned int offset, struct shell *sh);
+int runNode(struct script *script, struct node *node, struct shell *sh);
+int runCommand(struct script *script, unsigned int offset, struct shell *sh);
+char **loopWords(struct script *script, unsigned int offset, struct shell *sh);
+int buildCommand(struct script *script, unsigned int offset, struct command *cmd,
+	struct shell *sh);
+int expandWord(char *word, struct command *expanded, int mode, struct shell *sh);
+void processArgs(struct command *cmd, struct shell *sh);
+void cmdTime(struct command *cmd, struct shell *sh);
+void usageAdd(struct rusage *total, struct rusage *usage);
+void usageReport(struct shell *sh, struct timespec *start, struct rusage *usage);
+void cmdPlace(struct command *cmd, struct shell *sh);
+int isPrefix(char *word);
+void cmdAssign(char *args[], struct shell *sh);
+int isAssignment(char *word, char *end);
+int parseCpuList(char *text, cpu_set_t *cpus);
+int nodeCpus(int node, cpu_set_t *cpus);
+int parseLimit(char *text, struct placement *placement, struct shell *sh);
+int placeProcess(struct placement *placement, int all);
+int findBuiltin(char *name);
+void cmdChangeDir(char *args[], struct shell *sh);
+void cmdStatus(struct shell *sh);
+void cmdExit(struct shell *sh);
+void cmdHash(char *args[], struct shell *sh);
+void cmdExec(struct stage *stage, struct placement *placement, struct shell *sh);
+void cmdJobs(struct shell *sh);
+void cmdWait(char *args[], struct shell *sh);
+void cmdForeground(char *args[], struct shell *sh);
+void cmdBackground(char *args[], struct shell *sh);
+void cmdKill(char *args[], struct shell *sh);
+int signalNumber(char *name);
+void runServer(char *socketPath, struct shell *sh);
+void serveRequest(int client, int shellFds[], int shellDir, struct shell *sh);
+void sendReply(int client, int status, int termination, struct timespec *start,
+	struct rusage *usage, struct shell *sh);
+int runRemote(char *socketPath, char *command);
+void cmdParallel(char *args[], int inputFd, struct placement *placement,
+	struct shell *sh);
+void cmdBatch(char *args[], int inputFd, struct placement *placement,
+	struct shell *sh);
+int batchStart(char **command, int fixed, struct command *items, int first, int count,
+	long room, long most, struct placement *placement, struct shell *sh);
+void waitChildren(struct shell *sh);
+void cmdEcho(char *args[], struct shell *sh);
+void cmdPwd(struct shell *sh);
+void cmdTest(char *args[], struct shell *sh);
+int testOr(char *args[], int *position, int end, int *error, struct shell *sh);
+int testAnd(char *args[], int *position, int end, int *error, struct shell *sh);
+int testPrimary(char *args[], int *position, int end, int *error, struct shell *sh);
+int testCompareOp(char *op);
+void cmdPrintf(char *args[], struct shell *sh);
+long long printfNumber(char *value, struct shell *sh);
+void cmdExecute(struct command *cmd, struct shell *sh);
+int isStream(char *args[]);
+int runStream(char *args[], int fds[], struct shell *sh);
+int streamCat(char *args[], int fds[], struct shell *sh);
+int streamTee(char *args[], int fds[], struct shell *sh);
+int copyData(int from, int to);
+int drainPipe(int pipeFd, int to, size_t length, char *buffer);
+void planInit(struct fdPlan *plan);
+void planSet(struct fdPlan *plan, int fd, int replacement);
+int planRedirects(struct fdPlan *plan, struct stage *stage, struct shell *sh);
+void planClose(struct fdPlan *plan);
+int devNull(struct shell *sh);
+pid_t launchProcess(struct launch *job, struct shell *sh);
+void traceLaunched(struct shell *sh, pid_t cpid, long long start, int execPipe[]);
+long long traceClock(void);
+void traceRecord(struct trace *trace, int stage, long long start);
+long long traceBucketLimit(int bucket);
+void traceReport(struct shell *sh);
+void statsOpen(char *name, struct shell *sh);
+void statsPath(char *path, size_t size, char *name);
+void statsAdd(unsigned long long *counter, unsigned long long amount);
+void statsUsage(struct stats *stats, struct rusage *usage);
+void statsLatency(struct stats *stats, long long start);
+void cmdStats(char *args[], struct shell *sh);
+void historyOpen(char *file, int size, struct shell *sh);
+int historyReopen(struct history *history);
+int historyMap(struct history *history);
+int historyIndex(struct history *history);
+size_t historyStart(char *data, size_t size, int lines);
+void historyCompact(struct shell *sh);
+void historyAdd(char *line, struct shell *sh);
+void cmdHistory(char *args[], struct shell *sh);
+char *hashLookup(struct pathHash *hash, char *name);
+unsigned int hashBucket(char *name);
+void hashRemove(struct pathHash *hash, char *name);
+void hashClear(struct pathHash *hash);
 void catchInterrupt(int signo);
-int isInputRedirected(char *args[]);
-int isOutputRedirected(char *args[]);
-int isBackground(char *args[]);
-
-
-int main(void) {
-	char userInput[MAX_LINE_LENGTH + 1];
-	char *inputArgs[MAX_ARGS];
-	int i;
-	int termination = 0;            // Termination value of process, if any
-	int status = 0;                 // Returned status of process, if any
-	pid_t bgOpen[MAX_PROCESSES];    // Array of open background processes
-	int bgCounter = 0;              // Counter for background process array
-	int bgStatus;                   // Status of completed background process
+int jobAdd(struct jobTable *table, struct command *cmd);
+int jobAddProcess(struct jobTable *table, int slot, pid_t pid);
+int jobTakeProcess(struct jobTable *table, pid_t pid);
+int jobFindProcess(struct jobTable *table, pid_t pid);
+void jobRemove(struct jobTable *table, int slot);
+int jobFind(struct jobTable *table, char *spec);
+int jobWait(int stops, struct shell *sh);
+void jobSignal(struct jobTable *table, int signal);
+void jobStatus(int waitStatus, struct shell *sh);
+unsigned int jobIndexHash(pid_t pid, int bits);
+void outPrintf(struct shell *sh, const char *format, ...);
+void outWrite(struct shell *sh, const char *data, size_t length);
+char *outEscape(struct shell *sh, char *text, int zeroOctal, int *stop);
+void outFlush(struct shell *sh);
+void outSend(struct shell *sh, const char *data, size_t length);
+int writeAll(int fd, const char *data, size_t length);
+
+
+int main(int argc, char *argv[]) {
+	char *userInput;
+	char *lineCopy;                 // The line, if it has a here-document
+	struct command inputCommand;
+	struct shell sh;                // State shared with the commands
+	sigset_t childSignal;           // Signal set holding only SIGCHLD
+	long long started = 0;          // When a traced stage started
+
+	sh.status = 0;
+	sh.termination = 0;
+	memset(&sh.hash, 0, sizeof(sh.hash));
+	memset(&sh.input, 0, sizeof(sh.input));
+	sh.output.length = 0;
+	sh.output.fd = 1;
+	sh.parallel = NULL;
+	sh.usage = NULL;
+	sh.trace = NULL;
+	sh.stats = NULL;
+	sh.statsOwned = 0;
+	sh.execLast = 0;
+	sh.client = -1;
+	sh.devNull = -1;
+	sh.arena.data = NULL;
+	sh.arena.used = 0;
+	sh.arena.peak = 0;
+	memset(&sh.dirs, 0, sizeof(sh.dirs));
+	memset(&sh.capture, 0, sizeof(sh.capture));
+	sh.substituting = 0;
+	sh.parseMode = PARSE_LINE;
+	memset(&sh.script, 0, sizeof(sh.script));
+	memset(&sh.history, 0, sizeof(sh.history));
+	sh.history.fd = -1;
+
+	// Commands are read from the string given with -c, a script named
+	// on the command line, or else from stdin. The prompt is only shown
+	// to a terminal.
+	if (argc > 1 && argv[1][0] == '-' && (argc < 3 || strchr("crs", argv[1][1]) == NULL
+			|| argv[1][2] != '\0' || (argv[1][1] == 'r' && argc < 4))) {
+		outPrintf(&sh, "usage: babysh [-c command | -s socket | "
+			"-r socket command | script]\n");
+		outFlush(&sh);
+		exit(EXIT_FAILURE);
+	}
 
-	// Initialize bgOpen to contain non-valid process ids
-	for (i=0; i<MAX_PROCESSES; i++) {
-		bgOpen[i] = PROCESS_INVALID;
+	// Send the command to a server and exit with its status
+	if (argc > 1 && strcmp(argv[1], "-r") == 0)
+		exit(runRemote(argv[2], argv[3]));
+
+	if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+		sh.input.data = strdup(argv[2]);
+		sh.input.end = strlen(argv[2]);
+		sh.input.size = sh.input.end + 1;
+		sh.input.fd = -1;
+	}
+	else if (argc > 1 && strcmp(argv[1], "-s") != 0
+			&& openInput(argv[1], &sh.input) == -1) {
+		outPrintf(&sh, "File Error: cannot open %s for input\n", argv[1]);
+		outFlush(&sh);
+		exit(EXIT_FAILURE);
 	}
+	sh.interactive = (argc < 2 && isatty(0));
+
+	// Read the settings given in BABYSH_ environment variables
+	readSettings(&sh);
+
+	// Start with an empty table of background jobs
+	memset(&sh.jobs, 0, sizeof(sh.jobs));
+	sh.jobs.freeSlot = NO_JOB;
+	sh.jobs.stats = sh.stats;
 
 	// Set up a signal handler for main to ignore SIGINT. sigfillset()
 	// ensures that other signals will be blocked while this signal
@@ -63,564 +865,9942 @@ int main(void) {
 	act.sa_flags = 0;
 	sigfillset(&(act.sa_mask));
 
-	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGINT, &act, NULL);
+
+
+	// Block SIGCHLD so that finished children are reported through
+	// a signalfd, which getInput() waits on together with stdin
+	act.sa_handler = SIG_DFL;
+	sigaction(SIGCHLD, &act, NULL);
+	sigemptyset(&childSignal);
+	sigaddset(&childSignal, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childSignal, NULL);
+	sh.childFd = signalfd(-1, &childSignal, SFD_NONBLOCK|SFD_CLOEXEC);
+
+	if (sh.childFd == -1) {
+		perror("signalfd failed");
+		exit(EXIT_FAILURE);
+	}
+
+
+	// Run commands sent to a socket instead of reading them
+	if (argc > 1 && strcmp(argv[1], "-s") == 0)
+		runServer(argv[2], &sh);
+
+	// A script may be run from its compiled form instead
+	if (argc > 1 && argv[1][0] != '-' && sh.cache != CACHE_OFF
+			&& runCached(argv[1], &sh))
+		cmdExit(&sh);
+
+	// Show the command prompt until user enters "exit"
+	while (TRUE) {
+		// Report background processes that finished while the
+		// last command ran
+		reapBackground(&sh);
+
+		// Show command prompt
+		if (sh.interactive)
+			outPrintf(&sh, ": ");
+		outFlush(&sh);
+
+		// Get input from user, treating the end of input as "exit"
+		if (sh.trace != NULL)
+			started = traceClock();
+		if ((userInput = getInput(&sh)) == NULL)
+			cmdExit(&sh);
+		if (sh.trace != NULL)
+			traceRecord(sh.trace, TRACE_READ, started);
+
+		if (sh.history.record)
+			historyAdd(userInput, &sh);
+
+		// Compound commands and lists of commands are compiled first
+		if (isCompound(userInput)) {
+			runCompound(userInput, &sh.script, 1, &sh);
+			continue;
+		}
+
+		// A line with a here-document is parsed from a copy, as reading
+		// the lines of the document may move the input buffer
+		lineCopy = NULL;
+		if (strstr(userInput, "<<") != NULL && (lineCopy = strdup(userInput)))
+			userInput = lineCopy;
+
+		// Parse user input into a command, skipping lines with errors
+		if (sh.trace != NULL)
+			started = traceClock();
+		if (parseInput(userInput, &inputCommand, &sh) == -1
+				|| readHereDocs(&inputCommand, 1, &sh) == -1) {
+			sh.status = EXIT_FAILURE;
+			free(lineCopy);
+			continue;
+		}
+		if (sh.trace != NULL)
+			traceRecord(sh.trace, TRACE_PARSE, started);
+
+		// The last command of a script or of -c can replace the shell,
+		// unless there are background jobs for the shell to stop.
+		sh.execLast = sh.input.fd == -1 && sh.input.start >= sh.input.end
+			&& sh.jobs.indexCount == 0 && sh.trace == NULL && sh.stats == NULL;
+
+		// Process the command and attempt to execute it
+		processArgs(&inputCommand, &sh);
+		closeHereDocs(&inputCommand);
+		free(lineCopy);
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    getInput()
+ *
+ * Description: This function gets a line of input from the user and
+ *              removes any newline character. Input is read in large
+ *              blocks into the shell's input buffer, which grows to fit
+ *              a line of any length, and the lines are split in place.
+ *              When the shell is interactive, background processes are
+ *              reported as soon as they finish while waiting for input,
+ *              and the command prompt is shown again.
+ *
+ * Parameters:  sh - pointer to the shell state
+ *
+ * Returns:     The line, which stays valid until the next call, or NULL
+ *              at the end of input.
+ *
+ ************************************************************************/
+char *getInput(struct shell *sh) {
+	struct inputBuffer *in = &sh->input;
+	struct pollfd fds[2];
+	char *newline;
+	char *line;
+	char *grown;
+	size_t newSize;
+	ssize_t count;
+
+	fds[0].fd = in->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = sh->childFd;
+	fds[1].events = POLLIN;
+
+	// An empty buffer is not searched, as it may not be allocated yet
+	while (in->end == in->start || (newline = memchr(in->data + in->start, '\n',
+			in->end - in->start)) == NULL) {
+		if (in->mapped) {
+			// Copy a final line without a newline out of the mapping,
+			// so that it can be terminated
+			if (in->start == in->end)
+				return NULL;
+
+			newSize = in->end - in->start + 1;
+			grown = malloc(newSize);
+			if (grown == NULL)
+				return NULL;
+
+			memcpy(grown, in->data + in->start, newSize - 1);
+			munmap(in->data, in->end);
+			in->data = grown;
+			in->size = newSize;
+			in->end = newSize - 1;
+			in->start = 0;
+			in->mapped = 0;
+			in->fd = -1;
+		}
+
+		// Move the start of a partial line to the front of the buffer
+		if (in->start > 0) {
+			memmove(in->data, in->data + in->start, in->end - in->start);
+			in->end -= in->start;
+			in->start = 0;
+		}
+
+		// Grow the buffer, keeping room to terminate the line
+		if (in->end + 1 >= in->size) {
+			newSize = in->size ? in->size * 2 : INPUT_BLOCK;
+			grown = realloc(in->data, newSize);
+			if (grown == NULL)
+				return NULL;
+			in->data = grown;
+			in->size = newSize;
+		}
+
+		if (in->fd == -1) {
+			count = 0;
+		}
+		else {
+			if (sh->interactive) {
+				if (poll(fds, 2, -1) == -1) {
+					if (errno == EINTR)
+						continue;
+					perror("poll failed");
+					return NULL;
+				}
+
+				if (fds[1].revents & POLLIN) {
+					// Report finished background processes right away
+					outPrintf(sh, "\n");
+					reapBackground(sh);
+					outPrintf(sh, ": ");
+					outFlush(sh);
+				}
+
+				if (!(fds[0].revents & (POLLIN|POLLHUP|POLLERR)))
+					continue;
+			}
+
+			count = read(in->fd, in->data + in->end, in->size - in->end - 1);
+		}
+
+		if (count == -1 && errno == EINTR)
+			continue;
+
+		if (count <= 0) {
+			// At the end of input, a final line without a newline is
+			// still returned
+			in->fd = -1;
+			if (in->end == in->start)
+				return NULL;
+
+			newline = in->data + in->end;
+			in->end++;
+			break;
+		}
+
+		in->end += count;
+	}
+
+	// Terminate the line in place, leaving the rest of the buffer for
+	// later calls
+	*newline = '\0';
+	line = in->data + in->start;
+	in->start = newline + 1 - in->data;
+
+	return line;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    readSettings()
+ *
+ * Description: This function reads the settings of the shell from the
+ *              environment in a single pass, rather than searching the
+ *              environment once for each setting. BABYSH_SPAWN=fork
+ *              starts processes with fork(), BABYSH_PIPESIZE sets the
+ *              capacity of pipeline pipes, BABYSH_TIMEJOBS reports the
+ *              usage of every background job, BABYSH_TRACE names the
+ *              file the stage latencies are written to, or "-" for
+ *              stderr, BABYSH_STATS keeps counters in shared memory,
+ *              BABYSH_SCAN chooses how lines are scanned, BABYSH_HISTORY
+ *              names the history file, or "off", and BABYSH_HISTSIZE sets
+ *              how many lines of it are kept. A terminal session keeps
+ *              history in ~/.babysh_history unless told otherwise. The
+ *              shell exits if the trace cannot be set up.
+ *
+ * Parameters:  sh - pointer to the shell state
+ *
+ * Returns:     None. Members of sh are altered.
+ *
+ ************************************************************************/
+void readSettings(struct shell *sh) {
+	char **variable;
+	char *name;
+	char *value;
+	char *traceFile = NULL;
+	char *statsName = NULL;
+	char *scan = NULL;
+	char *historyFile = NULL;
+	int historySize = HISTORY_SIZE;
+
+	sh->useFork = 0;
+	sh->pipeSize = 0;
+	sh->timeJobs = 0;
+	sh->cache = CACHE_OFF;
+
+	for (variable = environ; *variable != NULL; variable++) {
+		if (strncmp(*variable, "BABYSH_", 7) != 0)
+			continue;
+
+		name = *variable + 7;
+		value = strchr(name, '=');
+		if (value == NULL)
+			continue;
+		value++;
+
+		if (strncmp(name, "SPAWN=", 6) == 0)
+			sh->useFork = (strcmp(value, "fork") == 0);
+		else if (strncmp(name, "PIPESIZE=", 9) == 0)
+			sh->pipeSize = atoi(value);
+		else if (strncmp(name, "TIMEJOBS=", 9) == 0)
+			sh->timeJobs = 1;
+		else if (strncmp(name, "CACHE=", 6) == 0)
+			sh->cache = (strcmp(value, "refresh") == 0) ? CACHE_REFRESH
+				: (strcmp(value, "on") == 0) ? CACHE_ON : CACHE_OFF;
+		else if (strncmp(name, "TRACE=", 6) == 0 && *value != '\0')
+			traceFile = value;
+		else if (strncmp(name, "STATS=", 6) == 0 && *value != '\0')
+			statsName = value;
+		else if (strncmp(name, "SCAN=", 5) == 0)
+			scan = value;
+		else if (strncmp(name, "HISTORY=", 8) == 0 && *value != '\0')
+			historyFile = value;
+		else if (strncmp(name, "HISTSIZE=", 9) == 0 && atoi(value) > 0)
+			historySize = atoi(value);
+	}
+
+	scanInit(&sh->scan, scan);
+
+	if (statsName != NULL)
+		statsOpen(statsName, sh);
+
+	// History is kept for a terminal, or wherever it is asked for
+	if (historyFile != NULL ? strcmp(historyFile, "off") != 0 : sh->interactive)
+		historyOpen(historyFile, historySize, sh);
+
+	if (traceFile == NULL)
+		return;
+
+	sh->trace = calloc(1, sizeof(*sh->trace));
+	if (sh->trace == NULL) {
+		perror("trace");
+		exit(EXIT_FAILURE);
+	}
+
+	sh->trace->fd = 2;
+	if (strcmp(traceFile, "-") != 0)
+		sh->trace->fd = open(traceFile, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+
+	if (sh->trace->fd == -1) {
+		outPrintf(sh, "File Error: cannot open %s for ouput\n", traceFile);
+		outFlush(sh);
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    openInput()
+ *
+ * Description: This function sets up an input buffer to read lines from
+ *              a file, such as a script, instead of stdin. A regular
+ *              file is mapped into memory with private, writable pages
+ *              so that lines can be split in place without reading the
+ *              file. Any other file is read in blocks.
+ *
+ * Parameters:  file - the name of the file
+ *              in - pointer to an empty input buffer
+ *
+ * Returns:     0 on success, or -1 if the file cannot be opened.
+ *
+ ************************************************************************/
+int openInput(char *file, struct inputBuffer *in) {
+	struct stat fileInfo;
+	void *map;
+
+	in->fd = open(file, O_RDONLY|O_CLOEXEC);
+
+	if (in->fd == -1)
+		return -1;
+
+	if (fstat(in->fd, &fileInfo) == -1 || !S_ISREG(fileInfo.st_mode)
+			|| fileInfo.st_size == 0)
+		return 0;
+
+	map = mmap(NULL, fileInfo.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+		in->fd, 0);
+	if (map == MAP_FAILED)
+		return 0;
+
+	close(in->fd);
+	in->fd = -1;
+	in->data = map;
+	in->end = fileInfo.st_size;
+	in->mapped = 1;
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    closeInput()
+ *
+ * Description: This function releases an input buffer set up by
+ *              openInput(), closing its file and freeing or unmapping
+ *              its data.
+ *
+ * Parameters:  in - pointer to the input buffer
+ *
+ * Returns:     None.
+ *
+ ************************************************************************/
+void closeInput(struct inputBuffer *in) {
+	if (in->mapped)
+		munmap(in->data, in->end);
+	else
+		free(in->data);
+
+	if (in->fd != -1)
+		close(in->fd);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    runServer()
+ *
+ * Description: This function runs the shell as a server, which saves
+ *              the cost of starting a shell for every command. Clients
+ *              connect to a UNIX socket and send one request each: the
+ *              command line, the directory to run it in, and the
+ *              environment, with the descriptors for stdin, stdout, and
+ *              stderr passed along as SCM_RIGHTS. Requests run at the
+ *              same time as jobs in the job table, and each client is
+ *              sent the result when its job is done. A socket left behind
+ *              by an earlier server is replaced, but any other file at
+ *              the path is left alone. A client that sends nothing is
+ *              dropped after REQUEST_TIMEOUT milliseconds, so that it
+ *              cannot hold up the others. This function does not return.
+ *
+ * Parameters:  socketPath - the name of the socket to listen on
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None.
+ *
+ ************************************************************************/
+void runServer(char *socketPath, struct shell *sh) {
+	struct sockaddr_un address;
+	struct pollfd fds[2];
+	struct stat pathInfo;
+	struct timeval timeout = { REQUEST_TIMEOUT / 1000, (REQUEST_TIMEOUT % 1000) * 1000 };
+	int shellFds[3];                // The shell's stdin, stdout and stderr
+	int shellDir;                   // The shell's working directory
+	int listener;
+	int client;
+	int fd;
+
+	if (strlen(socketPath) >= sizeof(address.sun_path)) {
+		outPrintf(sh, "babysh: %s: socket name too long\n", socketPath);
+		outFlush(sh);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socketPath);
+
+	// Replace the socket left behind by an earlier server
+	if (lstat(socketPath, &pathInfo) == 0) {
+		if (!S_ISSOCK(pathInfo.st_mode)) {
+			outPrintf(sh, "babysh: %s: exists and is not a socket\n", socketPath);
+			outFlush(sh);
+			exit(EXIT_FAILURE);
+		}
+		unlink(socketPath);
+	}
+	listener = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+	if (listener == -1 || bind(listener, (struct sockaddr *) &address,
+			sizeof(address)) == -1 || listen(listener, SOMAXCONN) == -1) {
+		perror("server failed");
+		exit(EXIT_FAILURE);
+	}
+
+	// Keep what each request changes, so that it can be put back
+	for (fd = 0; fd < 3; fd++)
+		shellFds[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+	shellDir = open(".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+	fds[0].fd = listener;
+	fds[0].events = POLLIN;
+	fds[1].fd = sh->childFd;
+	fds[1].events = POLLIN;
+
+	while (TRUE) {
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("poll failed");
+			exit(EXIT_FAILURE);
+		}
+
+		// Reply to the clients whose jobs are done
+		if (fds[1].revents & POLLIN)
+			reapBackground(sh);
+
+		if (fds[0].revents & POLLIN) {
+			client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+			if (client != -1) {
+				setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+				serveRequest(client, shellFds, shellDir, sh);
+			}
+		}
+
+		outFlush(sh);
+	}
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    serveRequest()
+ *
+ * Description: This function receives a request from a client of the
+ *              server and runs it with processArgs(), using the client's
+ *              descriptors as stdin, stdout, and stderr and its
+ *              directory and environment. A command that is started as
+ *              a job replies when it is done. A built in command, or one
+ *              that could not be started, replies right away. The exit
+ *              and exec commands would end the server and are refused,
+ *              and a request has no lines for a here-document, though it
+ *              may have a here-string.
+ *
+ * Parameters:  client - the connection to the client
+ *              shellFds - copies of the shell's stdin, stdout and stderr
+ *              shellDir - the shell's working directory
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status, termination, and jobs members of sh may
+ *              be altered.
+ *
+ ************************************************************************/
+void serveRequest(int client, int shellFds[], int shellDir, struct shell *sh) {
+	union {
+		char data[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} controlData;                  // Space for the passed descriptors
+	struct command request;
+	struct msghdr message;
+	struct iovec part;
+	struct cmsghdr *control;
+	struct timespec start;
+	struct rusage none;
+	char **shellEnv = environ;
+	char **requestEnv;
+	char *text;
+	char *directory;
+	char *end;
+	char *next;
+	ssize_t length;
+	int fds[3] = { -1, -1, -1 };    // The client's stdin, stdout and stderr
+	int used = 0;                   // Descriptors kept in fds
+	int count;
+	int position;
+	int fd;
+	int builtin;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	sh->status = EXIT_FAILURE;
+	sh->termination = 0;
+	sh->clientJob = 0;
+
+	// Find the size of the request, then receive it with the descriptors
+	length = recv(client, NULL, 0, MSG_PEEK|MSG_TRUNC);
+	text = (length > 0) ? malloc(length + 1) : NULL;
+	if (text == NULL) {
+		close(client);
+		return;
+	}
+
+	part.iov_base = text;
+	part.iov_len = length;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &part;
+	message.msg_iovlen = 1;
+	message.msg_control = controlData.data;
+	message.msg_controllen = sizeof(controlData.data);
+
+	length = recvmsg(client, &message, MSG_CMSG_CLOEXEC);
+	if (length <= 0) {
+		free(text);
+		close(client);
+		return;
+	}
+	text[length] = '\0';
+
+	// Only the first three descriptors are kept, and any others a client
+	// sent are closed, so that it cannot use up the server's. A request
+	// whose descriptors did not all fit is refused.
+	for (control = CMSG_FIRSTHDR(&message); control != NULL;
+			control = CMSG_NXTHDR(&message, control)) {
+		if (control->cmsg_level != SOL_SOCKET || control->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		count = (control->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (position = 0; position < count; position++) {
+			memcpy(&fd, CMSG_DATA(control) + position * sizeof(int), sizeof(int));
+			if (used < 3 && !(message.msg_flags & MSG_CTRUNC))
+				fds[used++] = fd;
+			else
+				close(fd);
+		}
+	}
+
+	if (message.msg_flags & MSG_CTRUNC) {
+		free(text);
+		close(client);
+		return;
+	}
+
+	// The command line is followed by the directory and then by the
+	// variables of the environment, each ending with a null
+	end = text + length;
+	directory = text + strlen(text) + 1;
+	count = 1;
+	for (next = directory; next < end; next += strlen(next) + 1)
+		count++;
+
+	requestEnv = malloc(count * sizeof(*requestEnv));
+	if (requestEnv == NULL) {
+		for (fd = 0; fd < used; fd++)
+			close(fds[fd]);
+		free(text);
+		close(client);
+		return;
+	}
+
+	count = 0;
+	for (next = directory; next < end; next += strlen(next) + 1) {
+		if (next > directory)
+			requestEnv[count++] = next;
+	}
+	requestEnv[count] = NULL;
+
+	// Take on the client's descriptors, directory and environment
+	outFlush(sh);
+	for (fd = 0; fd < 3; fd++) {
+		if (fds[fd] != -1) {
+			dup2(fds[fd], fd);
+			close(fds[fd]);
+		}
+	}
+	environ = requestEnv;
+
+	if (directory < end && *directory != '\0' && chdir(directory) == -1) {
+		outPrintf(sh, "cd: %s: No such file or directory\n", directory);
+	}
+	else if (parseInput(text, &request, sh) != -1
+			&& readHereDocs(&request, 0, sh) != -1) {
+		builtin = (request.stageCount == 1)
+			? findBuiltin(request.stages[0].argv[0]) : BUILTIN_NONE;
+
+		if (builtin == BUILTIN_EXIT || builtin == BUILTIN_EXEC) {
+			outPrintf(sh, "%s: not allowed in a server request\n",
+				request.stages[0].argv[0]);
+		}
+		else {
+			sh->status = EXIT_SUCCESS;
+			request.background = RUN_REQUEST;
+			sh->client = client;
+			processArgs(&request, sh);
+			sh->client = -1;
+		}
+		closeHereDocs(&request);
+	}
+
+	// Put back the shell's own descriptors, directory and environment
+	outFlush(sh);
+	environ = shellEnv;
+	fchdir(shellDir);
+	for (fd = 0; fd < 3; fd++) {
+		if (fds[fd] != -1)
+			dup2(shellFds[fd], fd);
+	}
+
+	if (!sh->clientJob) {
+		memset(&none, 0, sizeof(none));
+		sendReply(client, sh->status, sh->termination, &start, &none, sh);
+	}
+
+	free(requestEnv);
+	free(text);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    sendReply()
+ *
+ * Description: This function sends the result of a request to a client
+ *              of the server and closes the connection. The reply is a
+ *              single line holding the exit value or terminating signal,
+ *              in the form reported for background processes, followed
+ *              by the time and resources used.
+ *
+ * Parameters:  client - the connection to the client
+ *              status - the exit value of the command
+ *              termination - the terminating signal, or 0
+ *              start - when the request was received
+ *              usage - pointer to the resources used by the command
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None.
+ *
+ ************************************************************************/
+void sendReply(int client, int status, int termination, struct timespec *start,
+		struct rusage *usage, struct shell *sh) {
+	// Messages for stdout are written first, so the reply is
+	// formatted alone in the output buffer
+	outFlush(sh);
+
+	if (termination)
+		outPrintf(sh, "terminated by signal %d, ", termination);
+	else
+		outPrintf(sh, "exit value %d, ", status);
+	usageReport(sh, start, usage);
+	outPrintf(sh, "\n");
+
+	// A client that has gone away must not raise SIGPIPE
+	send(client, sh->output.data, sh->output.length, MSG_NOSIGNAL);
+	sh->output.length = 0;
+	close(client);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    runRemote()
+ *
+ * Description: This function sends a command to a shell running as a
+ *              server, along with the current directory, environment,
+ *              and stdin, stdout, and stderr, and waits for the result.
+ *
+ * Parameters:  socketPath - the name of the server's socket
+ *              command - the command line to run
+ *
+ * Returns:     The exit value of the command, 128 plus the signal that
+ *              terminated it, or 1 if the server could not be reached.
+ *
+ ************************************************************************/
+int runRemote(char *socketPath, char *command) {
+	union {
+		char data[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} controlData;                  // Space for the passed descriptors
+	struct sockaddr_un address;
+	struct msghdr message;
+	struct iovec part;
+	struct cmsghdr *control;
+	int fds[3] = { 0, 1, 2 };
+	char directory[PATH_MAX];
+	char reply[256];
+	char **variable;
+	char *request;
+	char *end;
+	size_t length;
+	ssize_t count;
+	int server;
+
+	if (getcwd(directory, sizeof(directory)) == NULL)
+		directory[0] = '\0';
+
+	// Lay out the command, directory and environment one after another
+	length = strlen(command) + strlen(directory) + 2;
+	for (variable = environ; *variable != NULL; variable++)
+		length += strlen(*variable) + 1;
+
+	request = malloc(length);
+	if (request == NULL) {
+		perror("request");
+		return EXIT_FAILURE;
+	}
+
+	end = stpcpy(request, command) + 1;
+	end = stpcpy(end, directory) + 1;
+	for (variable = environ; *variable != NULL; variable++)
+		end = stpcpy(end, *variable) + 1;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+
+	server = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+	if (server == -1 || connect(server, (struct sockaddr *) &address,
+			sizeof(address)) == -1) {
+		perror(socketPath);
+		return EXIT_FAILURE;
+	}
+
+	part.iov_base = request;
+	part.iov_len = length;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &part;
+	message.msg_iovlen = 1;
+	message.msg_control = controlData.data;
+	message.msg_controllen = sizeof(controlData.data);
+
+	control = CMSG_FIRSTHDR(&message);
+	control->cmsg_level = SOL_SOCKET;
+	control->cmsg_type = SCM_RIGHTS;
+	control->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(control), fds, sizeof(fds));
+
+	if (sendmsg(server, &message, 0) == -1) {
+		perror("send request");
+		return EXIT_FAILURE;
+	}
+
+	while ((count = recv(server, reply, sizeof(reply) - 1, 0)) == -1
+			&& errno == EINTR)
+		continue;
+
+	if (count <= 0)
+		return EXIT_FAILURE;
+	reply[count] = '\0';
+
+	if (strncmp(reply, "exit value ", 11) == 0)
+		return atoi(reply + 11);
+	if (strncmp(reply, "terminated by signal ", 21) == 0)
+		return 128 + atoi(reply + 21);
+	return EXIT_FAILURE;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    reapBackground()
+ *
+ * Description: This function reports every background process that has
+ *              finished. Nothing is done unless SIGCHLD has been
+ *              received through the signalfd, so the check costs a
+ *              single read() no matter how many processes are running.
+ *              Each finished process is collected with waitpid() and
+ *              removed from the job table, and a job is reported once
+ *              all of its processes are done. Jobs started by parallel
+ *              are counted in its summary instead of being reported, and
+ *              a server request sends its result to the client. A job
+ *              waited for gives its status to the wait instead, and one
+ *              that is stopped or continued is marked so in its slot.
+ *
+ * Parameters:  sh - pointer to the shell state
+ *
+ * Returns:     None. jobs member of sh may be altered.
+ *
+ ************************************************************************/
+void reapBackground(struct shell *sh) {
+	struct signalfd_siginfo info;
+	struct rusage usage;            // Resources used by the process
+	int bgStatus;                   // Status of completed background process
+	struct job *job;
+	int slot;
+	pid_t wpid;
+
+	// SIGCHLD is only queued once, however many children finished
+	if (read(sh->childFd, &info, sizeof(info)) != sizeof(info))
+		return;
+
+	while ((wpid = wait4(-1, &bgStatus, WNOHANG|WUNTRACED|WCONTINUED, &usage)) > 0) {
+		// A stopped process stays in its job
+		if (WIFSTOPPED(bgStatus) || WIFCONTINUED(bgStatus)) {
+			slot = jobFindProcess(&sh->jobs, wpid);
+			if (slot == NO_JOB)
+				continue;
+
+			job = &sh->jobs.jobs[slot];
+			job->stopped = WIFSTOPPED(bgStatus);
+			if (!job->stopped || job->group == 0)
+				continue;
+
+			if (sh->jobs.watchStops && sh->jobs.watchPid == job->pid) {
+				sh->jobs.watchStatus = bgStatus;
+				sh->jobs.watchPid = 0;
+			}
+			else {
+				outPrintf(sh, "background pid %d is stopped by signal %d\n",
+					job->pid, WSTOPSIG(bgStatus));
+			}
+			continue;
+		}
+
+		if (sh->stats != NULL)
+			statsUsage(sh->stats, &usage);
+
+		slot = jobTakeProcess(&sh->jobs, wpid);
+		if (slot == NO_JOB)
+			continue;
+
+		job = &sh->jobs.jobs[slot];
+		if (wpid == job->pid)
+			job->waitStatus = bgStatus;
+		usageAdd(&job->usage, &usage);
+
+		// Wait for the rest of a pipeline's processes
+		if (--job->processes > 0)
+			continue;
+
+		// The job has completed
+		bgStatus = job->waitStatus;
+		if (job->parallel && sh->parallel != NULL) {
+			sh->parallel->running--;
+			if (WIFEXITED(bgStatus) && WEXITSTATUS(bgStatus) == 0)
+				sh->parallel->succeeded++;
+			else if (WIFEXITED(bgStatus))
+				sh->parallel->failed++;
+			else
+				sh->parallel->signaled++;
+
+			// Stop starting jobs once the user interrupts one
+			if (WIFSIGNALED(bgStatus) && WTERMSIG(bgStatus) == SIGINT)
+				sh->parallel->interrupted = 1;
+
+			// A timed parallel command includes the usage of its jobs
+			if (sh->usage != NULL)
+				usageAdd(sh->usage, &job->usage);
+
+			jobRemove(&sh->jobs, slot);
+			continue;
+		}
+
+		if (job->client != -1) {
+			// Reply to the client whose request this was
+			sendReply(job->client, WIFEXITED(bgStatus) ? WEXITSTATUS(bgStatus) : 0,
+				WIFSIGNALED(bgStatus) ? WTERMSIG(bgStatus) : 0, &job->start,
+				&job->usage, sh);
+			jobRemove(&sh->jobs, slot);
+			continue;
+		}
+
+		if (sh->jobs.watchPid == job->pid || sh->jobs.watchPid == -1) {
+			sh->jobs.watchStatus = bgStatus;
+			sh->jobs.watchPid = 0;
+			jobRemove(&sh->jobs, slot);
+			continue;
+		}
+
+		outPrintf(sh, "background pid %d is done: ", job->pid);
+
+		// Print exit value of process
+		if (WIFEXITED(bgStatus)) {
+			outPrintf(sh, "exit value %d", WEXITSTATUS(bgStatus));
+		}
+
+		// Print termination if background process is terminated.
+		if (WIFSIGNALED(bgStatus)) {
+			outPrintf(sh, "terminated by signal %d", WTERMSIG(bgStatus));
+		}
+
+		if (job->timed) {
+			outPrintf(sh, ", ");
+			usageReport(sh, &job->start, &job->usage);
+		}
+		outPrintf(sh, "\n");
+
+		jobRemove(&sh->jobs, slot);
+	}
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    parseInput()
+ *
+ * Description:	This function evaluates a line of user input and parses
+ *              it into a command in a single pass. Words are separated
+ *              by spaces or tabs. The operators "|" and "&" and the
+ *              redirections "<", ">", ">>", "&>", "&>>", ">&", "<&" and
+ *              the here-documents are recognized with or without spaces
+ *              around them. A single digit written just before a
+ *              redirection names the descriptor redirected. A word
+ *              beginning with '#' starts a comment that runs to the end
+ *              of the line. Single quotes keep everything up to the next
+ *              single quote, double quotes keep everything except that a
+ *              backslash may escape '"', '\' or '$', and outside quotes a
+ *              backslash escapes any character. Parameters are expanded
+ *              outside single quotes, and the value of an unquoted one
+ *              stays a single word, which is removed if it is empty.
+ *              A command substitution "$(...)" is expanded the same way.
+ *              An argument with an unquoted "*", "?" or "[" is expanded
+ *              into the paths it matches, unless it also has one quoted.
+ *              Quotes are removed in place, so the arguments point into
+ *              input, or into the arena of the shell for words that had
+ *              a parameter expanded. After each character of a word the
+ *              ordinary characters that follow it are found and copied
+ *              together by copyRun().
+ *
+ * Parameters:  input - a char array
+ *              cmd - pointer to a command
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0 on success, or -1 after printing a message if the line
+ *              has a syntax error. input and cmd parameters are altered.
+ *
+ ************************************************************************/
+int parseInput(char input[], struct command *cmd, struct shell *sh) {
+	char *next = input;             // Next character to examine
+	char *out = input;              // Where the word's next character goes
+	char *word = NULL;              // Start of the word being built
+	char *inPlace = NULL;           // Where out goes back to after a word
+	                                // built in the arena
+	char **target = NULL;           // Redirection waiting for a file name
+	struct stage *stage = cmd->stages;
+	struct redirect *redirect;
+	char tokenName[2] = "";
+	int position = 0;
+	int plain = 0;                  // Whether the word has no quoting
+	int quoted = 0;                 // Whether the word has quotes
+	int pattern = 0;                // Whether it has an unquoted "*?["
+	int literal = 0;                // Whether it has a quoted one
+	int fields = 0;                 // Whether it was split into fields
+	int fd = -1;                    // Descriptor named before a redirection
+	ssize_t split;                  // Where the output to split begins
+	char *end;
+	int raw = (sh->parseMode == PARSE_RAW);
+	int result;
+	char quote = 0;
+	char c;
+
+	// The words of a line being run are kept while a command
+	// substitution in it, or a later word of a compiled command, is
+	// parsed
+	if (sh->substituting == 0 && sh->parseMode <= PARSE_RAW)
+		arenaReset(sh);
+	argInit(cmd);
+	cmd->stageCount = 0;
+	cmd->redirectCount = 0;
+	cmd->background = 0;
+	cmd->timed = 0;
+	cmd->placement = NULL;
+	stage->argv = cmd->args;
+	stage->redirects = cmd->redirects;
+	stage->redirectCount = 0;
+
+	for (;;) {
+		c = *next++;
+
+		if (quote) {
+			// Inside quotes every character belongs to the word
+			if (c == '\0') {
+				outPrintf(sh, "syntax error: unterminated quote\n");
+				return -1;
+			}
+
+			if (c == quote) {
+				quote = 0;
+				if (raw)
+					*out++ = c;
+				continue;
+			}
+
+			if (quote == '"' && c == '$' && raw) {
+				if (keepExpansion(&next, &out, sh) == -1)
+					return -1;
+				continue;
+			}
+
+			if (quote == '"' && c == '$'
+					&& (result = expandParameter(&next, &word, &out, &inPlace, sh))) {
+				if (result == -1)
+					return -1;
+				continue;
+			}
+
+			if (quote == '"' && c == '\\'
+					&& (*next == '"' || *next == '\\' || *next == '$')) {
+				if (raw)
+					*out++ = c;
+				c = *next++;
+			}
+
+			if (c == '*' || c == '?' || c == '[')
+				literal = 1;
+
+			*out++ = c;
+			copyRun(&next, &out, (quote == '"') ? SCAN_DOUBLE : SCAN_SINGLE, sh);
+			continue;
+		}
+
+		if (c != '\0' && strchr(" \t<>|&", c) == NULL) {
+			if (word == NULL && c == '#') {
+				// A comment runs to the end of the line
+				c = '\0';
+			}
+			else {
+				if (word == NULL) {
+					// Only the end of the line may follow "&"
+					if (cmd->background)
+						break;
+					word = out;
+					plain = 1;
+					quoted = 0;
+					pattern = 0;
+					literal = 0;
+					fields = 0;
+				}
+
+				if (c == '$' && raw) {
+					if (keepExpansion(&next, &out, sh) == -1)
+						return -1;
+					plain = 0;
+					continue;
+				}
+
+				// The output of a command substitution is split into
+				// fields, but not as the value of an assignment or as
+				// the target of a redirection
+				split = (c == '$' && *next == '(' && target == NULL
+					&& sh->parseMode != PARSE_TARGET
+					&& !(stage->argv == &cmd->args[position] && isAssignment(word, out)))
+					? out - word : -1;
+
+				if (c == '$'
+						&& (result = expandParameter(&next, &word, &out, &inPlace, sh))) {
+					if (result == -1)
+						return -1;
+					if (split != -1) {
+						out = fieldSplit(word + split, out);
+						fields = 1;
+					}
+					plain = 0;
+					continue;
+				}
+
+				if (c == '\'' || c == '"') {
+					quote = c;
+					plain = 0;
+					quoted = 1;
+					if (raw)
+						*out++ = c;
+					continue;
+				}
+
+				if (c == '\\' && *next != '\0') {
+					if (raw)
+						*out++ = c;
+					c = *next++;
+					plain = 0;
+					if (c == '*' || c == '?' || c == '[')
+						literal = 1;
+				}
+				else if (c == '*' || c == '?' || c == '[') {
+					pattern = 1;
+				}
+
+				*out++ = c;
+				copyRun(&next, &out, SCAN_PLAIN, sh);
+				continue;
+			}
+		}
+
+		// A separator, an operator, or the end of the line ends the word
+		if (word != NULL) {
+			*out++ = '\0';
+			end = out;
+
+			// The following words are built in place again
+			if (inPlace != NULL) {
+				sh->arena.used = out - sh->arena.data;
+				out = inPlace;
+				inPlace = NULL;
+			}
+
+			if (fields) {
+				if (fieldsAdd(word, end, pattern && !literal, quoted, cmd, &position, sh) == -1)
+					return -1;
+			}
+			else if (*word == '\0' && !quoted) {
+				// An unquoted parameter with an empty value is no word
+			}
+			else if (target == NULL && plain && (c == '<' || c == '>')
+					&& word[0] >= '0' && word[0] <= '9' && word[1] == '\0') {
+				fd = word[0] - '0';
+			}
+			else if (target != NULL) {
+				*target = word;
+				cmd->redirects[cmd->redirectCount - 1].quoted = !plain;
+				target = NULL;
+			}
+			else if (pattern && !literal && (sh->parseMode == PARSE_LINE
+					|| sh->parseMode == PARSE_WORD)) {
+				if (globWord(word, cmd, &position, sh) == -1)
+					return -1;
+			}
+			else if (argAdd(cmd, &position, word, sh) == -1) {
+				return -1;
+			}
+			word = NULL;
+		}
+
+		if (c == ' ' || c == '\t')
+			continue;
+
+		// A redirection must be followed by its file name, and only
+		// the end of the line may follow "&"
+		if (target != NULL || (cmd->background && c != '\0'))
+			break;
+
+		if (c == '<' || c == '>' || (c == '&' && *next == '>')) {
+			if (cmd->redirectCount == MAX_REDIRECTS) {
+				outPrintf(sh, "too many redirections\n");
+				return -1;
+			}
+
+			redirect = &cmd->redirects[cmd->redirectCount++];
+			stage->redirectCount++;
+			redirect->fd = (fd != -1) ? fd : (c == '<') ? 0 : 1;
+			redirect->hereFd = -1;
+			redirect->quoted = 0;
+			fd = -1;
+
+			if (c == '<') {
+				// "<<" begins a here-document, "<<-" one with its
+				// leading tabs removed, and "<<<" a here-string
+				redirect->kind = REDIRECT_INPUT;
+				if (*next == '<') {
+					next++;
+					redirect->kind = HERE_DOC;
+					if (*next == '<') {
+						next++;
+						redirect->kind = HERE_STRING;
+					}
+					else if (*next == '-') {
+						next++;
+						redirect->kind = HERE_DOC_TABS;
+					}
+				}
+				else if (*next == '&') {
+					next++;
+					redirect->kind = REDIRECT_DUP;
+				}
+			}
+			else if (c == '>') {
+				redirect->kind = REDIRECT_OUTPUT;
+				if (*next == '>') {
+					next++;
+					redirect->kind = REDIRECT_APPEND;
+				}
+				else if (*next == '&') {
+					next++;
+					redirect->kind = REDIRECT_DUP;
+				}
+			}
+			else {
+				// "&>" sends both stdout and stderr to the file
+				next++;
+				redirect->kind = REDIRECT_BOTH;
+				if (*next == '>') {
+					next++;
+					redirect->kind = REDIRECT_BOTH_APPEND;
+				}
+			}
+			target = &redirect->target;
+		}
+		else if (c == '&') {
+			cmd->background = 1;
+		}
+		else {
+			// End the arguments of the current stage. A stage with no
+			// command is only allowed on a blank line.
+			if (stage->argv == &cmd->args[position]) {
+				if (c == '\0' && cmd->stageCount == 0 && !cmd->background
+						&& stage->redirectCount == 0)
+					return 0;
+				break;
+			}
+
+			cmd->args[position++] = NULL;
+			cmd->stageCount++;
+
+			if (c == '\0')
+				return 0;
+
+			if (cmd->stageCount == MAX_STAGES) {
+				outPrintf(sh, "too many pipeline stages (max %d)\n", MAX_STAGES);
+				return -1;
+			}
+
+			stage++;
+			stage->argv = &cmd->args[position];
+			stage->redirects = &cmd->redirects[cmd->redirectCount];
+			stage->redirectCount = 0;
+		}
+	}
+
+	// Only reached on a syntax error, with c the unexpected token
+	tokenName[0] = c;
+	outPrintf(sh, "syntax error near unexpected token `%s'\n",
+		c ? tokenName : "newline");
+	return -1;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    copyRun()
+ *
+ * Description: This function copies the run of ordinary characters at
+ *              the next character of a line to the word being built by
+ *              parseInput(). The run ends before the first character of
+ *              the set that has a meaning of its own, which is left for
+ *              parseInput() to handle one character at a time.
+ *
+ * Parameters:  next - pointer to the next character of the line
+ *              out - pointer to where the next character of the word goes
+ *              set - the scanSet for where the run is in the line
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. next and out are moved past the run.
+ *
+ ************************************************************************/
+void copyRun(char **next, char **out, int set, struct shell *sh) {
+	size_t run = sh->scan.run(&sh->scan, *next, set);
+
+	// A word with nothing removed from it yet is already in place
+	if (*out != *next)
+		memmove(*out, *next, run);
+	*out += run;
+	*next += run;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    scanInit()
+ *
+ * Description: This function builds the tables of the characters that
+ *              end a run in each set, and chooses the kernel that finds
+ *              runs. AVX2 is used when the CPU has it, and otherwise a
+ *              byte at a time scan of a table. SSE2, which every x86-64
+ *              CPU has, compares the bytes with each character of the
+ *              set in turn, and only beats the table on runs of hundreds
+ *              of bytes, so it is only used when BABYSH_SCAN names it.
+ *              BABYSH_SCAN may also be "scalar", "avx2", or "off", which
+ *              copies every character on its own as the shell once did.
+ *              A kernel the CPU lacks is replaced by the best one it has.
+ *
+ * Parameters:  scan - pointer to the scanner
+ *              choice - the value of BABYSH_SCAN, or NULL
+ *
+ * Returns:     None. scan is altered.
+ *
+ ************************************************************************/
+void scanInit(struct scanner *scan, char *choice) {
+	static const char *ends[SCAN_SETS] = {
+		" \t\"$&'*<>?[\\|", "\"$\\*?[", "'*?["
+	};
+	unsigned char groups[16];       // Bit of each high nibble with an end
+	unsigned char end;
+	int used;
+	int set;
+	int stop;
+
+	memset(scan->classes, 0, sizeof(scan->classes));
+	memset(scan->stops, 0, sizeof(scan->stops));
+	memset(scan->nibbles, 0, sizeof(scan->nibbles));
+
+	for (set = 0; set < SCAN_SETS; set++) {
+		memset(groups, 0, sizeof(groups));
+		used = 0;
+		scan->counts[set] = strlen(ends[set]) + 1;
+
+		// Every set also ends at the end of the line. A byte is in the
+		// set if the tables of both its nibbles have the bit of its
+		// high nibble.
+		for (stop = 0; stop < scan->counts[set]; stop++) {
+			end = (stop == 0) ? '\0' : ends[set][stop - 1];
+			scan->classes[end] |= 1u << set;
+			memset(scan->stops[set][stop], end, 16);
+
+			if (groups[end >> 4] == 0)
+				groups[end >> 4] = 1u << used++;
+			scan->nibbles[set][0][end & 15] |= groups[end >> 4];
+			scan->nibbles[set][0][16 + (end & 15)] |= groups[end >> 4];
+			scan->nibbles[set][1][end >> 4] = groups[end >> 4];
+			scan->nibbles[set][1][16 + (end >> 4)] = groups[end >> 4];
+		}
+	}
+
+	scan->run = scanScalar;
+#ifdef __SSE2__
+	if (__builtin_cpu_supports("avx2"))
+		scan->run = scanAvx2;
+	if (choice != NULL && strcmp(choice, "sse2") == 0)
+		scan->run = scanSse2;
+#endif
+	if (choice != NULL && strcmp(choice, "scalar") == 0)
+		scan->run = scanScalar;
+	if (choice != NULL && strcmp(choice, "off") == 0)
+		scan->run = scanNone;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    scanNone()
+ *
+ * Description: This function finds no run, so that parseInput() handles
+ *              every character on its own.
+ *
+ * Parameters:  scan - pointer to the scanner
+ *              text - the characters to scan
+ *              set - the scanSet of the characters that end the run
+ *
+ * Returns:     0.
+ *
+ ************************************************************************/
+size_t scanNone(struct scanner *scan, const char *text, int set) {
+	(void) scan;
+	(void) text;
+	(void) set;
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    scanScalar()
+ *
+ * Description: This function finds a run a byte at a time, looking each
+ *              byte up in the table of classes.
+ *
+ * Parameters:  scan - pointer to the scanner
+ *              text - the characters to scan
+ *              set - the scanSet of the characters that end the run
+ *
+ * Returns:     The number of characters before the end of the run.
+ *
+ ************************************************************************/
+size_t scanScalar(struct scanner *scan, const char *text, int set) {
+	const unsigned char *end = (const unsigned char *) text;
+	unsigned char bit = 1u << set;
+
+	while (!(scan->classes[*end] & bit))
+		end++;
+
+	return (const char *) end - text;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    scanStart()
+ *
+ * Description: This function scans up to the first SCAN_START bytes of
+ *              a run a byte at a time. Most words are shorter than that,
+ *              and their end is found sooner this way than by setting up
+ *              the vector kernels, which carry on from there.
+ *
+ * Parameters:  scan - pointer to the scanner
+ *              text - the characters to scan
+ *              set - the scanSet of the characters that end the run
+ *
+ * Returns:     The number of characters before the end of the run, or
+ *              SCAN_START if it is not within them.
+ *
+ ************************************************************************/
+size_t scanStart(struct scanner *scan, const char *text, int set) {
+	unsigned char bit = 1u << set;
+	size_t length;
+
+	for (length = 0; length < SCAN_START; length++) {
+		if (scan->classes[(unsigned char) text[length]] & bit)
+			break;
+	}
+
+	return length;
+}
+
+
+
+#ifdef __SSE2__
+/*************************************************************************
+ *
+ * Function:    scanSse2()
+ *
+ * Description: This function finds a run 16 bytes at a time, comparing
+ *              the bytes with each character of the set. The loads are
+ *              aligned, so they never cross into a page after the one
+ *              holding the '\0' that ends the line, and the bytes of the
+ *              first load that come before text are ignored. Reading the
+ *              bytes around the line is why the address sanitizer is not
+ *              applied.
+ *
+ * Parameters:  scan - pointer to the scanner
+ *              text - the characters to scan
+ *              set - the scanSet of the characters that end the run
+ *
+ * Returns:     The number of characters before the end of the run.
+ *
+ ************************************************************************/
+__attribute__((no_sanitize_address))
+size_t scanSse2(struct scanner *scan, const char *text, int set) {
+	const __m128i *block;
+	unsigned int skip;
+	unsigned int found;
+	size_t length = scanStart(scan, text, set);
+	const __m128i *stops = (const __m128i *) scan->stops[set];
+	int count = (scan->counts[set] + 3) & ~3;
+	__m128i bytes;
+	__m128i hits[4];
+	int stop;
+
+	if (length < SCAN_START)
+		return length;
+
+	block = (const __m128i *) ((uintptr_t) (text + length) & ~(uintptr_t) 15);
+	skip = (uintptr_t) (text + length) & 15;
+
+	for (;;) {
+		// The characters are compared four at a time, so that the
+		// comparisons do not wait on each other. Those past the end of
+		// the set are '\0'.
+		bytes = _mm_load_si128(block);
+		hits[0] = hits[1] = hits[2] = hits[3] = _mm_setzero_si128();
+		for (stop = 0; stop < count; stop += 4) {
+			hits[0] = _mm_or_si128(hits[0], _mm_cmpeq_epi8(bytes, stops[stop]));
+			hits[1] = _mm_or_si128(hits[1], _mm_cmpeq_epi8(bytes, stops[stop + 1]));
+			hits[2] = _mm_or_si128(hits[2], _mm_cmpeq_epi8(bytes, stops[stop + 2]));
+			hits[3] = _mm_or_si128(hits[3], _mm_cmpeq_epi8(bytes, stops[stop + 3]));
+		}
+		hits[0] = _mm_or_si128(_mm_or_si128(hits[0], hits[1]),
+			_mm_or_si128(hits[2], hits[3]));
+
+		found = (unsigned int) _mm_movemask_epi8(hits[0]) >> skip << skip;
+		if (found != 0)
+			return (const char *) block + __builtin_ctz(found) - text;
+
+		block++;
+		skip = 0;
+	}
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    scanAvx2()
+ *
+ * Description: This function finds a run 32 bytes at a time. Each byte's
+ *              low and high nibbles look up the groups of characters of
+ *              the set in two tables, and the byte ends the run if both
+ *              lookups share a group, which takes the same few
+ *              instructions however many characters the set has. The
+ *              loads are aligned as in scanSse2().
+ *
+ * Parameters:  scan - pointer to the scanner
+ *              text - the characters to scan
+ *              set - the scanSet of the characters that end the run
+ *
+ * Returns:     The number of characters before the end of the run.
+ *
+ ************************************************************************/
+__attribute__((target("avx2"), no_sanitize_address))
+size_t scanAvx2(struct scanner *scan, const char *text, int set) {
+	const __m256i *block;
+	unsigned int skip;
+	size_t length = scanStart(scan, text, set);
+	__m256i low = _mm256_load_si256((const __m256i *) scan->nibbles[set][0]);
+	__m256i high = _mm256_load_si256((const __m256i *) scan->nibbles[set][1]);
+	__m256i nibble = _mm256_set1_epi8(15);
+	__m256i bytes;
+	__m256i groups;
+	unsigned int found;
+
+	if (length < SCAN_START)
+		return length;
+
+	block = (const __m256i *) ((uintptr_t) (text + length) & ~(uintptr_t) 31);
+	skip = (uintptr_t) (text + length) & 31;
+
+	for (;;) {
+		bytes = _mm256_load_si256(block);
+		groups = _mm256_and_si256(
+			_mm256_shuffle_epi8(low, _mm256_and_si256(bytes, nibble)),
+			_mm256_shuffle_epi8(high,
+				_mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble)));
+
+		found = ~(unsigned int) _mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(groups, _mm256_setzero_si256()));
+		found = found >> skip << skip;
+		if (found != 0)
+			return (const char *) block + __builtin_ctz(found) - text;
+
+		block++;
+		skip = 0;
+	}
+}
+#endif
+
+
+
+/*************************************************************************
+ *
+ * Function:    expandParameter()
+ *
+ * Description: This function expands the parameter whose '$' was just
+ *              read by parseInput(). "$NAME" and "${NAME}" are the value
+ *              of the environment variable, or empty if it is unset, "$?"
+ *              is the exit value the status command reports, plus 128 if
+ *              the command was terminated by a signal, "$$" is the pid of
+ *              the shell, and "$!" the pid of the last background job.
+ *              "$(" begins a command substitution. Any other '$' is kept
+ *              as it is. The first expansion in a word moves the word
+ *              into the arena of the shell.
+ *
+ * Parameters:  next - pointer to the next character of the line
+ *              word - pointer to the start of the word being built
+ *              out - pointer to where the next character of the word goes
+ *              inPlace - pointer to where out goes back to after the word,
+ *                        NULL while the word is built in place
+ *              sh - pointer to the shell state
+ *
+ * Returns:     1 if the parameter was expanded, 0 if the '$' is kept, or
+ *              -1 after printing a message. The parameters and the arena
+ *              member of sh may be altered.
+ *
+ ************************************************************************/
+int expandParameter(char **next, char **word, char **out, char **inPlace,
+		struct shell *sh) {
+	char number[24];                // Value of a special parameter
+	char *name = *next;
+	char *value = number;
+	char **variable;
+	size_t nameLength = 1;
+	size_t length = 0;
+	int braces = (*name == '{');
+
+	if (*name == '(')
+		return substituteCommand(next, word, out, inPlace, sh);
+
+	name += braces;
+	if (*name == '?' || *name == '$' || *name == '!') {
+		if (*name == '?')
+			length = snprintf(number, sizeof(number), "%d",
+				sh->termination ? 128 + sh->termination : sh->status);
+		else if (*name == '$')
+			length = snprintf(number, sizeof(number), "%d", (int) getpid());
+		else if (sh->jobs.lastPid > 0)
+			length = snprintf(number, sizeof(number), "%d", (int) sh->jobs.lastPid);
+	}
+	else if (isalpha((unsigned char) *name) || *name == '_') {
+		while (isalnum((unsigned char) name[nameLength]) || name[nameLength] == '_')
+			nameLength++;
+
+		// The variable is looked up without copying its name
+		value = "";
+		for (variable = environ; *variable != NULL; variable++) {
+			if (strncmp(*variable, name, nameLength) == 0
+					&& (*variable)[nameLength] == '=') {
+				value = *variable + nameLength + 1;
+				length = strlen(value);
+				break;
+			}
+		}
+	}
+	else if (!braces) {
+		return 0;
+	}
+	else {
+		nameLength = 0;
+	}
+
+	if (braces && (nameLength == 0 || name[nameLength] != '}')) {
+		outPrintf(sh, "syntax error: bad substitution\n");
+		return -1;
+	}
+	*next = name + nameLength + braces;
+
+	if (arenaReserve(word, out, inPlace, length, *next, sh) == -1)
+		return -1;
+
+	memcpy(*out, value, length);
+	*out += length;
+	return 1;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    keepExpansion()
+ *
+ * Description: This function copies the '$' just read by parseInput()
+ *              into a word being compiled, along with the whole of the
+ *              command substitution it may begin, so that the word is
+ *              kept as written.
+ *
+ * Parameters:  next - pointer to the character after the '$'
+ *              out - pointer to where the next character of the word goes
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0 on success, or -1 after printing a message. next and out
+ *              are altered.
+ *
+ ************************************************************************/
+int keepExpansion(char **next, char **out, struct shell *sh) {
+	char *end = *next;
+
+	*(*out)++ = '$';
+	if (**next != '(')
+		return 0;
+
+	if ((end = substitutionEnd(*next + 1)) == NULL) {
+		outPrintf(sh, "syntax error: unterminated command substitution\n");
+		return -1;
+	}
+
+	memmove(*out, *next, end + 1 - *next);
+	*out += end + 1 - *next;
+	*next = end + 1;
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    arenaReserve()
+ *
+ * Description: This function makes room in the arena of the shell for
+ *              more of the word being built. Room is also kept for the
+ *              rest of the line every time, so the arena cannot overflow
+ *              while the word and the words after it are finished. A
+ *              word built in place is first moved into the arena. The
+ *              arena is mapped the first time it is needed.
+ *
+ * Parameters:  word - pointer to the start of the word being built
+ *              out - pointer to where the next character of the word goes
+ *              inPlace - pointer to where out goes back to after the word,
+ *                        NULL while the word is built in place
+ *              length - the number of bytes to add to the word
+ *              rest - the rest of the line
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0 on success, or -1 after printing a message. The other
+ *              parameters and the arena member of sh may be altered.
+ *
+ ************************************************************************/
+int arenaReserve(char **word, char **out, char **inPlace, size_t length, char *rest,
+		struct shell *sh) {
+	size_t used;
+	size_t end;
+
+	if (sh->arena.data == NULL && arenaInit(sh) == -1)
+		return -1;
+
+	used = (*inPlace == NULL) ? sh->arena.used + (*out - *word)
+		: (size_t) (*out - sh->arena.data);
+	end = used + length + strlen(rest) + 1;
+	if (end > ARENA_SIZE) {
+		outPrintf(sh, "line too long after expansion\n");
+		return -1;
+	}
+	if (end > sh->arena.peak)
+		sh->arena.peak = end;
+
+	if (*inPlace == NULL) {
+		memcpy(sh->arena.data + sh->arena.used, *word, *out - *word);
+		*inPlace = *out;
+		*out = sh->arena.data + used;
+		*word = sh->arena.data + sh->arena.used;
+	}
+
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    arenaInit()
+ *
+ * Description: This function maps the arena of the shell. Only the
+ *              address space is reserved, and memory is given to the
+ *              pages as they are first written.
+ *
+ * Parameters:  sh - pointer to the shell state
+ *
+ * Returns:     0 on success, or -1 after printing a message. The arena
+ *              member of sh is altered.
+ *
+ ************************************************************************/
+int arenaInit(struct shell *sh) {
+	void *data = mmap(NULL, ARENA_SIZE, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+
+	if (data == MAP_FAILED) {
+		perror("expansion");
+		return -1;
+	}
+
+	sh->arena.data = data;
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    arenaAlloc()
+ *
+ * Description: This function takes room for finished data from the end
+ *              of the arena of the shell.
+ *
+ * Parameters:  length - the number of bytes needed
+ *              align - the alignment the data needs, a power of two
+ *              sh - pointer to the shell state
+ *
+ * Returns:     The room, or NULL after printing a message. The arena
+ *              member of sh is altered.
+ *
+ ************************************************************************/
+char *arenaAlloc(size_t length, size_t align, struct shell *sh) {
+	size_t offset = (sh->arena.used + align - 1) & ~(align - 1);
+
+	if (sh->arena.data == NULL && arenaInit(sh) == -1)
+		return NULL;
+
+	if (offset + length > ARENA_SIZE) {
+		outPrintf(sh, "line too long after expansion\n");
+		return NULL;
+	}
+
+	sh->arena.used = offset + length;
+	if (sh->arena.used > sh->arena.peak)
+		sh->arena.peak = sh->arena.used;
+	return sh->arena.data + offset;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    arenaReset()
+ *
+ * Description: This function empties the arena and the directory cache
+ *              for a new line. The memory of a line that used more of the
+ *              arena than ARENA_KEEP is given back, so that one very long
+ *              line does not keep it.
+ *
+ * Parameters:  sh - pointer to the shell state
+ *
+ * Returns:     None. The arena and dirs members of sh are altered.
+ *
+ ************************************************************************/
+void arenaReset(struct shell *sh) {
+	if (sh->arena.peak > ARENA_KEEP) {
+		madvise(sh->arena.data + ARENA_KEEP, sh->arena.peak - ARENA_KEEP,
+			MADV_DONTNEED);
+		sh->arena.peak = ARENA_KEEP;
+	}
+
+	sh->arena.used = 0;
+	sh->dirs.used = 0;
+	sh->dirs.count = 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    argInit()
+ *
+ * Description: This function starts the arguments of a command empty.
+ *
+ * Parameters:  cmd - pointer to the command
+ *
+ * Returns:     None. cmd is altered.
+ *
+ ************************************************************************/
+void argInit(struct command *cmd) {
+	cmd->args = cmd->argSpace;
+	cmd->argSize = INLINE_ARGS;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    argAdd()
+ *
+ * Description: This function adds an argument to the current stage of a
+ *              command, keeping room for the NULL that ends the stage.
+ *              When the arguments are full they are moved to twice the
+ *              room in the arena, and the stages begun so far are moved
+ *              with them.
+ *
+ * Parameters:  cmd - pointer to the command, with stageCount stages
+ *                    finished
+ *              position - pointer to the number of entries in args
+ *              word - the argument
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0 on success, or -1 after printing a message. cmd,
+ *              position and the arena member of sh may be altered.
+ *
+ ************************************************************************/
+int argAdd(struct command *cmd, int *position, char *word, struct shell *sh) {
+	char **grown;
+	int stage;
+
+	if (*position + 2 > cmd->argSize) {
+		if (cmd->argSize > INT_MAX / 2) {
+			outPrintf(sh, "too many arguments\n");
+			return -1;
+		}
+
+		grown = (char **) arenaAlloc(2 * cmd->argSize * sizeof(*grown),
+			sizeof(*grown), sh);
+		if (grown == NULL)
+			return -1;
+
+		memcpy(grown, cmd->args, *position * sizeof(*grown));
+		for (stage = 0; stage <= cmd->stageCount && stage < MAX_STAGES; stage++)
+			cmd->stages[stage].argv = grown + (cmd->stages[stage].argv - cmd->args);
+		cmd->args = grown;
+		cmd->argSize *= 2;
+	}
+
+	cmd->args[(*position)++] = word;
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    substituteCommand()
+ *
+ * Description: This function expands the command substitution "$(...)"
+ *              whose '$' was just read by parseInput() into the output of
+ *              the command, without its trailing newlines. The word so
+ *              far and the text of the command are kept in the arena of
+ *              the shell while the command is parsed and run, and then
+ *              the output is copied onto the end of the word.
+ *
+ * Parameters:  next - pointer to the "(" of the substitution
+ *              word - pointer to the start of the word being built
+ *              out - pointer to where the next character of the word goes
+ *              inPlace - pointer to where out goes back to after the word,
+ *                        NULL while the word is built in place
+ *              sh - pointer to the shell state
+ *
+ * Returns:     1 if the command was substituted, or -1 after printing a
+ *              message. The parameters and the arena, capture, status and
+ *              termination members of sh may be altered.
+ *
+ ************************************************************************/
+int substituteCommand(char **next, char **word, char **out, char **inPlace,
+		struct shell *sh) {
+	char *text = *next + 1;
+	char *end;
+	char *command;
+	char *output;
+	size_t length;
+	size_t saved;
+	size_t start;
+
+	if ((end = substitutionEnd(text)) == NULL) {
+		outPrintf(sh, "syntax error: unterminated command substitution\n");
+		return -1;
+	}
+	length = end - text;
+	*next = end + 1;
+
+	if (arenaReserve(word, out, inPlace, length + 1, *next, sh) == -1)
+		return -1;
+
+	// The command is parsed after the word, and its words are let go
+	// once it has run
+	saved = sh->arena.used;
+	command = *out;
+	memcpy(command, text, length);
+	command[length] = '\0';
+	sh->arena.used = command + length + 1 - sh->arena.data;
+
+	start = sh->capture.length;
+	if (runSubstitution(command, sh) == -1) {
+		sh->arena.used = saved;
+		return -1;
+	}
+	sh->arena.used = saved;
+
+	// Nothing may have been captured yet, leaving no buffer at all
+	length = sh->capture.length - start;
+	if (length == 0)
+		return 1;
+
+	// Trailing newlines are dropped by shortening the output
+	output = sh->capture.data + start;
+	while (length > 0 && output[length - 1] == '\n')
+		length--;
+
+	if (arenaReserve(word, out, inPlace, length, *next, sh) == -1) {
+		sh->capture.length = start;
+		return -1;
+	}
+
+	memcpy(*out, output, length);
+	*out += length;
+	sh->capture.length = start;
+	return 1;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    fieldSplit()
+ *
+ * Description: This function splits the output of a command substitution
+ *              that was just added to a word outside quotes into fields.
+ *              Each run of spaces, tabs and newlines becomes a single
+ *              null, which fieldsAdd() splits the word at once it ends.
+ *              Null bytes of the output are dropped, so that they do not
+ *              split it.
+ *
+ * Parameters:  start - the start of the output in the word
+ *              end - the end of the output
+ *
+ * Returns:     The new end of the output, which is moved up in place.
+ *
+ ************************************************************************/
+char *fieldSplit(char *start, char *end) {
+	char *out = start;
+	char *next;
+	int blank = 0;
+
+	for (next = start; next < end; next++) {
+		if (*next == ' ' || *next == '\t' || *next == '\n') {
+			blank = 1;
+		}
+		else if (*next != '\0') {
+			if (blank)
+				*out++ = '\0';
+			blank = 0;
+			*out++ = *next;
+		}
+	}
+
+	// A field may still follow the output
+	if (blank)
+		*out++ = '\0';
+
+	return out;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    fieldsAdd()
+ *
+ * Description: This function adds the fields of a word split by
+ *              fieldSplit() as arguments. Empty fields are not added,
+ *              unless the word was quoted and has no other field.
+ *
+ * Parameters:  word - the word
+ *              end - just past the null that ends the word
+ *              glob - whether each field is expanded as a pattern
+ *              quoted - whether the word has quotes
+ *              cmd - pointer to the command the arguments are added to
+ *              position - pointer to the number of entries in its args
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0 on success, or -1 after printing a message. cmd,
+ *              position and the arena and dirs members of sh may be
+ *              altered.
+ *
+ ************************************************************************/
+int fieldsAdd(char *word, char *end, int glob, int quoted, struct command *cmd,
+		int *position, struct shell *sh) {
+	char *field;
+	int first = *position;
+
+	for (field = word; field < end; field += strlen(field) + 1) {
+		if (*field == '\0')
+			continue;
+
+		if ((glob ? globWord(field, cmd, position, sh)
+				: argAdd(cmd, position, field, sh)) == -1)
+			return -1;
+	}
+
+	if (*position == first && quoted)
+		return argAdd(cmd, position, end - 1, sh);
+
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    substitutionEnd()
+ *
+ * Description: This function finds the ")" that ends a command
+ *              substitution, passing over nested parentheses, quotes and
+ *              escaped characters.
+ *
+ * Parameters:  text - the text just after the "("
+ *
+ * Returns:     A pointer to the ")", or NULL if there is none.
+ *
+ ************************************************************************/
+char *substitutionEnd(char *text) {
+	int depth = 1;
+	char quote = 0;
+
+	for (; *text != '\0'; text++) {
+		if (quote) {
+			if (*text == quote)
+				quote = 0;
+			else if (quote == '"' && *text == '\\' && text[1] != '\0')
+				text++;
+		}
+		else if (*text == '\\' && text[1] != '\0') {
+			text++;
+		}
+		else if (*text == '\'' || *text == '"') {
+			quote = *text;
+		}
+		else if (*text == '(') {
+			depth++;
+		}
+		else if (*text == ')' && --depth == 0) {
+			return text;
+		}
+	}
+
+	return NULL;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    runSubstitution()
+ *
+ * Description: This function runs the command of a command substitution
+ *              and adds its output to the capture buffer of the shell.
+ *              One of the common utilities, from echo on, leaves the
+ *              shell as it was, so it runs in the shell and its output
+ *              goes straight into the buffer, with no process or pipe.
+ *              Any other command, or a list or compound command, could
+ *              change the directory, variables or jobs of the shell, so
+ *              it runs in a copy of the shell made by runSubshell().
+ *              "exit" and "exec" would end the shell, so they are not
+ *              allowed.
+ *
+ * Parameters:  text - the command
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0 on success, or -1 after printing a message, in which case
+ *              nothing is added. The arena, capture, status and
+ *              termination members of sh may be altered.
+ *
+ ************************************************************************/
+int runSubstitution(char *text, struct shell *sh) {
+	struct command inner;
+	size_t start;
+	int execLast = sh->execLast;
+	int parseMode = sh->parseMode;
+	int builtin;
+	int result = -1;
+
+	if (sh->substituting == MAX_SUBSTITUTIONS) {
+		outPrintf(sh, "command substitution nested too deeply\n");
+		return -1;
+	}
+
+	// Output from before the command is not part of its output
+	outFlush(sh);
+	start = sh->capture.length;
+	sh->substituting++;
+	sh->execLast = 0;
+	sh->parseMode = PARSE_LINE;
+
+	if (isCompound(text)) {
+		result = runSubshell(text, NULL, sh);
+	}
+	else if (parseInput(text, &inner, sh) != -1 && readHereDocs(&inner, 0, sh) != -1) {
+		builtin = (inner.stageCount == 1)
+			? findBuiltin(inner.stages[0].argv[0]) : BUILTIN_NONE;
+
+		if (builtin == BUILTIN_EXIT || builtin == BUILTIN_EXEC) {
+			outPrintf(sh, "%s: not allowed in a command substitution\n",
+				inner.stages[0].argv[0]);
+		}
+		else if (builtin >= BUILTIN_ECHO && !inner.background) {
+			processArgs(&inner, sh);
+			result = 0;
+		}
+		else {
+			result = runSubshell(text, &inner, sh);
+		}
+		closeHereDocs(&inner);
+	}
+
+	outFlush(sh);
+	sh->substituting--;
+	sh->execLast = execLast;
+	sh->parseMode = parseMode;
+
+	// The messages of a command that failed are shown rather than kept
+	if (result == -1 && sh->capture.length > start) {
+		outWrite(sh, sh->capture.data + start, sh->capture.length - start);
+		sh->capture.length = start;
+	}
+
+	return result;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    runSubshell()
+ *
+ * Description: This function runs the command of a command substitution
+ *              in a child process that is a copy of the shell, so that
+ *              whatever the command changes is lost with the child. The
+ *              child starts with no jobs, as those of the shell are not
+ *              its own to wait for or signal, and sends what it captured
+ *              back through a pipe that the shell reads. A list or
+ *              compound command is compiled by the child, separately
+ *              from one that may be running.
+ *
+ * Parameters:  text - the command
+ *              cmd - pointer to the parsed command, or NULL to compile
+ *                    text as a list or compound command
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0 on success, or -1 if the child could not be started.
+ *              The capture, status and termination members of sh may be
+ *              altered.
+ *
+ ************************************************************************/
+int runSubshell(char *text, struct command *cmd, struct shell *sh) {
+	struct script script;
+	size_t start = sh->capture.length;
+	int pipeFds[2];
+	int waitStatus;
+	pid_t cpid;
+
+	if (pipe2(pipeFds, O_CLOEXEC) == -1) {
+		perror("pipe failed");
+		return -1;
+	}
+
+	cpid = fork();
+	if (cpid == -1) {
+		perror("fork failed");
+		close(pipeFds[0]);
+		close(pipeFds[1]);
+		return -1;
+	}
+
+	if (cpid == 0) {
+		close(pipeFds[0]);
+		memset(&sh->jobs, 0, sizeof(sh->jobs));
+		sh->jobs.freeSlot = NO_JOB;
+		sh->jobs.stats = sh->stats;
+
+		if (cmd == NULL) {
+			memset(&script, 0, sizeof(script));
+			runCompound(text, &script, 0, sh);
+		}
+		else {
+			processArgs(cmd, sh);
+		}
+
+		outFlush(sh);
+		if (sh->capture.length > start)
+			writeAll(pipeFds[1], sh->capture.data + start, sh->capture.length - start);
+		_exit(sh->termination ? 128 + sh->termination : sh->status);
+	}
+
+	close(pipeFds[1]);
+	captureRead(pipeFds[0], sh);
+	close(pipeFds[0]);
+
+	// The child reports a command terminated by a signal, but is not
+	// itself terminated by one
+	if (waitpid(cpid, &waitStatus, 0) == -1) {
+		perror("wait failed");
+		sh->status = EXIT_FAILURE;
+	}
+	else {
+		sh->status = WIFEXITED(waitStatus) ? WEXITSTATUS(waitStatus) : EXIT_FAILURE;
+	}
+	sh->termination = 0;
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    captureRead()
+ *
+ * Description: This function reads the output of a command substitution
+ *              from a pipe until every writer has closed it. The capture
+ *              buffer grows so that every read can take a large block.
+ *              Once a read fills a block, the command has a lot to say,
+ *              and the pipe is enlarged so that it seldom waits for the
+ *              shell. Most commands say little, and enlarging every pipe
+ *              up front would cost more than reading them.
+ *
+ * Parameters:  fd - the read end of the pipe
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. capture member of sh is altered.
+ *
+ ************************************************************************/
+void captureRead(int fd, struct shell *sh) {
+	struct capture *capture = &sh->capture;
+	ssize_t count;
+	int enlarged = 0;
+
+	for (;;) {
+		if (capture->size - capture->length < CAPTURE_READ
+				&& captureGrow(capture, CAPTURE_READ) == -1) {
+			perror("command substitution");
+			return;
+		}
+
+		count = read(fd, capture->data + capture->length,
+			capture->size - capture->length);
+		if (count == -1 && errno == EINTR)
+			continue;
+		if (count <= 0)
+			return;
+
+		capture->length += count;
+		if (!enlarged && count >= CAPTURE_READ) {
+			fcntl(fd, F_SETPIPE_SZ, CAPTURE_PIPE);
+			enlarged = 1;
+		}
+	}
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    captureGrow()
+ *
+ * Description: This function doubles the capture buffer until it has
+ *              room for more bytes. The memory is kept for the next
+ *              command substitution.
+ *
+ * Parameters:  capture - pointer to the capture buffer
+ *              length - the number of bytes that need room
+ *
+ * Returns:     0 on success, or -1 if no memory is left. capture is
+ *              altered.
+ *
+ ************************************************************************/
+int captureGrow(struct capture *capture, size_t length) {
+	size_t newSize = capture->size ? capture->size : CAPTURE_READ;
+	char *grown;
+
+	while (newSize - capture->length < length)
+		newSize *= 2;
+
+	grown = realloc(capture->data, newSize);
+	if (grown == NULL)
+		return -1;
+
+	capture->data = grown;
+	capture->size = newSize;
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    globWord()
+ *
+ * Description: This function expands a word holding a pattern into the
+ *              paths that match it, in sorted order, as arguments. "*"
+ *              matches any characters, "?" any single character, and
+ *              "[...]" any of the characters listed, but neither matches
+ *              "/" or a leading ".". A word that matches nothing is kept
+ *              as it is.
+ *
+ * Parameters:  word - the word
+ *              cmd - pointer to the command the arguments are added to
+ *              position - pointer to the number of entries in its args
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0 on success, or -1 after printing a message. cmd,
+ *              position and the arena and dirs members of sh may be
+ *              altered.
+ *
+ ************************************************************************/
+int globWord(char *word, struct command *cmd, int *position, struct shell *sh) {
+	char path[PATH_MAX];            // Path being matched
+	int first = *position;
+
+	if (isPattern(word, word + strlen(word))
+			&& globWalk(path, 0, word, cmd, position, sh) == -1)
+		return -1;
+
+	if (*position > first) {
+		// One sort puts every match in order
+		qsort(&cmd->args[first], *position - first, sizeof(*cmd->args), globCompare);
+		return 0;
+	}
+
+	return argAdd(cmd, position, word, sh);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    globWalk()
+ *
+ * Description: This function matches the rest of a pattern, one path
+ *              component at a time, against the directory named by the
+ *              path matched so far. Components without a pattern are
+ *              added to the path as they are, so only the directories
+ *              that hold a pattern are read, and the whole path is
+ *              checked once at the end.
+ *
+ * Parameters:  path - the path matched so far, PATH_MAX bytes
+ *              length - the length of path
+ *              rest - the rest of the pattern
+ *              cmd - pointer to the command the arguments are added to
+ *              position - pointer to the number of entries in its args
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0 on success, or -1 after printing a message. path, cmd,
+ *              position and the arena and dirs members of sh may be
+ *              altered.
+ *
+ ************************************************************************/
+int globWalk(char *path, size_t length, char *rest, struct command *cmd, int *position,
+		struct shell *sh) {
+	char component[NAME_MAX + 1];
+	struct stat info;
+	char *end;
+	char *name;
+	size_t size;
+	size_t offset;
+	size_t stop;
+	int slot;
+
+	while (*rest == '/' && length < PATH_MAX - 1)
+		path[length++] = *rest++;
+
+	end = strchrnul(rest, '/');
+	size = end - rest;
+
+	// A component without a pattern is part of the path
+	if (!isPattern(rest, end)) {
+		if (length + size >= PATH_MAX)
+			return 0;
+		memcpy(path + length, rest, size);
+		length += size;
+		path[length] = '\0';
+
+		if (*end != '\0')
+			return globWalk(path, length, end, cmd, position, sh);
+		if (fstatat(AT_FDCWD, path, &info, AT_SYMLINK_NOFOLLOW) == -1)
+			return 0;
+		return globAdd(path, length, cmd, position, sh);
+	}
+
+	if (size > NAME_MAX)
+		return 0;
+	memcpy(component, rest, size);
+	component[size] = '\0';
+
+	path[length] = '\0';
+	if ((slot = dirList(path, sh)) == -1)
+		return 0;
+
+	// The listing may move, and its slot be reused, while the matches
+	// are walked, but the offsets of its names stay the same
+	offset = sh->dirs.dirs[slot].first;
+	stop = sh->dirs.dirs[slot].end;
+	for (; offset < stop; offset += size + 1) {
+		name = sh->dirs.names + offset;
+		size = strlen(name);
+
+		if (fnmatch(component, name, FNM_PERIOD) != 0 || length + size >= PATH_MAX)
+			continue;
+		memcpy(path + length, name, size + 1);
+
+		if (*end != '\0') {
+			if (globWalk(path, length + size, end, cmd, position, sh) == -1)
+				return -1;
+		}
+		else if (globAdd(path, length + size, cmd, position, sh) == -1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    globAdd()
+ *
+ * Description: This function adds a matching path as an argument. The
+ *              path is copied into the arena of the shell.
+ *
+ * Parameters:  path - the path
+ *              length - the length of path
+ *              cmd - pointer to the command the argument is added to
+ *              position - pointer to the number of entries in its args
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0 on success, or -1 after printing a message. cmd,
+ *              position and the arena member of sh may be altered.
+ *
+ ************************************************************************/
+int globAdd(char *path, size_t length, struct command *cmd, int *position,
+		struct shell *sh) {
+	char *copy = arenaAlloc(length + 1, 1, sh);
+
+	if (copy == NULL)
+		return -1;
+
+	return argAdd(cmd, position, memcpy(copy, path, length + 1), sh);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    globCompare()
+ *
+ * Description: This function compares two arguments for qsort().
+ *
+ * Parameters:  a - pointer to a char*
+ *              b - pointer to a char*
+ *
+ * Returns:     Less than, equal to, or greater than 0 as a sorts before,
+ *              with, or after b.
+ *
+ ************************************************************************/
+int globCompare(const void *a, const void *b) {
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    isPattern()
+ *
+ * Description: This function checks whether text holds a pattern. A "["
+ *              only begins a pattern if a "]" follows it, so the test
+ *              command "[" is not looked for on disk.
+ *
+ * Parameters:  text - the text to check
+ *              end - pointer just past the end of text
+ *
+ * Returns:     1 if text holds a pattern, or else 0.
+ *
+ ************************************************************************/
+int isPattern(char *text, char *end) {
+	for (; text < end; text++) {
+		if (*text == '*' || *text == '?'
+				|| (*text == '[' && memchr(text + 1, ']', end - text - 1) != NULL))
+			return 1;
+	}
+
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    dirList()
+ *
+ * Description: This function lists the names in a directory, other than
+ *              "." and "..". A directory is only read once for a line,
+ *              however many patterns are matched against it. Entries are
+ *              read with getdents64() in large blocks straight into the
+ *              buffer of listings, and the names are then packed over
+ *              the entries they were read in, so they are never copied
+ *              through a directory stream.
+ *
+ * Parameters:  path - the directory, "" for the working directory, or
+ *                     ending with "/"
+ *              sh - pointer to the shell state
+ *
+ * Returns:     The slot of the listing in the dirs member of sh, or -1
+ *              if the directory cannot be read. dirs member of sh may
+ *              be altered.
+ *
+ ************************************************************************/
+int dirList(char *path, struct shell *sh) {
+	struct dirCache *cache = &sh->dirs;
+	struct cachedDir *dir;
+	struct dirent64 *entry;
+	char *grown;
+	char *entries;
+	char *name;
+	size_t start = cache->used;
+	size_t length = strlen(path) + 1;
+	size_t offset;
+	size_t newSize;
+	unsigned short recordLength;
+	ssize_t count;
+	int fd;
+	int slot;
+
+	for (slot = 0; slot < cache->count && slot < DIR_CACHE_SIZE; slot++) {
+		if (strcmp(cache->names + cache->dirs[slot].path, path) == 0)
+			return slot;
+	}
+
+	fd = open((*path != '\0') ? path : ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	for (count = 0;;) {
+		// Keep room for the path and a full block of aligned entries
+		if (cache->size - cache->used < length + DIR_READ + 8) {
+			newSize = cache->size ? cache->size * 2 : DIR_READ * 2;
+			while (newSize - cache->used < length + DIR_READ + 8)
+				newSize *= 2;
+
+			grown = realloc(cache->names, newSize);
+			if (grown == NULL) {
+				perror("expansion");
+				count = -1;
+				break;
+			}
+			cache->names = grown;
+			cache->size = newSize;
+		}
+
+		if (cache->used == start) {
+			memcpy(cache->names + start, path, length);
+			cache->used += length;
+		}
+
+		offset = (cache->used + 7) & ~(size_t) 7;
+		entries = cache->names + offset;
+		count = getdents64(fd, entries, cache->size - offset);
+		if (count <= 0)
+			break;
+
+		// Each name is shorter than the entry holding it, so the names
+		// can be packed from the start of the entries
+		for (offset = 0; offset < (size_t) count; offset += recordLength) {
+			entry = (struct dirent64 *) (entries + offset);
+			recordLength = entry->d_reclen;
+			name = entry->d_name;
+
+			if (name[0] == '.' && (name[1] == '\0'
+					|| (name[1] == '.' && name[2] == '\0')))
+				continue;
+
+			length = strlen(name) + 1;
+			memmove(cache->names + cache->used, name, length);
+			cache->used += length;
+		}
+		length = 0;
+	}
+
+	close(fd);
+	if (count == -1) {
+		cache->used = start;
+		return -1;
+	}
+
+	// The oldest listing gives up its slot once every slot is used
+	slot = cache->count++ % DIR_CACHE_SIZE;
+	dir = &cache->dirs[slot];
+	dir->path = start;
+	dir->first = start + strlen(path) + 1;
+	dir->end = cache->used;
+	return slot;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    readHereDocs()
+ *
+ * Description: This function reads the contents of the here-documents
+ *              and here-strings of a parsed command. The lines of a
+ *              here-document follow the command in the input, up to a
+ *              line holding only the delimiter, and are expanded unless
+ *              the delimiter was quoted. The contents are kept in memory,
+ *              ready to be used as the input of a stage.
+ *
+ * Parameters:  cmd - pointer to a command
+ *              readLines - whether here-documents may be read from the
+ *                          input
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0 on success, or -1 if an error was reported. The hereFd
+ *              members of the redirections of cmd are altered.
+ *
+ ************************************************************************/
+int readHereDocs(struct command *cmd, int readLines, struct shell *sh) {
+	struct redirect *redirect;
+	char *body;
+	char *expanded;
+	size_t length;
+
+	// A compiled command already has its here-documents
+	for (redirect = cmd->redirects; redirect < cmd->redirects + cmd->redirectCount;
+			redirect++) {
+		if (redirect->kind < HERE_DOC || redirect->hereFd != -1)
+			continue;
+
+		if (redirect->kind != HERE_STRING && !readLines) {
+			outPrintf(sh, "here-document not allowed here\n");
+			closeHereDocs(cmd);
+			return -1;
+		}
+
+		if ((body = hereBody(redirect, &length, sh)) == NULL) {
+			closeHereDocs(cmd);
+			return -1;
+		}
+
+		expanded = body;
+		if (redirect->kind != HERE_STRING && !redirect->quoted
+				&& (expanded = hereExpand(body, &length, sh)) == NULL) {
+			free(body);
+			closeHereDocs(cmd);
+			return -1;
+		}
+
+		redirect->hereFd = hereInput(expanded, length);
+		free(body);
+
+		if (redirect->hereFd == -1) {
+			perror("here-document");
+			closeHereDocs(cmd);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    hereBody()
+ *
+ * Description: This function reads the contents of a here-document from
+ *              the lines of input up to its delimiter, or makes those of
+ *              a here-string from its word.
+ *
+ * Parameters:  redirect - pointer to the redirection
+ *              length - pointer to where to store the length
+ *              sh - pointer to the shell state
+ *
+ * Returns:     The contents, ending with '\0', to be freed by the caller,
+ *              or NULL after printing a message.
+ *
+ ************************************************************************/
+char *hereBody(struct redirect *redirect, size_t *length, struct shell *sh) {
+	char *body;
+	char *grown;
+	char *line;
+	size_t size;
+	size_t lineLength;
+
+	// A here-string is the word followed by a newline
+	size = strlen(redirect->target) + 2;
+	body = malloc(size);
+	if (body == NULL) {
+		perror("here-document");
+		return NULL;
+	}
+	*length = 0;
+
+	if (redirect->kind == HERE_STRING)
+		*length = stpcpy(stpcpy(body, redirect->target), "\n") - body;
+
+	while (redirect->kind != HERE_STRING) {
+		if (sh->interactive) {
+			outPrintf(sh, "> ");
+			outFlush(sh);
+		}
+
+		// The end of input also ends the document
+		if ((line = getInput(sh)) == NULL)
+			break;
+
+		if (redirect->kind == HERE_DOC_TABS)
+			line += strspn(line, "\t");
+		if (strcmp(line, redirect->target) == 0)
+			break;
+
+		lineLength = strlen(line);
+		if (*length + lineLength + 2 > size) {
+			while (*length + lineLength + 2 > size)
+				size *= 2;
+
+			grown = realloc(body, size);
+			if (grown == NULL) {
+				perror("here-document");
+				free(body);
+				return NULL;
+			}
+			body = grown;
+		}
+
+		memcpy(body + *length, line, lineLength);
+		*length += lineLength;
+		body[(*length)++] = '\n';
+	}
+
+	body[*length] = '\0';
+	return body;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    hereExpand()
+ *
+ * Description: This function expands the parameters and command
+ *              substitutions in the contents of a here-document whose
+ *              delimiter was not quoted, as expandParameter() does for a
+ *              word. The contents are copied into the arena of the shell
+ *              and expanded there as a single word, which is neither
+ *              split nor globbed. A backslash only escapes "$", "`", "\"
+ *              and a newline, which joins the line to the next.
+ *
+ * Parameters:  body - the contents, ending with '\0'
+ *              length - pointer to the length of the contents
+ *              sh - pointer to the shell state
+ *
+ * Returns:     The expanded contents, which stay in the arena until it is
+ *              next used, or NULL after printing a message. length and
+ *              the arena member of sh are altered.
+ *
+ ************************************************************************/
+char *hereExpand(char *body, size_t *length, struct shell *sh) {
+	char *copy;
+	char *next;
+	char *out;
+	char *inPlace = NULL;
+	int result;
+	char c;
+
+	if ((copy = arenaAlloc(*length + 1, 1, sh)) == NULL)
+		return NULL;
+	memcpy(copy, body, *length + 1);
+
+	next = out = copy;
+	while ((c = *next++) != '\0') {
+		if (c == '\\' && *next == '\n') {
+			next++;
+			continue;
+		}
+
+		if (c == '\\' && (*next == '$' || *next == '`' || *next == '\\')) {
+			c = *next++;
+		}
+		else if (c == '$' && (result = expandParameter(&next, &copy, &out, &inPlace, sh))) {
+			if (result == -1)
+				return NULL;
+			continue;
+		}
+
+		*out++ = c;
+	}
+
+	*length = out - copy;
+	return copy;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    hereInput()
+ *
+ * Description: This function puts the contents of a here-document into
+ *              a file descriptor that a stage can read them from. Small
+ *              contents are written into a pipe, which holds them until
+ *              they are read. Contents larger than the pipe are written
+ *              to a memory file that is sealed against changes. Either
+ *              way no data goes to disk.
+ *
+ * Parameters:  data - the contents
+ *              length - the number of bytes in data
+ *
+ * Returns:     A close-on-exec descriptor positioned at the start of the
+ *              contents, or -1 on an error.
+ *
+ ************************************************************************/
+int hereInput(char *data, size_t length) {
+	int pipeFds[2];
+	int fd;
+
+	if (length <= HERE_PIPE_LIMIT && pipe2(pipeFds, O_CLOEXEC) == 0) {
+		// The capacity of the pipe may be below the usual size
+		if ((ssize_t) length <= fcntl(pipeFds[1], F_GETPIPE_SZ)
+				&& writeAll(pipeFds[1], data, length) == 0) {
+			close(pipeFds[1]);
+			return pipeFds[0];
+		}
+
+		close(pipeFds[0]);
+		close(pipeFds[1]);
+	}
+
+	fd = memfd_create("here-document", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+	if (fd == -1)
+		return -1;
+
+	if (writeAll(fd, data, length) == -1 || lseek(fd, 0, SEEK_SET) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL);
+	return fd;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    closeHereDocs()
+ *
+ * Description: This function closes the here-documents of a command once
+ *              the command has been started.
+ *
+ * Parameters:  cmd - pointer to a command
+ *
+ * Returns:     None. The hereFd members of the redirections of cmd are
+ *              altered.
+ *
+ ************************************************************************/
+void closeHereDocs(struct command *cmd) {
+	struct redirect *redirect;
+
+	for (redirect = cmd->redirects; redirect < cmd->redirects + cmd->redirectCount;
+			redirect++) {
+		if (redirect->hereFd != -1) {
+			close(redirect->hereFd);
+			redirect->hereFd = -1;
+		}
+	}
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    isCompound()
+ *
+ * Description: This function checks whether a line is compiled and run
+ *              by runCompound(), which is the case when it begins with a
+ *              reserved word or holds more than one command separated by
+ *              ";" or "&".
+ *
+ * Parameters:  line - the line
+ *
+ * Returns:     1 if the line is compiled, or else 0.
+ *
+ ************************************************************************/
+int isCompound(char *line) {
+	static char *reserved[] = {
+		"if", "then", "elif", "else", "fi", "while", "for", "do", "done"
+	};
+	char *and;
+	size_t word;
+
+	if (strchr(line, ';') != NULL)
+		return 1;
+
+	// An "&" that is not part of a redirection may be followed by more
+	for (and = strchr(line, '&'); and != NULL; and = strchr(and + 1, '&')) {
+		if (and[1] != '>' && (and == line || (and[-1] != '>' && and[-1] != '<'))
+				&& and[1 + strspn(and + 1, " \t")] != '\0')
+			return 1;
+	}
+
+	line += strspn(line, " \t");
+	if (strchr("iftewd", *line) == NULL || *line == '\0')
+		return 0;
+
+	for (word = 0; word < sizeof(reserved) / sizeof(reserved[0]); word++) {
+		if (keywordRest(line, reserved[word]) != NULL)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    runCompound()
+ *
+ * Description: This function compiles a line, and the lines that follow
+ *              it until its compound commands are complete, and runs the
+ *              result. Each simple command is parsed once, so a loop only
+ *              expands the words that hold parameters, command
+ *              substitutions or patterns each time it runs its body.
+ *
+ * Parameters:  line - the line
+ *              script - pointer to the script to compile into
+ *              readLines - whether the lines after it may be read
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status and termination members of sh and script are
+ *              altered.
+ *
+ ************************************************************************/
+void runCompound(char *line, struct script *script, int readLines, struct shell *sh) {
+	struct compiler compiler;
+	unsigned int first;
+	long long started = 0;          // When a traced compile started
+
+	if (sh->trace != NULL)
+		started = traceClock();
+
+	// The line is copied, as the lines after it may move the input
+	compiler.sh = sh;
+	compiler.script = script;
+	compiler.line = strdup(line);
+	compiler.rest = compiler.line;
+	compiler.pending = NULL;
+	compiler.depth = 0;
+	compiler.readLines = readLines;
+	compiler.whole = 0;
+	compiler.background = 0;
+	compiler.found = -1;
+	compiler.error = (compiler.line == NULL);
+	script->used = SCRIPT_START;
+
+	first = compileList(&compiler, NULL);
+	free(compiler.line);
+
+	if (sh->trace != NULL)
+		traceRecord(sh->trace, TRACE_PARSE, started);
+
+	if (compiler.error) {
+		sh->status = EXIT_FAILURE;
+		return;
+	}
+
+	// The shell has to be kept for the commands after the last
+	sh->execLast = 0;
+	runList(script, first, sh);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    runCached()
+ *
+ * Description: This function runs a script from its compiled form kept
+ *              in the cache, which is mapped and run as it is, so none
+ *              of the script is parsed. A cached script is found by the
+ *              device and inode of the script, and is only used if the
+ *              script has the size and modification time it was compiled
+ *              from. Otherwise the whole script is compiled, saved and
+ *              run. The compiled scripts are kept in babysh under
+ *              $XDG_CACHE_HOME, or else under $HOME/.cache. A script that
+ *              cannot be compiled as a whole, such as one with a syntax
+ *              error, which is only reported when its line is reached,
+ *              or one that runs parallel on the rest of its input, is
+ *              left to be run a line at a time. The offsets in a cached
+ *              script are followed without being checked, so one whose
+ *              checksum does not match, having been damaged, is removed
+ *              and the script run a line at a time as well.
+ *
+ * Parameters:  file - the script
+ *              sh - pointer to the shell state
+ *
+ * Returns:     1 if the script was run, or else 0. status, termination,
+ *              and trace members of sh may be altered.
+ *
+ ************************************************************************/
+int runCached(char *file, struct shell *sh) {
+	struct scriptHeader *header;
+	struct script script;
+	struct stat fileInfo;
+	struct stat cacheInfo;
+	char path[PATH_MAX];
+	char temporary[PATH_MAX + 32];
+	void *map = MAP_FAILED;
+	unsigned int first;
+	long long started = 0;          // When a traced load started
+	int fd = -1;
+
+	if (stat(file, &fileInfo) == -1 || cachePath(path, sizeof(path), &fileInfo, 0) == -1)
+		return 0;
+
+	if (sh->trace != NULL)
+		started = traceClock();
+
+	// Map the compiled script, if it is there and up to date
+	if (sh->cache != CACHE_REFRESH && (fd = open(path, O_RDONLY|O_CLOEXEC)) != -1) {
+		if (fstat(fd, &cacheInfo) == 0 && cacheInfo.st_size >= (off_t) SCRIPT_START)
+			map = mmap(NULL, cacheInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+	}
+
+	if (map != MAP_FAILED) {
+		header = map;
+		if (memcmp(header->magic, SCRIPT_MAGIC, sizeof(header->magic)) == 0
+				&& header->device == (unsigned long long) fileInfo.st_dev
+				&& header->inode == (unsigned long long) fileInfo.st_ino
+				&& header->size == (unsigned long long) fileInfo.st_size
+				&& header->mtime == (long long) fileInfo.st_mtim.tv_sec
+				&& header->mtimeNsec == (long long) fileInfo.st_mtim.tv_nsec
+				&& header->used == (unsigned long long) cacheInfo.st_size
+				&& header->first < header->used) {
+			if (header->checksum != scriptChecksum((char *) map + SCRIPT_START,
+					header->used - SCRIPT_START)) {
+				munmap(map, cacheInfo.st_size);
+				unlink(path);
+				if (sh->trace != NULL)
+					sh->trace->cache = CACHE_FAILED;
+				return 0;
+			}
+
+			if (sh->trace != NULL) {
+				traceRecord(sh->trace, TRACE_READ, started);
+				sh->trace->cache = CACHE_HIT;
+			}
+
+			script.data = map;
+			script.used = script.size = cacheInfo.st_size;
+			runScript(&script, header->first, sh);
+			munmap(map, cacheInfo.st_size);
+			return 1;
+		}
+		munmap(map, cacheInfo.st_size);
+	}
+
+	// Compile the script and save it before running it
+	memset(&script, 0, sizeof(script));
+	if (compileScript(file, &script, &first, sh) == -1) {
+		if (sh->trace != NULL)
+			sh->trace->cache = CACHE_FAILED;
+		free(script.data);
+		return 0;
+	}
+
+	header = (struct scriptHeader *) script.data;
+	memset(header, 0, sizeof(*header));
+	header->first = first;
+	memcpy(header->magic, SCRIPT_MAGIC, sizeof(header->magic));
+	header->device = fileInfo.st_dev;
+	header->inode = fileInfo.st_ino;
+	header->size = fileInfo.st_size;
+	header->mtime = fileInfo.st_mtim.tv_sec;
+	header->mtimeNsec = fileInfo.st_mtim.tv_nsec;
+	header->used = script.used;
+	header->checksum = scriptChecksum(script.data + SCRIPT_START,
+		script.used - SCRIPT_START);
+	if (sh->trace != NULL)
+		sh->trace->cache = CACHE_MISS;
+
+	// The new file is renamed into place, so a shell running the old one
+	// is not disturbed
+	snprintf(temporary, sizeof(temporary), "%s.%d", path, (int) getpid());
+	if (cachePath(path, sizeof(path), &fileInfo, 1) == 0
+			&& (fd = open(temporary, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0600)) != -1) {
+		if (writeAll(fd, script.data, script.used) == -1 || close(fd) == -1
+				|| rename(temporary, path) == -1)
+			unlink(temporary);
+		else if (sh->trace != NULL)
+			sh->trace->cache = CACHE_SAVED;
+	}
+
+	runScript(&script, first, sh);
+	free(script.data);
+	return 1;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cachePath()
+ *
+ * Description: This function finds the file a script is cached in.
+ *
+ * Parameters:  path - where to store the name of the file
+ *              size - the size of path
+ *              fileInfo - pointer to the status of the script
+ *              create - whether to create the directories of the cache
+ *
+ * Returns:     0 on success, or -1 if there is no cache directory.
+ *
+ ************************************************************************/
+int cachePath(char *path, size_t size, struct stat *fileInfo, int create) {
+	char *home = getenv("XDG_CACHE_HOME");
+	int length;
+
+	if (home != NULL && *home == '/') {
+		length = snprintf(path, size, "%s", home);
+	}
+	else if ((home = getenv("HOME")) != NULL && *home == '/') {
+		length = snprintf(path, size, "%s/.cache", home);
+	}
+	else {
+		return -1;
+	}
+
+	if (length < 0 || (size_t) length + 64 > size)
+		return -1;
+
+	if (create)
+		mkdir(path, 0700);
+	length += snprintf(path + length, size - length, "/babysh");
+	if (create && mkdir(path, 0700) == -1 && errno != EEXIST)
+		return -1;
+
+	snprintf(path + length, size - length, "/%llx-%llx",
+		(unsigned long long) fileInfo->st_dev, (unsigned long long) fileInfo->st_ino);
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    scriptChecksum()
+ *
+ * Description: This function computes the checksum a cached script is
+ *              saved with, an FNV-1a hash taken eight bytes at a time,
+ *              which is fast enough to check on every load.
+ *
+ * Parameters:  data - the compiled nodes
+ *              length - the number of bytes of data
+ *
+ * Returns:     The checksum.
+ *
+ ************************************************************************/
+unsigned long long scriptChecksum(const char *data, size_t length) {
+	unsigned long long hash = 14695981039346656037ull;
+	unsigned long long word;
+
+	for (; length >= sizeof(word); data += sizeof(word), length -= sizeof(word)) {
+		memcpy(&word, data, sizeof(word));
+		hash = (hash ^ word) * 1099511628211ull;
+	}
+
+	for (; length > 0; data++, length--)
+		hash = (hash ^ (unsigned char) *data) * 1099511628211ull;
+
+	return hash;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    compileScript()
+ *
+ * Description: This function compiles every line of a script into a
+ *              single list. The script is read apart from the shell's
+ *              own input, so that the shell can still run it a line at a
+ *              time if it cannot be compiled. The messages of a failed
+ *              compile are discarded, to be shown when the line is run.
+ *
+ * Parameters:  file - the script
+ *              script - pointer to the script to compile into
+ *              first - where to store the offset of the first node
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0 on success, or -1 if the script was not compiled. script
+ *              is altered, leaving room for its header.
+ *
+ ************************************************************************/
+int compileScript(char *file, struct script *script, unsigned int *first,
+		struct shell *sh) {
+	struct compiler compiler;
+	struct inputBuffer saved = sh->input;
+	long long started = 0;          // When a traced compile started
+
+	memset(&sh->input, 0, sizeof(sh->input));
+	if (openInput(file, &sh->input) == -1) {
+		sh->input = saved;
+		return -1;
+	}
+
+	if (sh->trace != NULL)
+		started = traceClock();
+	outFlush(sh);
+
+	compiler.sh = sh;
+	compiler.script = script;
+	compiler.line = NULL;
+	compiler.rest = NULL;
+	compiler.pending = NULL;
+	compiler.depth = 0;
+	compiler.readLines = 1;
+	compiler.whole = 1;
+	compiler.background = 0;
+	compiler.found = -1;
+	compiler.error = 0;
+
+	// The header is filled in once the script is compiled
+	script->used = SCRIPT_START;
+	compiler.error = (scriptAdd(script, "", 0, 1) == 0);
+	*first = compileList(&compiler, NULL);
+	free(compiler.line);
+
+	closeInput(&sh->input);
+	sh->input = saved;
+
+	if (compiler.error) {
+		sh->output.length = 0;
+		return -1;
+	}
+
+	if (sh->trace != NULL)
+		traceRecord(sh->trace, TRACE_PARSE, started);
+
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    runScript()
+ *
+ * Description: This function runs a whole compiled script. As when run
+ *              a line at a time, a command that was interrupted does not
+ *              stop the script, and the last command replaces the shell
+ *              if it can.
+ *
+ * Parameters:  script - pointer to the compiled script
+ *              first - the offset of its first node
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status and termination members of sh are altered.
+ *
+ ************************************************************************/
+void runScript(struct script *script, unsigned int first, struct shell *sh) {
+	struct node *node;
+	unsigned int offset;
+
+	for (offset = first; offset != 0; offset = node->next) {
+		node = (struct node *) (script->data + offset);
+
+		sh->execLast = node->next == 0 && node->kind == NODE_COMMAND
+			&& sh->jobs.indexCount == 0 && sh->trace == NULL && sh->stats == NULL;
+		runNode(script, node, sh);
+	}
+
+	// Report the jobs that finished after the last command
+	sh->execLast = 0;
+	reapBackground(sh);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    compileList()
+ *
+ * Description: This function compiles commands into a list of nodes up
+ *              to one of the reserved words that ends it. At the top
+ *              level the list ends with the line instead. The rest of the
+ *              command after the reserved word is left pending, as in
+ *              "then echo yes".
+ *
+ * Parameters:  compiler - pointer to the compiler state
+ *              stops - the reserved words ending the list, ending with
+ *                      NULL, or NULL at the top level
+ *
+ * Returns:     The offset of the first node, or 0 for an empty list or on
+ *              an error. found member of compiler is set to the index of
+ *              the reserved word, and error member on an error.
+ *
+ ************************************************************************/
+unsigned int compileList(struct compiler *compiler, char **stops) {
+	static char *misplaced[] = {
+		"then", "elif", "else", "fi", "do", "done", NULL
+	};
+	struct node *node;
+	struct compiledCommand *compiled;
+	unsigned int first = 0;
+	unsigned int last = 0;
+	unsigned int offset;
+	char *piece;
+	char *rest;
+	int word;
+
+	while ((piece = nextPiece(compiler)) != NULL) {
+		piece += strspn(piece, " \t");
+		if ((*piece == '\0' || *piece == '#') && compiler->background) {
+			outPrintf(compiler->sh, "syntax error near unexpected token `&'\n");
+			compiler->error = 1;
+			return 0;
+		}
+		if (*piece == '\0' || *piece == '#')
+			continue;
+
+		for (word = 0; stops != NULL && stops[word] != NULL; word++) {
+			if ((rest = keywordRest(piece, stops[word])) != NULL) {
+				compiler->found = word;
+				compiler->pending = rest;
+				return first;
+			}
+		}
+
+		for (word = 0; misplaced[word] != NULL; word++) {
+			if (keywordRest(piece, misplaced[word]) != NULL) {
+				outPrintf(compiler->sh, "syntax error near unexpected token `%s'\n",
+					misplaced[word]);
+				compiler->error = 1;
+				return 0;
+			}
+		}
+
+		if ((rest = keywordRest(piece, "if")) != NULL)
+			offset = compileIf(compiler, rest);
+		else if ((rest = keywordRest(piece, "while")) != NULL)
+			offset = compileWhile(compiler, rest);
+		else if ((rest = keywordRest(piece, "for")) != NULL)
+			offset = compileFor(compiler, rest);
+		else if ((offset = compileCommand(compiler, piece)) != 0) {
+			// A command ended by "&" runs in the background
+			compiled = (struct compiledCommand *) (compiler->script->data + offset);
+			compiled->background |= compiler->background;
+			offset = compileNode(compiler, NODE_COMMAND, offset, 0, 0);
+		}
+
+		if (compiler->error)
+			return 0;
+
+		// Link the node onto the end of the list
+		if (last != 0) {
+			node = (struct node *) (compiler->script->data + last);
+			node->next = offset;
+		}
+		else {
+			first = offset;
+		}
+		last = offset;
+	}
+
+	// Only the top level may end with the input
+	if (stops != NULL && !compiler->error) {
+		outPrintf(compiler->sh, "syntax error: unexpected end of file\n");
+		compiler->error = 1;
+	}
+
+	return first;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    compileIf()
+ *
+ * Description: This function compiles "if list then list [elif list
+ *              then list]... [else list] fi". An elif is compiled as an
+ *              if in the else list of the one before it.
+ *
+ * Parameters:  compiler - pointer to the compiler state
+ *              rest - the command after "if" or "elif"
+ *
+ * Returns:     The offset of the node, or 0 on an error.
+ *
+ ************************************************************************/
+unsigned int compileIf(struct compiler *compiler, char *rest) {
+	static char *thenStop[] = { "then", NULL };
+	static char *elseStop[] = { "elif", "else", "fi", NULL };
+	static char *fiStop[] = { "fi", NULL };
+	unsigned int condition;
+	unsigned int body;
+	unsigned int alternative = 0;
+	int elif = 0;
+
+	compiler->pending = rest;
+	compiler->depth++;
+
+	condition = compileList(compiler, thenStop);
+	body = compileList(compiler, elseStop);
+	if (!compiler->error && compiler->found == 0) {
+		// The elif and its if share the one "fi"
+		elif = 1;
+		alternative = compileIf(compiler, compiler->pending);
+	}
+	else if (!compiler->error && compiler->found == 1) {
+		alternative = compileList(compiler, fiStop);
+	}
+
+	compiler->depth--;
+
+	if (!compiler->error && !elif && !compileEnd(compiler, "fi"))
+		return 0;
+
+	return compileNode(compiler, NODE_IF, condition, body, alternative);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    compileWhile()
+ *
+ * Description: This function compiles "while list do list done".
+ *
+ * Parameters:  compiler - pointer to the compiler state
+ *              rest - the command after "while"
+ *
+ * Returns:     The offset of the node, or 0 on an error.
+ *
+ ************************************************************************/
+unsigned int compileWhile(struct compiler *compiler, char *rest) {
+	static char *doStop[] = { "do", NULL };
+	static char *doneStop[] = { "done", NULL };
+	unsigned int condition;
+	unsigned int body;
+
+	compiler->pending = rest;
+	compiler->depth++;
+
+	condition = compileList(compiler, doStop);
+	body = compileList(compiler, doneStop);
+
+	compiler->depth--;
+
+	if (!compiler->error && !compileEnd(compiler, "done"))
+		return 0;
+
+	return compileNode(compiler, NODE_WHILE, condition, body, 0);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    compileFor()
+ *
+ * Description: This function compiles "for name in words do list done".
+ *              The words are compiled as the arguments of a command, and
+ *              are expanded once each time the loop starts.
+ *
+ * Parameters:  compiler - pointer to the compiler state
+ *              rest - the text after "for"
+ *
+ * Returns:     The offset of the node, or 0 on an error.
+ *
+ ************************************************************************/
+unsigned int compileFor(struct compiler *compiler, char *rest) {
+	static char *doStop[] = { "do", NULL };
+	static char *doneStop[] = { "done", NULL };
+	struct compiledCommand *words;
+	unsigned int name;
+	unsigned int list = 0;
+	unsigned int body;
+	size_t length = 0;
+	char *in;
+
+	while (isalnum((unsigned char) rest[length]) || rest[length] == '_')
+		length++;
+
+	in = rest + length + strspn(rest + length, " \t");
+	if (length == 0 || isdigit((unsigned char) rest[0])
+			|| (rest[length] != ' ' && rest[length] != '\t')
+			|| (in = keywordRest(in, "in")) == NULL) {
+		outPrintf(compiler->sh, "for: usage: for name in words\n");
+		compiler->error = 1;
+		return 0;
+	}
+	rest[length] = '\0';
+
+	if ((name = scriptAdd(compiler->script, rest, length + 1, 1)) == 0) {
+		compiler->error = 1;
+		return 0;
+	}
+
+	// The words are those of a single command with no redirections
+	if (*in != '\0' && *in != '#') {
+		list = compileCommand(compiler, in);
+		if (compiler->error)
+			return 0;
+
+		words = (struct compiledCommand *) (compiler->script->data + list);
+		if (words->stageCount > 1 || words->redirectCount > 0 || words->background) {
+			outPrintf(compiler->sh, "for: usage: for name in words\n");
+			compiler->error = 1;
+			return 0;
+		}
+	}
+
+	compiler->depth++;
+
+	// Nothing comes between the words and "do"
+	if (compileList(compiler, doStop) != 0 && !compiler->error) {
+		outPrintf(compiler->sh, "syntax error: expected `do'\n");
+		compiler->error = 1;
+	}
+	body = compiler->error ? 0 : compileList(compiler, doneStop);
+
+	compiler->depth--;
+
+	if (!compiler->error && !compileEnd(compiler, "done"))
+		return 0;
+
+	return compileNode(compiler, NODE_FOR, name, body, list);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    compileEnd()
+ *
+ * Description: This function checks that nothing follows the reserved
+ *              word ending a compound command, other than a ";" or the
+ *              end of the line. A compound command cannot be run in the
+ *              background.
+ *
+ * Parameters:  compiler - pointer to the compiler state
+ *              word - the reserved word
+ *
+ * Returns:     1 if nothing follows, or else 0 after printing a message.
+ *              error member of compiler may be set.
+ *
+ ************************************************************************/
+int compileEnd(struct compiler *compiler, char *word) {
+	char *rest = compiler->pending;
+
+	compiler->pending = NULL;
+	if (compiler->background) {
+		outPrintf(compiler->sh, "syntax error near unexpected token `&'\n");
+		compiler->error = 1;
+		return 0;
+	}
+	if (*rest == '\0' || *rest == '#')
+		return 1;
+
+	outPrintf(compiler->sh, "syntax error: unexpected text after `%s'\n", word);
+	compiler->error = 1;
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    compileNode()
+ *
+ * Description: This function adds a node to the compiled script.
+ *
+ * Parameters:  compiler - pointer to the compiler state
+ *              kind - the kind of node
+ *              first - the first member of the node
+ *              second - the second member of the node
+ *              third - the third member of the node
+ *
+ * Returns:     The offset of the node, or 0 on an error.
+ *
+ ************************************************************************/
+unsigned int compileNode(struct compiler *compiler, int kind, unsigned int first,
+		unsigned int second, unsigned int third) {
+	struct node node;
+	unsigned int offset;
+
+	if (compiler->error)
+		return 0;
+
+	node.kind = kind;
+	node.next = 0;
+	node.first = first;
+	node.second = second;
+	node.third = third;
+
+	if ((offset = scriptAdd(compiler->script, &node, sizeof(node), 8)) == 0)
+		compiler->error = 1;
+	return offset;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    compileCommand()
+ *
+ * Description: This function compiles a simple command. Its words are
+ *              kept as parseInput() finds them with their expansions
+ *              left as written, and a word that holds no "$" or pattern
+ *              has its quotes removed once and for all. The bodies of
+ *              its here-documents are read now and kept.
+ *
+ * Parameters:  compiler - pointer to the compiler state
+ *              text - the command, which is altered
+ *
+ * Returns:     The offset of the compiled command, or 0 on an error.
+ *
+ ************************************************************************/
+unsigned int compileCommand(struct compiler *compiler, char *text) {
+	struct shell *sh = compiler->sh;
+	struct command cmd;
+	struct compiledCommand compiled;
+	struct compiledStage stages[MAX_STAGES];
+	struct compiledWord *words;
+	struct compiledRedirect redirects[MAX_REDIRECTS];
+	struct redirect *redirect;
+	char **arg;
+	char *body;
+	size_t length;
+	unsigned int offset;
+	int stage;
+	int word = 0;
+	int result;
+
+	sh->parseMode = PARSE_RAW;
+	result = parseInput(text, &cmd, sh);
+	sh->parseMode = PARSE_LINE;
+	if (result == -1) {
+		compiler->error = 1;
+		return 0;
+	}
+
+	// parallel and batch read the lines after them unless given other
+	// input, so a script using them cannot be compiled as a whole
+	if (compiler->whole && cmd.stageCount > 0 && shellInput(&cmd.stages[0])) {
+		compiler->error = 1;
+		return 0;
+	}
+
+	compiled.stageCount = cmd.stageCount;
+	compiled.redirectCount = cmd.redirectCount;
+	compiled.background = cmd.background;
+
+	// The words of every stage end with NULL, which is not compiled
+	for (stage = 0; stage < cmd.stageCount; stage++) {
+		for (arg = cmd.stages[stage].argv; *arg != NULL; arg++)
+			word++;
+	}
+	if ((words = malloc((word + 1) * sizeof(*words))) == NULL) {
+		perror("compile");
+		compiler->error = 1;
+		return 0;
+	}
+	word = 0;
+
+	for (stage = 0; stage < cmd.stageCount; stage++) {
+		stages[stage].redirectCount = cmd.stages[stage].redirectCount;
+		stages[stage].wordCount = 0;
+		for (arg = cmd.stages[stage].argv; *arg != NULL; arg++) {
+			words[word].text = compileWord(compiler, *arg, &words[word].expand);
+			stages[stage].wordCount++;
+			word++;
+		}
+	}
+	compiled.wordCount = word;
+
+	for (word = 0; word < cmd.redirectCount; word++) {
+		redirect = &cmd.redirects[word];
+		redirects[word].kind = redirect->kind;
+		redirects[word].fd = redirect->fd;
+		redirects[word].target = compileWord(compiler, redirect->target,
+			&redirects[word].expand);
+		redirects[word].body = 0;
+		redirects[word].bodyLength = 0;
+
+		// The delimiter of a here-document is never expanded
+		if (redirect->kind == HERE_DOC || redirect->kind == HERE_DOC_TABS) {
+			if (!compiler->readLines) {
+				outPrintf(sh, "here-document not allowed here\n");
+				compiler->error = 1;
+				break;
+			}
+			if (compiler->error || redirects[word].expand) {
+				outPrintf(sh, "here-document delimiter must be a plain word\n");
+				compiler->error = 1;
+				break;
+			}
+
+			redirect->target = compiler->script->data + redirects[word].target;
+			if ((body = hereBody(redirect, &length, sh)) == NULL) {
+				compiler->error = 1;
+				break;
+			}
+			redirects[word].body = scriptAdd(compiler->script, body, length + 1, 1);
+			redirects[word].bodyLength = length;
+			free(body);
+		}
+	}
+
+	// The parts are added one after the other, with nothing between them
+	offset = 0;
+	if (!compiler->error)
+		offset = scriptAdd(compiler->script, &compiled, sizeof(compiled), 8);
+	if (offset == 0
+			|| !scriptAdd(compiler->script, stages, compiled.stageCount * sizeof(stages[0]), 8)
+			|| !scriptAdd(compiler->script, words, compiled.wordCount * sizeof(words[0]), 8)
+			|| !scriptAdd(compiler->script, redirects,
+				compiled.redirectCount * sizeof(redirects[0]), 8)) {
+		compiler->error = 1;
+		offset = 0;
+	}
+
+	free(words);
+	return offset;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    shellInput()
+ *
+ * Description: This function checks whether a stage may run parallel or
+ *              batch on the shell's own input. Any word "parallel" or
+ *              "batch" is taken to be the command, as it may follow a
+ *              prefix.
+ *
+ * Parameters:  stage - pointer to the first stage of a command
+ *
+ * Returns:     1 if it may, or else 0.
+ *
+ ************************************************************************/
+int shellInput(struct stage *stage) {
+	char **arg;
+	int redirect;
+
+	for (redirect = 0; redirect < stage->redirectCount; redirect++) {
+		if (stage->redirects[redirect].fd == 0)
+			return 0;
+	}
+
+	for (arg = stage->argv; *arg != NULL; arg++) {
+		if (strcmp(*arg, "parallel") == 0 || strcmp(*arg, "batch") == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    compileWord()
+ *
+ * Description: This function adds a word of a compiled command to the
+ *              script, as written if it is expanded each time the
+ *              command runs, and otherwise without its quotes.
+ *
+ * Parameters:  compiler - pointer to the compiler state
+ *              word - the word as written, which is altered
+ *              expand - pointer to where to store whether it is expanded
+ *
+ * Returns:     The offset of the word, or 0 on an error. error member of
+ *              compiler may be set.
+ *
+ ************************************************************************/
+unsigned int compileWord(struct compiler *compiler, char *word, int *expand) {
+	struct command unquoted;
+	unsigned int offset;
+
+	*expand = (strchr(word, '$') != NULL || isPattern(word, word + strlen(word)));
+
+	// Parsing the word again removes its quotes and backslashes
+	if (!*expand && strpbrk(word, "'\"\\") != NULL) {
+		if (parseInput(word, &unquoted, compiler->sh) == -1) {
+			compiler->error = 1;
+			return 0;
+		}
+		word = unquoted.args[0];
+	}
+
+	if ((offset = scriptAdd(compiler->script, word, strlen(word) + 1, 1)) == 0)
+		compiler->error = 1;
+	return offset;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    nextPiece()
+ *
+ * Description: This function finds the next command to compile, which is
+ *              the command left pending after a reserved word, or else
+ *              the text up to the next unquoted ";" or "&" or the end of
+ *              the line. Inside a compound command more lines are read
+ *              as needed.
+ *
+ * Parameters:  compiler - pointer to the compiler state
+ *
+ * Returns:     The command, or NULL at the end of the line at the top
+ *              level, at the end of input, or on an error. background
+ *              member of compiler is set if the command ended with "&".
+ *
+ ************************************************************************/
+char *nextPiece(struct compiler *compiler) {
+	struct shell *sh = compiler->sh;
+	char *piece;
+	char *end;
+	char *mark;
+	char *line;
+
+	if (compiler->error)
+		return NULL;
+
+	if (compiler->pending != NULL) {
+		piece = compiler->pending;
+		compiler->pending = NULL;
+		return piece;
+	}
+
+	while (compiler->rest == NULL) {
+		if ((compiler->depth == 0 && !compiler->whole) || !compiler->readLines)
+			return NULL;
+
+		if (sh->interactive) {
+			outPrintf(sh, "> ");
+			outFlush(sh);
+		}
+
+		if ((line = getInput(sh)) == NULL)
+			return NULL;
+
+		free(compiler->line);
+		if ((compiler->line = strdup(line)) == NULL) {
+			perror("compile");
+			compiler->error = 1;
+			return NULL;
+		}
+		compiler->rest = compiler->line;
+	}
+
+	// Find the ";" or "&", passing over quotes, escapes, command
+	// substitutions, redirections and a comment
+	piece = compiler->rest;
+	for (end = piece; *end != '\0' && *end != ';'; end++) {
+		if (*end == '&' && end[1] != '>' && (end == piece
+				|| (end[-1] != '>' && end[-1] != '<'))) {
+			break;
+		}
+		else if (*end == '\\' && end[1] != '\0') {
+			end++;
+		}
+		else if (*end == '\'' || *end == '"') {
+			for (mark = end++; *end != '\0' && *end != *mark; end++) {
+				if (*mark == '"' && *end == '\\' && end[1] != '\0')
+					end++;
+			}
+			if (*end == '\0')
+				break;
+		}
+		else if (*end == '$' && end[1] == '(') {
+			if ((mark = substitutionEnd(end + 2)) == NULL) {
+				end += strlen(end);
+				break;
+			}
+			end = mark;
+		}
+		else if (*end == '#' && (end == piece || end[-1] == ' ' || end[-1] == '\t')) {
+			end += strlen(end);
+			break;
+		}
+	}
+
+	compiler->background = (*end == '&');
+	compiler->rest = (*end != '\0') ? end + 1 : NULL;
+	*end = '\0';
+	return piece;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    keywordRest()
+ *
+ * Description: This function checks whether a command begins with a
+ *              reserved word.
+ *
+ * Parameters:  text - the command, without leading blanks
+ *              keyword - the reserved word
+ *
+ * Returns:     The text after the word and the blanks following it, or
+ *              NULL if the command does not begin with the word.
+ *
+ ************************************************************************/
+char *keywordRest(char *text, char *keyword) {
+	while (*keyword != '\0') {
+		if (*text++ != *keyword++)
+			return NULL;
+	}
+
+	if (*text != '\0' && *text != ' ' && *text != '\t')
+		return NULL;
+
+	return text + strspn(text, " \t");
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    scriptAdd()
+ *
+ * Description: This function adds data to the end of a compiled script,
+ *              which is doubled in size whenever it is full. Offset 0 is
+ *              never used, so it can stand for nothing.
+ *
+ * Parameters:  script - pointer to the script
+ *              data - the data
+ *              length - the number of bytes of data
+ *              align - the alignment the data needs, a power of two
+ *
+ * Returns:     The offset of the data, or 0 if memory ran out.
+ *
+ ************************************************************************/
+unsigned int scriptAdd(struct script *script, const void *data, size_t length,
+		size_t align) {
+	size_t offset = (script->used + align - 1) & ~(align - 1);
+	size_t size = script->size;
+	char *grown;
+
+	if (offset + length > size) {
+		while (offset + length > size)
+			size = size ? size * 2 : SCRIPT_BLOCK;
+
+		if (size > UINT_MAX || (grown = realloc(script->data, size)) == NULL) {
+			perror("compile");
+			return 0;
+		}
+		script->data = grown;
+		script->size = size;
+	}
+
+	memcpy(script->data + offset, data, length);
+	script->used = offset + length;
+	return offset;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    runList()
+ *
+ * Description: This function runs a list of compiled nodes. A loop, and
+ *              every list it is in, stops once a command is interrupted
+ *              by SIGINT.
+ *
+ * Parameters:  script - pointer to the compiled script
+ *              offset - the offset of the first node of the list, or 0
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0, or -1 once a command was interrupted. status and
+ *              termination members of sh are altered.
+ *
+ ************************************************************************/
+int runList(struct script *script, unsigned int offset, struct shell *sh) {
+	struct node *node;
+
+	for (; offset != 0; offset = node->next) {
+		node = (struct node *) (script->data + offset);
+		if (runNode(script, node, sh) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    runNode()
+ *
+ * Description: This function runs a compiled node. The condition of an
+ *              if or a while holds if its last command had an exit
+ *              status of 0.
+ *
+ * Parameters:  script - pointer to the compiled script
+ *              node - pointer to the node
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0, or -1 once a command was interrupted. status and
+ *              termination members of sh are altered.
+ *
+ ************************************************************************/
+int runNode(struct script *script, struct node *node, struct shell *sh) {
+	unsigned int offset;
+	char **words;
+	int position;
+	int status;
+
+	switch (node->kind) {
+	case NODE_COMMAND:
+		return runCommand(script, node->first, sh);
+	case NODE_IF:
+		if (runList(script, node->first, sh) == -1)
+			return -1;
+
+		// With no branch taken the status is 0
+		if (sh->status == EXIT_SUCCESS && sh->termination == 0)
+			offset = node->second;
+		else
+			offset = node->third;
+		sh->status = EXIT_SUCCESS;
+		sh->termination = 0;
+		return runList(script, offset, sh);
+	case NODE_WHILE:
+		status = EXIT_SUCCESS;
+		for (;;) {
+			if (runList(script, node->first, sh) == -1)
+				return -1;
+			if (sh->status != EXIT_SUCCESS || sh->termination != 0)
+				break;
+
+			if (runList(script, node->second, sh) == -1)
+				return -1;
+			status = sh->status;
+		}
+		sh->status = status;
+		sh->termination = 0;
+		break;
+	case NODE_FOR:
+		if ((words = loopWords(script, node->third, sh)) == NULL) {
+			sh->status = EXIT_FAILURE;
+			break;
+		}
+
+		sh->status = EXIT_SUCCESS;
+		sh->termination = 0;
+		for (position = 0; words[position] != NULL; position++) {
+			setenv(script->data + node->first, words[position], 1);
+			if (runList(script, node->second, sh) == -1) {
+				free(words);
+				return -1;
+			}
+		}
+		free(words);
+		break;
+	}
+
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    runCommand()
+ *
+ * Description: This function runs a compiled simple command, after
+ *              reporting background processes that have finished. As in
+ *              runSubstitution(), exit and exec are refused inside a
+ *              command substitution.
+ *
+ * Parameters:  script - pointer to the compiled script
+ *              offset - the offset of the compiled command
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0, or -1 if the command was interrupted by SIGINT. status
+ *              and termination members of sh are altered.
+ *
+ ************************************************************************/
+int runCommand(struct script *script, unsigned int offset, struct shell *sh) {
+	struct command cmd;
+	int builtin;
+
+	reapBackground(sh);
+
+	if (buildCommand(script, offset, &cmd, sh) == -1) {
+		sh->status = EXIT_FAILURE;
+		return 0;
+	}
+
+	builtin = (cmd.stageCount == 1 && sh->substituting > 0)
+		? findBuiltin(cmd.stages[0].argv[0]) : BUILTIN_NONE;
+	if (builtin == BUILTIN_EXIT || builtin == BUILTIN_EXEC) {
+		outPrintf(sh, "%s: not allowed in a command substitution\n",
+			cmd.stages[0].argv[0]);
+		closeHereDocs(&cmd);
+		sh->status = EXIT_FAILURE;
+		return 0;
+	}
+
+	// A background command leaves the termination of the one before
+	sh->termination = 0;
+	processArgs(&cmd, sh);
+	closeHereDocs(&cmd);
+
+	return (sh->termination == SIGINT) ? -1 : 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    loopWords()
+ *
+ * Description: This function expands the words of a for loop into a
+ *              copy, as the loop body reuses the arena they are built in.
+ *
+ * Parameters:  script - pointer to the compiled script
+ *              offset - the offset of the compiled words, or 0 for none
+ *              sh - pointer to the shell state
+ *
+ * Returns:     An array of the words ending with NULL, followed by the
+ *              words themselves, to be freed by the caller, or NULL on
+ *              an error.
+ *
+ ************************************************************************/
+char **loopWords(struct script *script, unsigned int offset, struct shell *sh) {
+	struct command cmd;
+	char **words;
+	char *end;
+	size_t length = 0;
+	int count = 0;
+	int position;
+
+	cmd.stageCount = 0;
+	if (offset != 0 && buildCommand(script, offset, &cmd, sh) == -1)
+		return NULL;
+
+	if (cmd.stageCount > 0) {
+		for (; cmd.args[count] != NULL; count++)
+			length += strlen(cmd.args[count]) + 1;
+	}
+
+	words = malloc((count + 1) * sizeof(*words) + length);
+	if (words == NULL) {
+		perror("for");
+		return NULL;
+	}
+
+	end = (char *) (words + count + 1);
+	for (position = 0; position < count; position++) {
+		words[position] = end;
+		end = stpcpy(end, cmd.args[position]) + 1;
+	}
+	words[count] = NULL;
+
+	return words;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    buildCommand()
+ *
+ * Description: This function makes a command to run from a compiled one.
+ *              The words kept as written are expanded, and the rest are
+ *              used where they are in the script.
+ *
+ * Parameters:  script - pointer to the compiled script
+ *              offset - the offset of the compiled command
+ *              cmd - pointer to the command to make
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0 on success, or -1 after printing a message. cmd and the
+ *              arena and dirs members of sh are altered.
+ *
+ ************************************************************************/
+int buildCommand(struct script *script, unsigned int offset, struct command *cmd,
+		struct shell *sh) {
+	struct compiledCommand *compiled = (struct compiledCommand *) (script->data + offset);
+	struct compiledStage *stages = (struct compiledStage *) (compiled + 1);
+	struct compiledWord *words = (struct compiledWord *) (stages + compiled->stageCount);
+	struct compiledRedirect *redirects
+		= (struct compiledRedirect *) (words + compiled->wordCount);
+	struct command expanded;        // A word of the command, expanded
+	struct stage *stage;
+	struct redirect *redirect;
+	char *body;
+	size_t length;
+	int position = 0;
+	int count;
+	int index;
+	int expandedCount;
+
+	if (sh->substituting == 0)
+		arenaReset(sh);
+	argInit(cmd);
+	cmd->stageCount = 0;
+	cmd->redirectCount = compiled->redirectCount;
+	cmd->background = compiled->background;
+	cmd->timed = 0;
+	cmd->placement = NULL;
+
+	for (index = 0; index < compiled->redirectCount; index++) {
+		cmd->redirects[index].hereFd = -1;
+		cmd->redirects[index].quoted = 0;
+	}
+
+	// The stages are counted as they are made, as argAdd() moves them
+	redirect = cmd->redirects;
+	for (stage = cmd->stages; stage < cmd->stages + compiled->stageCount; stage++) {
+		stage->argv = &cmd->args[position];
+		stage->redirects = redirect;
+		stage->redirectCount = stages->redirectCount;
+
+		for (count = stages->wordCount; count > 0; count--, words++) {
+			if (!words->expand) {
+				if (argAdd(cmd, &position, script->data + words->text, sh) == -1) {
+					closeHereDocs(cmd);
+					return -1;
+				}
+				continue;
+			}
+
+			if ((expandedCount = expandWord(script->data + words->text, &expanded,
+					PARSE_WORD, sh)) == -1) {
+				closeHereDocs(cmd);
+				return -1;
+			}
+			for (index = 0; index < expandedCount; index++) {
+				if (argAdd(cmd, &position, expanded.args[index], sh) == -1) {
+					closeHereDocs(cmd);
+					return -1;
+				}
+			}
+		}
+
+		for (count = stages->redirectCount; count > 0; count--, redirects++) {
+			redirect->kind = redirects->kind;
+			redirect->fd = redirects->fd;
+			redirect->target = script->data + redirects->target;
+
+			// A target expands to a single word, which is not globbed
+			if (redirects->expand) {
+				if ((expandedCount = expandWord(redirect->target, &expanded,
+						PARSE_TARGET, sh)) <= 0) {
+					if (expandedCount == 0)
+						outPrintf(sh, "syntax error near unexpected token `newline'\n");
+					closeHereDocs(cmd);
+					return -1;
+				}
+				redirect->target = expanded.args[0];
+			}
+
+			// The delimiter of a compiled here-document is a plain
+			// word, so its contents are expanded every time
+			if (redirects->body != 0) {
+				length = redirects->bodyLength;
+				if ((body = hereExpand(script->data + redirects->body, &length, sh)) == NULL) {
+					closeHereDocs(cmd);
+					return -1;
+				}
+
+				redirect->hereFd = hereInput(body, length);
+				if (redirect->hereFd == -1) {
+					perror("here-document");
+					closeHereDocs(cmd);
+					return -1;
+				}
+			}
+			redirect++;
+		}
+
+		// A command whose words all expanded to nothing is a blank line,
+		// unless it is part of a pipeline or has redirections
+		if (stage->argv == &cmd->args[position]) {
+			if (compiled->stageCount == 1 && cmd->redirectCount == 0
+					&& !cmd->background)
+				return 0;
+
+			outPrintf(sh, "syntax error near unexpected token `%s'\n",
+				(stage < cmd->stages + compiled->stageCount - 1) ? "|" : "newline");
+			closeHereDocs(cmd);
+			return -1;
+		}
+		cmd->args[position++] = NULL;
+		cmd->stageCount++;
+		stages++;
+	}
+
+	// Here-strings are made from their expanded words
+	return readHereDocs(cmd, 0, sh);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    expandWord()
+ *
+ * Description: This function expands a word of a compiled command by
+ *              parsing a copy of it in the arena, where the words of the
+ *              command already expanded are kept.
+ *
+ * Parameters:  word - the word, as written
+ *              expanded - pointer to the command to parse it into
+ *              mode - PARSE_WORD, or PARSE_TARGET for a single word that
+ *                     is not globbed
+ *              sh - pointer to the shell state
+ *
+ * Returns:     The number of words it expanded to, or -1 after printing a
+ *              message. expanded and the arena member of sh are altered.
+ *
+ ************************************************************************/
+int expandWord(char *word, struct command *expanded, int mode, struct shell *sh) {
+	size_t length = strlen(word) + 1;
+	char *copy;
+	int result;
+	int count = 0;
+
+	if ((copy = arenaAlloc(length, 1, sh)) == NULL)
+		return -1;
+	memcpy(copy, word, length);
+
+	sh->parseMode = mode;
+	result = parseInput(copy, expanded, sh);
+	sh->parseMode = PARSE_LINE;
+	if (result == -1)
+		return -1;
+
+	while (expanded->stageCount > 0 && expanded->args[count] != NULL)
+		count++;
+
+	return count;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function: 	processArgs()
+ *
+ * Description: This function evaluates the first argument of a parsed
+ *              command. A blank line or a commented line has no stages
+ *              and is ignored. All other lines are commands and the
+ *              function determines whether the command is built in or
+ *              not. The command is sent to the appropriate function for
+ *              execution. Pipelines are always executed.
+ *
+ * Parameters:	cmd - pointer to a command
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None.
+ *
+ ************************************************************************/
+void processArgs(struct command *cmd, struct shell *sh) {
+	struct stage *stage = cmd->stages;
+	struct redirect *redirect;
+	struct fdPlan plan;             // Descriptors of a built in command
+	char **args = stage->argv;
+	int builtin = BUILTIN_NONE;
+	int result;
+	long long started = 0;          // When a traced redirection started
+
+	if (cmd->stageCount == 0) {
+		// If the user input is a blank line or a commented line
+		// (beginning with #), do nothing and return to the shell prompt.
+		return;
+	}
+
+	// A command of NAME=value words sets variables rather than running
+	if (cmd->stageCount == 1 && !cmd->background && isAssignment(args[0], NULL)) {
+		cmdAssign(args, sh);
+		return;
+	}
+
+	// A command beginning with "time" is measured as it runs
+	if (!cmd->timed && strcmp(args[0], "time") == 0) {
+		cmdTime(cmd, sh);
+		return;
+	}
+
+	// As does one beginning with the prefixes that place its processes
+	if (isPrefix(args[0])) {
+		cmdPlace(cmd, sh);
+		return;
+	}
+
+	// Pipelines are always executed. The common utilities are only run
+	// in the shell when in the foreground with their input not
+	// redirected and not placed, and otherwise are executed as programs.
+	if (cmd->stageCount == 1)
+		builtin = findBuiltin(args[0]);
+	if (builtin >= BUILTIN_ECHO && (cmd->background == 1 || cmd->placement != NULL))
+		builtin = BUILTIN_NONE;
+	for (redirect = stage->redirects; builtin >= BUILTIN_ECHO
+			&& redirect < stage->redirects + stage->redirectCount; redirect++) {
+		if (redirect->fd == 0)
+			builtin = BUILTIN_NONE;
+	}
+
+	// Replace the shell with the command, rather than start it and wait
+	if (builtin == BUILTIN_EXEC || (builtin == BUILTIN_NONE && sh->execLast
+			&& cmd->stageCount == 1 && !cmd->background && !cmd->timed)) {
+		if (builtin == BUILTIN_EXEC)
+			stage->argv++;
+		cmdExec(stage, cmd->placement, sh);
+		return;
+	}
+
+	if (builtin == BUILTIN_NONE) {
+		// Attempt to execute the given command
+		cmdExecute(cmd, sh);
+		return;
+	}
+
+	// Make the redirections of the built in command. Every file is
+	// opened, but only stdout is used, as the output of the command.
+	planInit(&plan);
+	if (stage->redirectCount > 0) {
+		if (sh->trace != NULL)
+			started = traceClock();
+		result = planRedirects(&plan, stage, sh);
+		if (sh->trace != NULL)
+			traceRecord(sh->trace, TRACE_REDIRECT, started);
+
+		if (result == -1) {
+			sh->status = EXIT_FAILURE;
+			return;
+		}
+
+		if (plan.changed & (1u << 1)) {
+			outFlush(sh);
+			sh->output.fd = plan.fds[1];
+		}
+	}
+
+	if (sh->stats != NULL)
+		statsAdd(&sh->stats->builtins, 1);
+
+	switch (builtin) {
+	case BUILTIN_CD:
+		// Execute the change directory command
+		cmdChangeDir(args, sh);
+		break;
+	case BUILTIN_STATUS:
+		// Execute the status command
+		cmdStatus(sh);
+		break;
+	case BUILTIN_STATS:
+		// Execute the stats command
+		cmdStats(args, sh);
+		break;
+	case BUILTIN_EXIT:
+		// Execute the exit command
+		cmdExit(sh);
+		break;
+	case BUILTIN_HASH:
+		// Execute the hash command
+		cmdHash(args, sh);
+		break;
+	case BUILTIN_HISTORY:
+		// Execute the history command
+		cmdHistory(args, sh);
+		break;
+	case BUILTIN_PARALLEL:
+		// Execute the parallel command
+		cmdParallel(args, (plan.changed & (1u << 0)) ? plan.fds[0] : -1,
+			cmd->placement, sh);
+		break;
+	case BUILTIN_BATCH:
+		// Execute the batch command
+		cmdBatch(args, (plan.changed & (1u << 0)) ? plan.fds[0] : -1,
+			cmd->placement, sh);
+		break;
+	case BUILTIN_JOBS:
+		cmdJobs(sh);
+		break;
+	case BUILTIN_WAIT:
+		cmdWait(args, sh);
+		break;
+	case BUILTIN_FG:
+		cmdForeground(args, sh);
+		break;
+	case BUILTIN_BG:
+		cmdBackground(args, sh);
+		break;
+	case BUILTIN_KILL:
+		cmdKill(args, sh);
+		break;
+	case BUILTIN_ECHO:
+		cmdEcho(args, sh);
+		break;
+	case BUILTIN_PWD:
+		cmdPwd(sh);
+		break;
+	case BUILTIN_TRUE:
+	case BUILTIN_FALSE:
+		sh->status = (builtin == BUILTIN_TRUE) ? EXIT_SUCCESS : EXIT_FAILURE;
+		sh->termination = 0;
+		break;
+	case BUILTIN_TEST:
+		cmdTest(args, sh);
+		break;
+	case BUILTIN_PRINTF:
+		cmdPrintf(args, sh);
+		break;
+	}
+
+	if (plan.changed & (1u << 1)) {
+		outFlush(sh);
+		sh->output.fd = 1;
+	}
+	planClose(&plan);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdTime()
+ *
+ * Description: This function executes the built in prefix "time". The
+ *              rest of the command is run, and the wall clock time it
+ *              took is reported along with the user and system CPU time,
+ *              largest resident set size, and voluntary and involuntary
+ *              context switches of the processes that were waited for.
+ *              The CPU time the shell itself spent, such as running a
+ *              built in command, is included. A background command
+ *              reports its usage when it is done.
+ *
+ * Parameters:  cmd - pointer to a command beginning with "time"
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status, termination, and jobs members of sh may
+ *              be altered.
+ *
+ ************************************************************************/
+void cmdTime(struct command *cmd, struct shell *sh) {
+	struct timespec start;
+	struct rusage usage;            // Totals for the command
+	struct rusage before;           // Usage of the shell before the command
+	struct rusage self;             // Usage of the shell after the command
+
+	// Remove "time" from the front of the command
+	cmd->stages[0].argv++;
+	cmd->timed = 1;
+
+	if (cmd->stages[0].argv[0] == NULL) {
+		outPrintf(sh, "time: usage: time command [arguments]\n");
+		sh->status = EXIT_FAILURE;
+		sh->termination = 0;
+		return;
+	}
+
+	memset(&usage, 0, sizeof(usage));
+	getrusage(RUSAGE_SELF, &before);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	sh->usage = &usage;
+	processArgs(cmd, sh);
+	sh->usage = NULL;
+
+	// A background job is reported when it finishes
+	if (cmd->background)
+		return;
+
+	getrusage(RUSAGE_SELF, &self);
+	timersub(&self.ru_utime, &before.ru_utime, &self.ru_utime);
+	timersub(&self.ru_stime, &before.ru_stime, &self.ru_stime);
+	self.ru_nvcsw -= before.ru_nvcsw;
+	self.ru_nivcsw -= before.ru_nivcsw;
+	self.ru_maxrss = 0;
+	usageAdd(&usage, &self);
+
+	usageReport(sh, &start, &usage);
+	outPrintf(sh, "\n");
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    usageAdd()
+ *
+ * Description: This function adds the resources used by a process to a
+ *              total. CPU time and context switches are summed, and the
+ *              largest resident set size is kept.
+ *
+ * Parameters:  total - pointer to the total
+ *              usage - pointer to the usage to add
+ *
+ * Returns:     None. total is altered.
+ *
+ ************************************************************************/
+void usageAdd(struct rusage *total, struct rusage *usage) {
+	timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+	timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+	total->ru_nvcsw += usage->ru_nvcsw;
+	total->ru_nivcsw += usage->ru_nivcsw;
+	if (usage->ru_maxrss > total->ru_maxrss)
+		total->ru_maxrss = usage->ru_maxrss;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    usageReport()
+ *
+ * Description: This function prints the wall clock time since a command
+ *              started and the resources it used, on a single line
+ *              without a newline.
+ *
+ * Parameters:  sh - pointer to the shell state
+ *              start - when the command started, from CLOCK_MONOTONIC
+ *              usage - pointer to the resources used
+ *
+ * Returns:     None.
+ *
+ ************************************************************************/
+void usageReport(struct shell *sh, struct timespec *start, struct rusage *usage) {
+	struct timespec now;
+	long long wall;                 // Elapsed time in microseconds
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wall = (now.tv_sec - start->tv_sec) * 1000000LL
+		+ (now.tv_nsec - start->tv_nsec) / 1000;
+
+	outPrintf(sh, "real %lld.%06llds user %ld.%06lds sys %ld.%06lds "
+		"maxrss %ldk switches %ld/%ld",
+		wall / 1000000, wall % 1000000,
+		(long) usage->ru_utime.tv_sec, (long) usage->ru_utime.tv_usec,
+		(long) usage->ru_stime.tv_sec, (long) usage->ru_stime.tv_usec,
+		usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdPlace()
+ *
+ * Description: This function runs a command given after the prefixes
+ *              that place its processes. "pin cpus" runs them on the
+ *              listed CPUs, such as "0-7,16", and "numa node" takes
+ *              memory only from the NUMA node, on its CPUs unless they
+ *              are pinned. "limit resource=value" sets a resource limit,
+ *              any number of them, for mem, stack or core in bytes with
+ *              an optional K, M, G or T, cpu in seconds, or files or
+ *              procs. "cgroup path" moves the processes into a cgroup v2
+ *              group, relative to /sys/fs/cgroup. The prefixes may be
+ *              combined, and the later of two of a kind is used.
+ *              Programs started by the command, including the jobs of
+ *              parallel, are placed, while the other built in commands
+ *              run unchanged.
+ *
+ * Parameters:  cmd - pointer to a command beginning with the prefixes
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status and termination members of sh may be
+ *              altered. The arguments of cmd are altered.
+ *
+ ************************************************************************/
+void cmdPlace(struct command *cmd, struct shell *sh) {
+	struct placement placement;
+	struct placement *outer = cmd->placement;  // As in "pin 0 time numa 0"
+	char **args = cmd->stages[0].argv;
+	char *prefix = args[0];
+	char *end;
+	int position;
+
+	sh->status = EXIT_FAILURE;
+	sh->termination = 0;
+
+	if (outer != NULL) {
+		placement = *outer;
+	}
+	else {
+		CPU_ZERO(&placement.cpus);
+		placement.pinned = 0;
+		placement.node = -1;
+		placement.limitCount = 0;
+		placement.cgroup = NULL;
+	}
+
+	while (args[0] != NULL && isPrefix(args[0])) {
+		prefix = args[0];
+		position = 1;
+
+		if (strcmp(prefix, "pin") == 0) {
+			if (args[1] == NULL || parseCpuList(args[1], &placement.cpus) == -1) {
+				outPrintf(sh, "pin: usage: pin cpus command\n");
+				return;
+			}
+			placement.pinned = 1;
+			position++;
+		}
+		else if (strcmp(prefix, "numa") == 0) {
+			if (args[1] == NULL || (placement.node = strtol(args[1], &end, 10)) < 0
+					|| placement.node >= NUMA_NODES || *end != '\0' || end == args[1]) {
+				outPrintf(sh, "numa: usage: numa node command\n");
+				return;
+			}
+			position++;
+		}
+		else if (strcmp(prefix, "cgroup") == 0) {
+			if (args[1] == NULL) {
+				outPrintf(sh, "cgroup: usage: cgroup path command\n");
+				return;
+			}
+			placement.cgroup = args[1];
+			position++;
+		}
+		else {
+			while (args[position] != NULL && strchr(args[position], '=') != NULL) {
+				if (parseLimit(args[position], &placement, sh) == -1)
+					return;
+				position++;
+			}
+
+			if (position == 1) {
+				outPrintf(sh, "limit: usage: limit resource=value... command\n");
+				return;
+			}
+		}
+
+		args += position;
+	}
+
+	if (args[0] == NULL) {
+		outPrintf(sh, "%s: usage: %s ... command\n", prefix, prefix);
+		return;
+	}
+
+	// Without pinned CPUs a NUMA node runs on its own, if it has any
+	if (placement.node != -1 && !placement.pinned) {
+		if (nodeCpus(placement.node, &placement.cpus) == -1) {
+			outPrintf(sh, "numa: %d: no such node\n", placement.node);
+			return;
+		}
+		placement.pinned = (CPU_COUNT(&placement.cpus) > 0);
+	}
+
+	sh->status = EXIT_SUCCESS;
+	cmd->stages[0].argv = args;
+	cmd->placement = &placement;
+	processArgs(cmd, sh);
+	cmd->placement = outer;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    isPrefix()
+ *
+ * Description: This function checks whether a word is one of the
+ *              prefixes handled by cmdPlace().
+ *
+ * Parameters:  word - the word
+ *
+ * Returns:     1 if the word is a prefix, or else 0.
+ *
+ ************************************************************************/
+int isPrefix(char *word) {
+	switch (word[0]) {
+	case 'p':
+		return strcmp(word, "pin") == 0;
+	case 'n':
+		return strcmp(word, "numa") == 0;
+	case 'l':
+		return strcmp(word, "limit") == 0;
+	case 'c':
+		return strcmp(word, "cgroup") == 0;
+	}
+
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdAssign()
+ *
+ * Description: This function sets the variables of a command made of
+ *              NAME=value words, such as x=$(pwd). The variables are
+ *              those of the environment, which is where $NAME is read
+ *              from, so they are passed on to the commands started
+ *              after. Assignments made only for the command that follows
+ *              them are not supported, and nothing is set if there is
+ *              such a command.
+ *
+ * Parameters:  args - the words of the command
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status and termination members of sh are altered.
+ *
+ ************************************************************************/
+void cmdAssign(char *args[], struct shell *sh) {
+	char **arg;
+	size_t length;
+
+	sh->termination = 0;
+	for (arg = args; *arg != NULL; arg++) {
+		if (!isAssignment(*arg, NULL)) {
+			outPrintf(sh, "%s: assignments before a command are not supported\n", *arg);
+			sh->status = EXIT_FAILURE;
+			return;
+		}
+	}
+
+	sh->status = EXIT_SUCCESS;
+	for (arg = args; *arg != NULL; arg++) {
+		length = strchr(*arg, '=') - *arg;
+		(*arg)[length] = '\0';
+		if (setenv(*arg, *arg + length + 1, 1) == -1) {
+			perror("setenv");
+			sh->status = EXIT_FAILURE;
+		}
+		(*arg)[length] = '=';
+	}
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    isAssignment()
+ *
+ * Description: This function checks whether a word is an assignment, a
+ *              name made of letters, digits and underscores, not starting
+ *              with a digit, followed by "=".
+ *
+ * Parameters:  word - the word
+ *              end - the end of the word, or NULL if it ends with a null
+ *
+ * Returns:     1 if the word is an assignment, or else 0.
+ *
+ ************************************************************************/
+int isAssignment(char *word, char *end) {
+	if (word == end || (!isalpha((unsigned char) *word) && *word != '_'))
+		return 0;
+
+	while (word != end && (isalnum((unsigned char) *word) || *word == '_'))
+		word++;
+
+	return word != end && *word == '=';
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    parseCpuList()
+ *
+ * Description: This function reads a list of CPUs, such as "0-7,16", as
+ *              written by the pin prefix and in /sys.
+ *
+ * Parameters:  text - the list
+ *              cpus - pointer to the set of CPUs
+ *
+ * Returns:     0 on success, or -1 if the list is not valid. cpus is
+ *              altered.
+ *
+ ************************************************************************/
+int parseCpuList(char *text, cpu_set_t *cpus) {
+	char *end;
+	long first;
+	long last;
+
+	CPU_ZERO(cpus);
+	for (;;) {
+		first = last = strtol(text, &end, 10);
+		if (end == text || first < 0)
+			return -1;
+
+		if (*end == '-') {
+			text = end + 1;
+			last = strtol(text, &end, 10);
+			if (end == text || last < first)
+				return -1;
+		}
+
+		if (last >= CPU_SETSIZE)
+			return -1;
+		for (; first <= last; first++)
+			CPU_SET(first, cpus);
+
+		if (*end != ',')
+			break;
+		text = end + 1;
+	}
+
+	return (*end == '\0' || *end == '\n') ? 0 : -1;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    nodeCpus()
+ *
+ * Description: This function finds the CPUs of a NUMA node, of which a
+ *              node holding only memory has none.
+ *
+ * Parameters:  node - the node
+ *              cpus - pointer to the set of CPUs
+ *
+ * Returns:     0 on success, or -1 if the node does not exist. cpus is
+ *              altered.
+ *
+ ************************************************************************/
+int nodeCpus(int node, cpu_set_t *cpus) {
+	char path[64];
+	char list[4096];
+	ssize_t length;
+	int fd;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+		return -1;
+
+	length = read(fd, list, sizeof(list) - 1);
+	close(fd);
+	if (length < 0)
+		length = 0;
+
+	list[length] = '\0';
+	if (parseCpuList(list, cpus) == -1)
+		CPU_ZERO(cpus);
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    parseLimit()
+ *
+ * Description: This function reads a resource limit given to the limit
+ *              prefix, such as "mem=4G".
+ *
+ * Parameters:  text - the limit
+ *              placement - pointer to the placement the limit is added to
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0 on success, or -1 after printing a message. placement
+ *              is altered.
+ *
+ ************************************************************************/
+int parseLimit(char *text, struct placement *placement, struct shell *sh) {
+	static const struct {
+		char *name;
+		int resource;
+		int sized;                      // Whether K, M, G and T may follow
+	} resources[] = {
+		{ "mem", RLIMIT_AS, 1 },
+		{ "stack", RLIMIT_STACK, 1 },
+		{ "core", RLIMIT_CORE, 1 },
+		{ "cpu", RLIMIT_CPU, 0 },
+		{ "files", RLIMIT_NOFILE, 0 },
+		{ "procs", RLIMIT_NPROC, 0 }
+	};
+	char *value = strchr(text, '=') + 1;
+	char *end;
+	unsigned long long number;
+	size_t kind;
+	int shift;
+	int slot;
+
+	for (kind = 0; kind < sizeof(resources) / sizeof(resources[0]); kind++) {
+		if (strncmp(text, resources[kind].name, value - 1 - text) == 0
+				&& resources[kind].name[value - 1 - text] == '\0')
+			break;
+	}
+
+	if (kind == sizeof(resources) / sizeof(resources[0])) {
+		outPrintf(sh, "limit: %s: unknown resource\n", text);
+		return -1;
+	}
+
+	if (strcmp(value, "unlimited") == 0) {
+		number = RLIM_INFINITY;
+	}
+	else {
+		errno = 0;
+		number = strtoull(value, &end, 10);
+		if (resources[kind].sized && *end != '\0' && strchr("KMGT", *end) != NULL) {
+			shift = 10 * (strchr("KMGT", *end) - "KMGT" + 1);
+			if (number > (RLIM_INFINITY >> shift))
+				errno = ERANGE;
+			number <<= shift;
+			end++;
+		}
+
+		if (end == value || *end != '\0' || *value == '-' || errno != 0) {
+			outPrintf(sh, "limit: %s: invalid value\n", text);
+			return -1;
+		}
+	}
+
+	// A limit given again replaces the first
+	for (slot = 0; slot < placement->limitCount; slot++) {
+		if (placement->limits[slot].resource == resources[kind].resource)
+			break;
+	}
+	if (slot == placement->limitCount)
+		placement->limitCount++;
+
+	placement->limits[slot].resource = resources[kind].resource;
+	placement->limits[slot].value = number;
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    placeProcess()
+ *
+ * Description: This function places the calling process as described,
+ *              and is run in a child before it executes its command. The
+ *              CPUs and the NUMA node can also be set in the shell around
+ *              posix_spawn(), as they are inherited and can be put back,
+ *              so the limits and the cgroup may be left out.
+ *
+ * Parameters:  placement - pointer to the placement
+ *              all - whether the limits and the cgroup are set as well
+ *
+ * Returns:     0 on success, or -1 with errno set.
+ *
+ ************************************************************************/
+int placeProcess(struct placement *placement, int all) {
+	struct rlimit limit;
+	unsigned long nodes;
+	char path[PATH_MAX];
+	int slot;
+	int fd;
+
+	if (placement->pinned && sched_setaffinity(0, sizeof(placement->cpus),
+			&placement->cpus) == -1)
+		return -1;
+
+	if (placement->node != -1) {
+		nodes = 1UL << placement->node;
+		if (syscall(SYS_set_mempolicy, MPOL_BIND, &nodes, NUMA_NODES + 1) == -1)
+			return -1;
+	}
+
+	if (!all)
+		return 0;
+
+	for (slot = 0; slot < placement->limitCount; slot++) {
+		limit.rlim_cur = limit.rlim_max = placement->limits[slot].value;
+		if (setrlimit(placement->limits[slot].resource, &limit) == -1)
+			return -1;
+	}
+
+	// Writing "0" to cgroup.procs moves the writer into the group
+	if (placement->cgroup != NULL) {
+		snprintf(path, sizeof(path), "%s%s/cgroup.procs",
+			(placement->cgroup[0] == '/') ? "" : "/sys/fs/cgroup/",
+			placement->cgroup);
+		if ((fd = open(path, O_WRONLY|O_CLOEXEC)) == -1)
+			return -1;
+		if (write(fd, "0", 1) != 1) {
+			close(fd);
+			return -1;
+		}
+		close(fd);
+	}
+
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    findBuiltin()
+ *
+ * Description: This function determines whether a command is built into
+ *              the shell. The first character selects the one or two
+ *              built in commands the name could be, so at most two
+ *              string comparisons are made.
+ *
+ * Parameters:  name - the command name
+ *
+ * Returns:     The built in command, or BUILTIN_NONE.
+ *
+ ************************************************************************/
+int findBuiltin(char *name) {
+	switch (name[0]) {
+	case '[':
+		return (name[1] == '\0') ? BUILTIN_TEST : BUILTIN_NONE;
+	case 'b':
+		if (strcmp(name, "bg") == 0)
+			return BUILTIN_BG;
+		return (strcmp(name, "batch") == 0) ? BUILTIN_BATCH : BUILTIN_NONE;
+	case 'c':
+		return (strcmp(name, "cd") == 0) ? BUILTIN_CD : BUILTIN_NONE;
+	case 'e':
+		if (strcmp(name, "echo") == 0)
+			return BUILTIN_ECHO;
+		if (strcmp(name, "exec") == 0)
+			return BUILTIN_EXEC;
+		return (strcmp(name, "exit") == 0) ? BUILTIN_EXIT : BUILTIN_NONE;
+	case 'f':
+		if (strcmp(name, "fg") == 0)
+			return BUILTIN_FG;
+		return (strcmp(name, "false") == 0) ? BUILTIN_FALSE : BUILTIN_NONE;
+	case 'h':
+		if (strcmp(name, "hash") == 0)
+			return BUILTIN_HASH;
+		return (strcmp(name, "history") == 0) ? BUILTIN_HISTORY : BUILTIN_NONE;
+	case 'j':
+		return (strcmp(name, "jobs") == 0) ? BUILTIN_JOBS : BUILTIN_NONE;
+	case 'k':
+		return (strcmp(name, "kill") == 0) ? BUILTIN_KILL : BUILTIN_NONE;
+	case 'p':
+		if (strcmp(name, "pwd") == 0)
+			return BUILTIN_PWD;
+		if (strcmp(name, "parallel") == 0)
+			return BUILTIN_PARALLEL;
+		return (strcmp(name, "printf") == 0) ? BUILTIN_PRINTF : BUILTIN_NONE;
+	case 's':
+		if (strcmp(name, "status") == 0)
+			return BUILTIN_STATUS;
+		return (strcmp(name, "stats") == 0) ? BUILTIN_STATS : BUILTIN_NONE;
+	case 't':
+		if (strcmp(name, "true") == 0)
+			return BUILTIN_TRUE;
+		return (strcmp(name, "test") == 0) ? BUILTIN_TEST : BUILTIN_NONE;
+	case 'w':
+		return (strcmp(name, "wait") == 0) ? BUILTIN_WAIT : BUILTIN_NONE;
+	default:
+		return BUILTIN_NONE;
+	}
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdChangeDir()
+ *
+ * Description: This function changes the working directory to a path
+ *              specified by the user. The function supports absolute
+ *              and relative paths. If the path is not valid, an error
+ *              message is printed.
+ *
+ * Parameters:  args - an array of char*
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status and termination members of sh are altered.
+ *
+ ************************************************************************/
+void cmdChangeDir(char *args[], struct shell *sh) {
+	char *homeDir;
+
+	sh->status = EXIT_SUCCESS;
+	sh->termination = 0;
+
+	if (args[1] == NULL) {
+		// If no destination directory is specified change to the
+		// users home directory
+		homeDir = getenv("HOME");
+		if (homeDir != NULL)
+			chdir(homeDir);
+	}
+	else {
+		// Attempt to change to specified directory
+		if (chdir(args[1]) == -1) {
+			outPrintf(sh, "cd: %s: No such file or directory\n", args[1]);
+			sh->status = EXIT_FAILURE;
+		}
+	}
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdStatus()
+ *
+ * Description: This function executes the build in command "status". If
+ *              the previous command exited normally, its exit status
+ *              is displayed. Otherwise, if it was terminated by a signal,
+ *              a message with the signal number is displayed.
+ *
+ * Parameters:  sh - pointer to the shell state
+ *
+ * Returns:     None.
+ *
+ ************************************************************************/
+void cmdStatus(struct shell *sh) {
+	if (sh->termination > 0) {
+		// Previous process was terminated and the termination flag was
+		// set to a valid signal, so show termination signal
+		outPrintf(sh, "terminated by signal %d\n", sh->termination);
+	}
+	else {
+		// Previous process exited normally, so show exit status
+		outPrintf(sh, "exit value %d\n", sh->status);
+	}
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdExit()
+ *
+ * Description: This function executes the build in command "exit". Before
+ *              exiting the program, all background processes are sent
+ *              SIGTERM, and those still running after EXIT_GRACE
+ *              milliseconds are killed. A job started with "&" is
+ *              signalled through its process group, which also reaches
+ *              the processes it started itself. The shell exits with the
+ *              status of the last command, or 128 plus the signal that
+ *              terminated it. Counters of BABYSH_STATS named after the
+ *              shell are removed.
+ *
+ * Parameters:  sh - pointer to the shell state
+ *
+ * Returns:     None.
+ *
+ ************************************************************************/
+void cmdExit(struct shell *sh) {
+	struct jobTable *jobs = &sh->jobs;
+	struct signalfd_siginfo info;
+	struct pollfd child;
+	struct timespec now;
+	struct timespec deadline;
+	long remaining = EXIT_GRACE;    // Milliseconds left for the jobs to exit
+	char path[NAME_MAX];
+	char pid[24];
+	pid_t wpid;
+
+	// Ask every background process to finish, and collect them as
+	// they do
+	if (jobs->indexCount > 0) {
+		jobSignal(jobs, SIGTERM);
+
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += EXIT_GRACE / 1000;
+		deadline.tv_nsec += (EXIT_GRACE % 1000) * 1000000L;
+		child.fd = sh->childFd;
+		child.events = POLLIN;
+
+		while (jobs->indexCount > 0 && remaining > 0) {
+			if (poll(&child, 1, remaining) > 0)
+				while (read(sh->childFd, &info, sizeof(info)) == sizeof(info))
+					continue;
+
+			while ((wpid = waitpid(-1, NULL, WNOHANG)) > 0)
+				jobTakeProcess(jobs, wpid);
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			remaining = (deadline.tv_sec - now.tv_sec) * 1000
+				+ (deadline.tv_nsec - now.tv_nsec) / 1000000;
+		}
+
+		// Kill whatever is left, including what the jobs started
+		jobSignal(jobs, SIGKILL);
+	}
+
+	if (sh->trace != NULL)
+		traceReport(sh);
+
+	// Counters named after the shell go with it
+	if (sh->statsOwned) {
+		snprintf(pid, sizeof(pid), "%d", (int) getpid());
+		statsPath(path, sizeof(path), pid);
+		shm_unlink(path);
+	}
+
+	outFlush(sh);
+	exit(sh->termination ? 128 + sh->termination : sh->status);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdJobs()
+ *
+ * Description: This function executes the built in command "jobs", which
+ *              lists the jobs started with "&" that have not yet been
+ *              reported as done. Each is shown with its job number, which
+ *              %n refers to, whether it is running or stopped, its pid
+ *              and its command line.
+ *
+ * Parameters:  sh - pointer to the shell state
+ *
+ * Returns:     None. status member of sh is altered.
+ *
+ ************************************************************************/
+void cmdJobs(struct shell *sh) {
+	struct job *job;
+	int slot;
+
+	// Pick up jobs that changed since the prompt was shown
+	reapBackground(sh);
+
+	for (slot = 0; slot < sh->jobs.capacity; slot++) {
+		job = &sh->jobs.jobs[slot];
+		if (job->pid == 0 || job->group == 0)
+			continue;
+
+		outPrintf(sh, "[%d] %s pid %d: %s\n", slot + 1,
+			job->stopped ? "stopped" : "running", job->pid, job->command);
+	}
+
+	sh->status = EXIT_SUCCESS;
+	sh->termination = 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdWait()
+ *
+ * Description: This function executes the built in command "wait". With
+ *              no arguments it waits for every job started with "&" to
+ *              finish. With -n it waits for whichever job finishes next,
+ *              and otherwise for each job given as %n or by a pid. The
+ *              status is that of the last job waited for, and 127 if a
+ *              job does not exist. The shell sleeps in poll() until a
+ *              child changes state, and SIGINT interrupts the wait.
+ *
+ * Parameters:  args - an array of char*
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status, termination and jobs members of sh are
+ *              altered.
+ *
+ ************************************************************************/
+void cmdWait(char *args[], struct shell *sh) {
+	struct jobTable *jobs = &sh->jobs;
+	int next = (args[1] != NULL && strcmp(args[1], "-n") == 0);
+	int position;
+	int slot = NO_JOB;
+
+	sh->status = EXIT_SUCCESS;
+	sh->termination = 0;
+
+	if (next && args[2] != NULL) {
+		outPrintf(sh, "wait: usage: wait [-n] | wait [%%job | pid]...\n");
+		sh->status = EXIT_FAILURE;
+		return;
+	}
+
+	// Every job, or the next one, is waited for until none are left
+	if (args[1] == NULL || next) {
+		while ((slot = jobFind(jobs, NULL)) != NO_JOB) {
+			jobs->watchPid = -1;
+			if (jobWait(0, sh) == -1)
+				return;
+
+			if (next) {
+				jobStatus(jobs->watchStatus, sh);
+				return;
+			}
+		}
+
+		// As with other shells, -n without a job fails
+		if (next)
+			sh->status = 127;
+		return;
+	}
+
+	for (position = 1; args[position] != NULL; position++) {
+		slot = jobFind(jobs, args[position]);
+		if (slot == NO_JOB) {
+			outPrintf(sh, "wait: %s: no such job\n", args[position]);
+			sh->status = 127;
+			sh->termination = 0;
+			continue;
+		}
+
+		jobs->watchPid = jobs->jobs[slot].pid;
+		if (jobWait(0, sh) == -1)
+			return;
+		jobStatus(jobs->watchStatus, sh);
+	}
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdForeground()
+ *
+ * Description: This function executes the built in command "fg", which
+ *              continues a job, the one given as %n or by a pid or else
+ *              the one started last, and waits for it as if it had been
+ *              started in the foreground. When reading from a terminal,
+ *              the job's process group is given the terminal, so that it
+ *              receives the signals typed there, and the shell takes it
+ *              back with its settings once the job finishes or stops. The
+ *              job still ignores SIGINT, as it was started with.
+ *
+ * Parameters:  args - an array of char*
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status, termination and jobs members of sh are
+ *              altered.
+ *
+ ************************************************************************/
+void cmdForeground(char *args[], struct shell *sh) {
+	struct jobTable *jobs = &sh->jobs;
+	struct termios settings;        // The terminal as the shell left it
+	sigset_t terminalSignal;
+	sigset_t savedMask;
+	int terminal;
+	int slot;
+
+	slot = jobFind(jobs, args[1]);
+	if (slot == NO_JOB) {
+		outPrintf(sh, "fg: %s: no such job\n", args[1] ? args[1] : "current");
+		sh->status = EXIT_FAILURE;
+		sh->termination = 0;
+		return;
+	}
+
+	outPrintf(sh, "%s\n", jobs->jobs[slot].command);
+	outFlush(sh);
+
+	// While the job has the terminal, the shell is a background group
+	// and would be stopped by SIGTTOU when writing or taking it back
+	sigemptyset(&terminalSignal);
+	sigaddset(&terminalSignal, SIGTTOU);
+	sigprocmask(SIG_BLOCK, &terminalSignal, &savedMask);
+
+	terminal = sh->interactive && tcgetpgrp(0) == getpgrp()
+		&& tcgetattr(0, &settings) == 0;
+	if (terminal && tcsetpgrp(0, jobs->jobs[slot].group) == -1)
+		terminal = 0;
+
+	if (killpg(jobs->jobs[slot].group, SIGCONT) == -1)
+		perror("kill failed");
+	jobs->jobs[slot].stopped = 0;
+
+	jobs->watchPid = jobs->jobs[slot].pid;
+	if (jobWait(1, sh) == 0)
+		jobStatus(jobs->watchStatus, sh);
+
+	if (terminal) {
+		tcsetpgrp(0, getpgrp());
+		tcsetattr(0, TCSADRAIN, &settings);
+	}
+	sigprocmask(SIG_SETMASK, &savedMask, NULL);
+
+	if (WIFSTOPPED(jobs->watchStatus) && jobs->jobs[slot].pid != 0)
+		outPrintf(sh, "[%d] stopped: %s\n", slot + 1, jobs->jobs[slot].command);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdBackground()
+ *
+ * Description: This function executes the built in command "bg", which
+ *              continues a stopped job in the background. The job is
+ *              given as %n or by a pid, or else the one started last is
+ *              continued.
+ *
+ * Parameters:  args - an array of char*
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status member of sh is altered.
+ *
+ ************************************************************************/
+void cmdBackground(char *args[], struct shell *sh) {
+	struct job *job;
+	int slot;
+
+	sh->status = EXIT_FAILURE;
+	sh->termination = 0;
+
+	slot = jobFind(&sh->jobs, args[1]);
+	if (slot == NO_JOB) {
+		outPrintf(sh, "bg: %s: no such job\n", args[1] ? args[1] : "current");
+		return;
+	}
+
+	job = &sh->jobs.jobs[slot];
+	if (killpg(job->group, SIGCONT) == -1) {
+		perror("kill failed");
+		return;
+	}
+
+	job->stopped = 0;
+	outPrintf(sh, "[%d] %s\n", slot + 1, job->command);
+	sh->status = EXIT_SUCCESS;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdKill()
+ *
+ * Description: This function executes the built in command "kill", which
+ *              sends a signal, SIGTERM unless another is given with -s
+ *              or as -NAME or -NUMBER, to each job or process. A job
+ *              given as %n is signalled through its process group, with
+ *              a single killpg(), and is continued as well if it is
+ *              stopped, so that it can act on the signal. Any other
+ *              argument is taken as a pid.
+ *
+ * Parameters:  args - an array of char*
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status member of sh is altered.
+ *
+ ************************************************************************/
+void cmdKill(char *args[], struct shell *sh) {
+	struct job *job;
+	char *name = NULL;
+	char *end;
+	long pid;
+	int signal = SIGTERM;
+	int position = 1;
+	int slot;
+
+	sh->status = EXIT_SUCCESS;
+	sh->termination = 0;
+
+	// Nothing is read past the end of the arguments
+	if (args[1] != NULL && strcmp(args[1], "-s") == 0 && args[2] == NULL) {
+		outPrintf(sh, "kill: usage: kill [-s signal | -signal] %%job | pid...\n");
+		sh->status = EXIT_FAILURE;
+		return;
+	}
+
+	if (args[1] != NULL && strcmp(args[1], "-s") == 0) {
+		name = args[2];
+		position = 3;
+	}
+	else if (args[1] != NULL && args[1][0] == '-' && args[1][1] != '\0') {
+		name = args[1] + 1;
+		position = 2;
+	}
+
+	if (name != NULL && (signal = signalNumber(name)) == -1) {
+		outPrintf(sh, "kill: %s: invalid signal\n", name);
+		sh->status = EXIT_FAILURE;
+		return;
+	}
+
+	if (args[position] == NULL) {
+		outPrintf(sh, "kill: usage: kill [-s signal | -signal] %%job | pid...\n");
+		sh->status = EXIT_FAILURE;
+		return;
+	}
+
+	for (; args[position] != NULL; position++) {
+		if (args[position][0] == '%') {
+			slot = jobFind(&sh->jobs, args[position]);
+			if (slot == NO_JOB) {
+				outPrintf(sh, "kill: %s: no such job\n", args[position]);
+				sh->status = EXIT_FAILURE;
+				continue;
+			}
+
+			job = &sh->jobs.jobs[slot];
+			if (killpg(job->group, signal) == -1) {
+				perror("kill failed");
+				sh->status = EXIT_FAILURE;
+			}
+			else if (job->stopped && signal != SIGSTOP && signal != SIGTSTP
+					&& signal != SIGTTIN && signal != SIGTTOU) {
+				killpg(job->group, SIGCONT);
+			}
+			continue;
+		}
+
+		errno = 0;
+		pid = strtol(args[position], &end, 10);
+		if (end == args[position] || *end != '\0' || errno != 0
+				|| pid > INT_MAX || pid < INT_MIN) {
+			outPrintf(sh, "kill: %s: not a pid or job\n", args[position]);
+			sh->status = EXIT_FAILURE;
+			continue;
+		}
+
+		if (kill((pid_t)pid, signal) == -1) {
+			perror("kill failed");
+			sh->status = EXIT_FAILURE;
+		}
+	}
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    signalNumber()
+ *
+ * Description: This function finds the number of a signal given by its
+ *              number or by its name, with or without the SIG prefix.
+ *
+ * Parameters:  name - the number or name of the signal
+ *
+ * Returns:     The signal number, or -1 if there is no such signal.
+ *
+ ************************************************************************/
+int signalNumber(char *name) {
+	static const struct {
+		const char *name;
+		int number;
+	} signals[] = {
+		{ "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT },
+		{ "ABRT", SIGABRT }, { "KILL", SIGKILL }, { "USR1", SIGUSR1 },
+		{ "SEGV", SIGSEGV }, { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE },
+		{ "ALRM", SIGALRM }, { "TERM", SIGTERM }, { "CHLD", SIGCHLD },
+		{ "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP },
+		{ "TTIN", SIGTTIN }, { "TTOU", SIGTTOU }, { "WINCH", SIGWINCH }
+	};
+	char *end;
+	long number;
+	size_t entry;
+
+	if (isdigit((unsigned char) name[0])) {
+		number = strtol(name, &end, 10);
+		return (*end == '\0' && number < NSIG) ? (int)number : -1;
+	}
+
+	if (strncmp(name, "SIG", 3) == 0)
+		name += 3;
+
+	for (entry = 0; entry < sizeof(signals) / sizeof(signals[0]); entry++) {
+		if (strcmp(name, signals[entry].name) == 0)
+			return signals[entry].number;
+	}
+
+	return -1;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdExec()
+ *
+ * Description: This function executes the built in command "exec", and
+ *              is also used to run the last command of a script or of
+ *              -c. The shell is replaced by the command, with its input
+ *              and output redirected and SIGINT and the signal mask
+ *              reset, saving a process and a wait. With no command the
+ *              redirections are applied to the shell itself, as is the
+ *              placement, which the command otherwise runs with. If the
+ *              command cannot be executed the shell carries on as before,
+ *              though still placed.
+ *
+ * Parameters:  stage - pointer to the command and its redirections
+ *              placement - pointer to the placement, or NULL
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None, unless the command cannot be executed. status and
+ *              termination members of sh are altered.
+ *
+ ************************************************************************/
+void cmdExec(struct stage *stage, struct placement *placement, struct shell *sh) {
+	struct sigaction act;
+	struct fdPlan plan;
+	sigset_t mask;
+	sigset_t shellMask;
+	int saved[REDIRECT_FDS];        // The shell's replaced descriptors
+	int *owned[5];                  // Descriptors the shell uses itself
+	char *path;
+	int moved;
+	int fd;
+
+	sh->status = EXIT_FAILURE;
+	sh->termination = 0;
+
+	// Open the redirected files before anything is changed
+	planInit(&plan);
+	if (planRedirects(&plan, stage, sh) == -1)
+		return;
+
+	// A descriptor the shell uses itself is moved out of the way first
+	owned[0] = &sh->childFd;
+	owned[1] = &sh->devNull;
+	owned[2] = &sh->input.fd;
+	owned[3] = (sh->trace != NULL) ? &sh->trace->fd : NULL;
+	owned[4] = &sh->history.fd;
+	for (fd = 0; fd < 5; fd++) {
+		if (owned[fd] == NULL || *owned[fd] <= 2 || *owned[fd] >= REDIRECT_FDS
+				|| !(plan.changed & (1u << *owned[fd])))
+			continue;
+
+		moved = fcntl(*owned[fd], F_DUPFD_CLOEXEC, REDIRECT_FDS);
+		if (moved == -1) {
+			perror("exec");
+			planClose(&plan);
+			return;
+		}
+		*owned[fd] = moved;
+	}
+
+	if (placement != NULL && placeProcess(placement, 1) == -1) {
+		perror("placement failed");
+		planClose(&plan);
+		return;
+	}
+
+	// Replace the descriptors, keeping copies in case exec fails
+	outFlush(sh);
+	for (fd = 0; fd < REDIRECT_FDS; fd++) {
+		saved[fd] = -1;
+		if (!(plan.changed & (1u << fd)))
+			continue;
+
+		if (stage->argv[0] != NULL)
+			saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_FDS);
+		if (plan.fds[fd] == -1)
+			close(fd);
+		else
+			dup2(plan.fds[fd], fd);
+	}
+	planClose(&plan);
+
+	if (stage->argv[0] == NULL) {
+		sh->status = EXIT_SUCCESS;
+		return;
+	}
+
+	path = hashLookup(&sh->hash, stage->argv[0]);
+
+	// The command runs in the foreground with no signals blocked
+	act.sa_handler = SIG_DFL;
+	act.sa_flags = 0;
+	sigfillset(&(act.sa_mask));
+	sigaction(SIGINT, &act, NULL);
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, &shellMask);
+
+	if (path != NULL)
+		execve(path, stage->argv, environ);
+	if (path == NULL || errno == ENOENT)
+		execvp(stage->argv[0], stage->argv);
+
+	// Restore the shell. A child that finished while SIGCHLD was
+	// unblocked is not reported to the signalfd, so raise it again.
+	act.sa_handler = SIG_IGN;
+	sigaction(SIGINT, &act, NULL);
+	sigprocmask(SIG_SETMASK, &shellMask, NULL);
+	raise(SIGCHLD);
+	if (sh->stats != NULL)
+		statsAdd(&sh->stats->execFailures, 1);
+
+	for (fd = 0; fd < REDIRECT_FDS; fd++) {
+		if (!(plan.changed & (1u << fd)))
+			continue;
+
+		if (saved[fd] == -1) {
+			close(fd);
+			continue;
+		}
+		dup2(saved[fd], fd);
+		close(saved[fd]);
+	}
+
+	outPrintf(sh, "Execution Error: %s is not a valid command\n", stage->argv[0]);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdHash()
+ *
+ * Description: This function executes the built in command "hash". With
+ *              no arguments the remembered commands are listed along
+ *              with the number of times each was run. "hash -r" forgets
+ *              every remembered command, and any other arguments are
+ *              looked up on PATH and remembered.
+ *
+ * Parameters:  args - an array of char*
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status member of sh may be altered.
+ *
+ ************************************************************************/
+void cmdHash(char *args[], struct shell *sh) {
+	struct hashEntry *entry;
+	int position = 1;
+	int bucket;
+	int empty = 1;
+
+	sh->status = EXIT_SUCCESS;
+
+	if (args[1] == NULL) {
+		// List the remembered commands
+		for (bucket = 0; bucket < HASH_BUCKETS; bucket++) {
+			for (entry = sh->hash.buckets[bucket]; entry; entry = entry->next) {
+				if (empty)
+					outPrintf(sh, "hits\tcommand\n");
+				outPrintf(sh, "%4d\t%s\n", entry->hits, entry->path);
+				empty = 0;
+			}
+		}
+
+		if (empty)
+			outPrintf(sh, "hash: hash table empty\n");
+		return;
+	}
+
+	if (strcmp(args[1], "-r") == 0) {
+		// Forget all remembered commands
+		hashClear(&sh->hash);
+		position++;
+	}
+
+	// Remember each of the named commands
+	for (; args[position] != NULL; position++) {
+		if (strchr(args[position], '/') != NULL)
+			continue;
+
+		if (hashLookup(&sh->hash, args[position]) == NULL) {
+			outPrintf(sh, "hash: %s: not found\n", args[position]);
+			sh->status = EXIT_FAILURE;
+		}
+	}
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdParallel()
+ *
+ * Description: This function executes the built in command "parallel".
+ *              Command lines are read from the named file, wherever
+ *              input is redirected from, or else the rest of the shell's
+ *              input, and each is run as a job. At most the number of
+ *              jobs given with "-j" run at once, by default one for each
+ *              online processor. Whenever the limit is reached the shell
+ *              sleeps on the SIGCHLD signalfd, so the next job starts as
+ *              soon as one finishes. With "-p" each job is pinned to the
+ *              next of the CPUs the shell may run on, or those given
+ *              with the pin prefix, in turn. A summary of the exit
+ *              statuses is printed once every job is done.
+ *
+ * Parameters:  args - an array of char*
+ *              inputFd - the descriptor input is redirected from, or -1
+ *              placement - pointer to the placement of every job, or NULL
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status, termination, and jobs members of sh may
+ *              be altered.
+ *
+ ************************************************************************/
+void cmdParallel(char *args[], int inputFd, struct placement *placement,
+		struct shell *sh) {
+	struct parallelRun run;
+	struct command line;            // The command line being started
+	struct inputBuffer saved;       // The shell's own input
+	struct placement jobPlacement;  // Placement of the job being started
+	cpu_set_t cpus;                 // CPUs the jobs are spread over
+	int savedInteractive = sh->interactive;
+	long limit = sysconf(_SC_NPROCESSORS_ONLN);
+	char *inputFile = NULL;
+	char *option;
+	char *text;
+	char *lineCopy;                 // The line, if it has a here-document
+	char *end;
+	int position = 1;
+	int running;
+	int spread = 0;                 // Whether "-p" was given
+	int cpu = -1;                   // CPU of the last job started
+
+	sh->status = EXIT_FAILURE;
+	sh->termination = 0;
+
+	// Read the limit on the number of jobs, given as "-j N" or "-jN",
+	// and "-p"
+	while (args[position] != NULL && args[position][0] == '-') {
+		if (strcmp(args[position], "-p") == 0) {
+			spread = 1;
+			position++;
+			continue;
+		}
+		if (strncmp(args[position], "-j", 2) != 0)
+			break;
+
+		option = (args[position][2] != '\0') ? args[position] + 2
+			: args[++position];
+		if (option == NULL || (limit = strtol(option, &end, 10)) < 1
+				|| *end != '\0') {
+			outPrintf(sh, "parallel: usage: parallel [-j jobs] [-p] [file]\n");
+			return;
+		}
+		position++;
+	}
+
+	if (args[position] != NULL && args[position + 1] != NULL) {
+		outPrintf(sh, "parallel: usage: parallel [-j jobs] [-p] [file]\n");
+		return;
+	}
+
+	if (spread) {
+		if (placement != NULL && placement->pinned)
+			cpus = placement->cpus;
+		else if (sched_getaffinity(0, sizeof(cpus), &cpus) == -1)
+			spread = 0;
+	}
+
+	if (limit < 1)
+		limit = 1;
+
+	// Read from a file in place of the shell's input until the end.
+	// The arguments are not used after this point, as reading the
+	// shell's input may move the line they are stored in.
+	if (args[position] != NULL) {
+		inputFile = args[position];
+		inputFd = -1;
+	}
+
+	saved = sh->input;
+	if (inputFile != NULL) {
+		memset(&sh->input, 0, sizeof(sh->input));
+		if (openInput(inputFile, &sh->input) == -1) {
+			outPrintf(sh, "File Error: cannot open %s for input\n", inputFile);
+			sh->input = saved;
+			return;
+		}
+	}
+	else if (inputFd != -1) {
+		memset(&sh->input, 0, sizeof(sh->input));
+		sh->input.fd = fcntl(inputFd, F_DUPFD_CLOEXEC, 0);
+	}
+
+	memset(&run, 0, sizeof(run));
+	sh->parallel = &run;
+
+	// The prompt is not shown while the command lines are read
+	sh->interactive = 0;
+
+	while (!run.interrupted && (text = getInput(sh)) != NULL) {
+		lineCopy = NULL;
+		if (strstr(text, "<<") != NULL && (lineCopy = strdup(text)))
+			text = lineCopy;
+
+		if (parseInput(text, &line, sh) == -1
+				|| readHereDocs(&line, 1, sh) == -1) {
+			run.started++;
+			run.failed++;
+			free(lineCopy);
+			continue;
+		}
+
+		if (line.stageCount == 0) {
+			free(lineCopy);
+			continue;
+		}
+
+		// Each job is placed as the parallel command was, and when
+		// spread, on the CPU after the last one
+		if (placement != NULL || spread) {
+			if (placement != NULL) {
+				jobPlacement = *placement;
+			}
+			else {
+				jobPlacement.node = -1;
+				jobPlacement.limitCount = 0;
+				jobPlacement.cgroup = NULL;
+			}
+
+			if (spread) {
+				do
+					cpu = (cpu + 1) % CPU_SETSIZE;
+				while (!CPU_ISSET(cpu, &cpus));
+				CPU_ZERO(&jobPlacement.cpus);
+				CPU_SET(cpu, &jobPlacement.cpus);
+				jobPlacement.pinned = 1;
+			}
+			line.placement = &jobPlacement;
+		}
+
+		// Every line is run as a job, even one ending with "&"
+		line.background = RUN_PARALLEL;
+		running = run.running;
+		run.started++;
+		cmdExecute(&line, sh);
+		closeHereDocs(&line);
+		free(lineCopy);
+
+		if (run.running == running)
+			run.failed++;
+
+		while (run.running >= limit)
+			waitChildren(sh);
+	}
+
+	while (run.running > 0)
+		waitChildren(sh);
+
+	sh->parallel = NULL;
+	sh->interactive = savedInteractive;
+
+	if (inputFile != NULL || inputFd != -1) {
+		closeInput(&sh->input);
+		sh->input = saved;
+	}
+	else if (savedInteractive) {
+		// The end of input at a terminal only ends the command lines
+		sh->input.fd = 0;
+	}
+
+	outPrintf(sh, "parallel: %d jobs, %d succeeded, %d failed",
+		run.started, run.succeeded, run.failed);
+	if (run.signaled > 0)
+		outPrintf(sh, ", %d terminated by signal", run.signaled);
+	outPrintf(sh, "\n");
+
+	sh->status = (run.succeeded == run.started) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdBatch()
+ *
+ * Description: This function executes the built in command "batch". The
+ *              paths matching each pattern given with "-g", in order, and
+ *              the lines of the file given with "-f" are collected as
+ *              arguments, as are, with neither, the lines wherever input
+ *              is redirected from, or else of the rest of the shell's
+ *              input. The command is then run with as many of them after
+ *              its own arguments as fit under the system's limit on the
+ *              size of the arguments and environment of a program, or at
+ *              most the number given with "-n", so that it is started as
+ *              few times as possible. The batches are run as parallel
+ *              jobs, one at a time unless "-j" allows more at once.
+ *              Nothing is run without arguments.
+ *
+ * Parameters:  args - an array of char*
+ *              inputFd - the descriptor input is redirected from, or -1
+ *              placement - pointer to the placement of every job, or NULL
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status, termination, jobs and arena members of sh
+ *              may be altered.
+ *
+ ************************************************************************/
+void cmdBatch(char *args[], int inputFd, struct placement *placement,
+		struct shell *sh) {
+	struct parallelRun run;
+	struct command items;           // Arguments collected for the batches
+	struct inputBuffer saved;       // The shell's own input
+	char path[PATH_MAX];            // Path being matched by globWalk()
+	char **command;                 // Copy of the command and its arguments
+	char **variable;
+	char *inputFile = NULL;
+	char *option;
+	char *text;
+	char *end;
+	long limit = 1;
+	long most = 0;                  // Most arguments in a batch, or 0
+	long value;
+	long room = sysconf(_SC_ARG_MAX);
+	size_t length;
+	int savedInteractive = sh->interactive;
+	int readLines = 1;              // Whether to read lines of input
+	int position = 1;
+	int fixed;
+	int count = 0;
+	int first;
+	int next = 0;
+	char flag;
+
+	sh->status = EXIT_FAILURE;
+	sh->termination = 0;
+
+	argInit(&items);
+	items.stageCount = 0;
+	items.stages[0].argv = items.args;
+
+	// Read the options, adding the paths of each pattern in sorted order
+	while (args[position] != NULL && args[position][0] == '-'
+			&& (flag = args[position][1]) != '\0' && strchr("jnfg", flag) != NULL) {
+		option = (args[position][2] != '\0') ? args[position] + 2
+			: args[++position];
+		if (option == NULL) {
+			outPrintf(sh, "batch: usage: batch [-j jobs] [-n count] [-f file] "
+				"[-g pattern]... command [args...]\n");
+			return;
+		}
+
+		if (flag == 'j' || flag == 'n') {
+			value = strtol(option, &end, 10);
+			if (*end != '\0' || end == option || value < (flag == 'j')) {
+				outPrintf(sh, "batch: usage: batch [-j jobs] [-n count] [-f file] "
+					"[-g pattern]... command [args...]\n");
+				return;
+			}
+			if (flag == 'j')
+				limit = value;
+			else
+				most = value;
+		}
+		else if (flag == 'f') {
+			inputFile = option;
+		}
+		else {
+			readLines = 0;
+			first = count;
+			if (globWalk(path, 0, option, &items, &count, sh) == -1)
+				return;
+			qsort(&items.args[first], count - first, sizeof(*items.args),
+				globCompare);
+		}
+		position++;
+	}
+
+	if (args[position] == NULL) {
+		outPrintf(sh, "batch: usage: batch [-j jobs] [-n count] [-f file] "
+			"[-g pattern]... command [args...]\n");
+		return;
+	}
+
+	// The command is copied, as reading the shell's input may move the
+	// line it is stored in
+	for (fixed = 0; args[position + fixed] != NULL; fixed++)
+		;
+	if ((command = (char **) arenaAlloc((fixed + 1) * sizeof(*command),
+			sizeof(*command), sh)) == NULL)
+		return;
+	for (fixed = 0; args[position + fixed] != NULL; fixed++) {
+		length = strlen(args[position + fixed]) + 1;
+		if ((command[fixed] = arenaAlloc(length, 1, sh)) == NULL)
+			return;
+		memcpy(command[fixed], args[position + fixed], length);
+	}
+	command[fixed] = NULL;
+
+	// Every line read is an argument, apart from empty ones
+	if (inputFile != NULL || readLines) {
+		saved = sh->input;
+		if (inputFile != NULL) {
+			memset(&sh->input, 0, sizeof(sh->input));
+			if (openInput(inputFile, &sh->input) == -1) {
+				outPrintf(sh, "File Error: cannot open %s for input\n", inputFile);
+				sh->input = saved;
+				return;
+			}
+		}
+		else if (inputFd != -1) {
+			memset(&sh->input, 0, sizeof(sh->input));
+			sh->input.fd = fcntl(inputFd, F_DUPFD_CLOEXEC, 0);
+		}
+
+		sh->interactive = 0;
+		while ((text = getInput(sh)) != NULL) {
+			if (*text == '\0')
+				continue;
+
+			length = strlen(text) + 1;
+			if ((option = arenaAlloc(length, 1, sh)) == NULL
+					|| argAdd(&items, &count, memcpy(option, text, length), sh) == -1)
+				break;
+		}
+		sh->interactive = savedInteractive;
+
+		if (inputFile != NULL || inputFd != -1) {
+			closeInput(&sh->input);
+			sh->input = saved;
+		}
+		else if (savedInteractive) {
+			// The end of input at a terminal only ends the arguments
+			sh->input.fd = 0;
+		}
+
+		if (text != NULL)
+			return;
+	}
+
+	// Every batch has the environment and the command to fit as well
+	if (room <= 0)
+		room = _POSIX_ARG_MAX;
+	room -= BATCH_HEADROOM;
+	for (variable = environ; *variable != NULL; variable++)
+		room -= strlen(*variable) + 1 + sizeof(*variable);
+	for (fixed = 0; command[fixed] != NULL; fixed++)
+		room -= strlen(command[fixed]) + 1 + sizeof(*command);
+	room -= sizeof(*command);
+
+	if (room <= 0) {
+		outPrintf(sh, "batch: %s: command too long\n", command[0]);
+		return;
+	}
+
+	memset(&run, 0, sizeof(run));
+	sh->parallel = &run;
+
+	for (first = 0; first < count && !run.interrupted; first = next) {
+		next = batchStart(command, fixed, &items, first, count, room, most,
+			placement, sh);
+		if (next == -1)
+			break;
+
+		while (run.running >= limit)
+			waitChildren(sh);
+	}
+
+	while (run.running > 0)
+		waitChildren(sh);
+
+	sh->parallel = NULL;
+
+	if (next != -1 && run.succeeded == run.started)
+		sh->status = EXIT_SUCCESS;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    batchStart()
+ *
+ * Description: This function starts the command of "batch" with the
+ *              arguments that fit after the first one not yet used. The
+ *              first one is always used, so an argument too long for any
+ *              batch fails when its command is started.
+ *
+ * Parameters:  command - the command and its own arguments
+ *              fixed - the number of words in command
+ *              items - pointer to the collected arguments
+ *              first - the index of the first argument not yet used
+ *              count - the number of arguments
+ *              room - the bytes left for the arguments of a batch
+ *              most - the most arguments in a batch, or 0
+ *              placement - pointer to the placement of the job, or NULL
+ *              sh - pointer to the shell state
+ *
+ * Returns:     The index of the first argument left for the next batch,
+ *              or -1 after printing a message. parallel and jobs members
+ *              of sh are altered.
+ *
+ ************************************************************************/
+int batchStart(char **command, int fixed, struct command *items, int first, int count,
+		long room, long most, struct placement *placement, struct shell *sh) {
+	struct command batch;
+	size_t used = sh->arena.used;
+	int next = first;
+	int running = sh->parallel->running;
+
+	do {
+		room -= strlen(items->args[next++]) + 1 + sizeof(*items->args);
+	} while (next < count && (most == 0 || next - first < most)
+		&& (long) (strlen(items->args[next]) + 1 + sizeof(*items->args)) <= room);
+
+	// The words of the batch are given to the job in the arena, which
+	// is let go once it has started
+	batch.argSize = fixed + (next - first) + 1;
+	batch.args = (char **) arenaAlloc(batch.argSize * sizeof(*batch.args),
+		sizeof(*batch.args), sh);
+	if (batch.args == NULL)
+		return -1;
+
+	memcpy(batch.args, command, fixed * sizeof(*batch.args));
+	memcpy(batch.args + fixed, items->args + first, (next - first) * sizeof(*batch.args));
+	batch.args[batch.argSize - 1] = NULL;
+
+	batch.stages[0].argv = batch.args;
+	batch.stages[0].redirects = batch.redirects;
+	batch.stages[0].redirectCount = 0;
+	batch.stageCount = 1;
+	batch.redirectCount = 0;
+	batch.background = RUN_PARALLEL;
+	batch.timed = 0;
+	batch.placement = placement;
+
+	sh->parallel->started++;
+	cmdExecute(&batch, sh);
+	if (sh->parallel->running == running)
+		sh->parallel->failed++;
+
+	sh->arena.used = used;
+	return next;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    waitChildren()
+ *
+ * Description: This function sleeps until SIGCHLD is received through
+ *              the signalfd and then collects the finished processes.
+ *
+ * Parameters:  sh - pointer to the shell state
+ *
+ * Returns:     None. jobs member of sh may be altered.
+ *
+ ************************************************************************/
+void waitChildren(struct shell *sh) {
+	struct pollfd child;
+
+	child.fd = sh->childFd;
+	child.events = POLLIN;
+
+	if (poll(&child, 1, -1) == -1 && errno != EINTR) {
+		perror("poll failed");
+		return;
+	}
+
+	reapBackground(sh);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdEcho()
+ *
+ * Description: This function executes the built in command "echo",
+ *              which writes its arguments separated by spaces and
+ *              followed by a newline. As with the echo program, leading
+ *              options made of the letters n, e and E are accepted: -n
+ *              leaves off the newline, -e interprets backslash escapes
+ *              and -E turns them off again.
+ *
+ * Parameters:  args - an array of char*
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status member of sh is altered.
+ *
+ ************************************************************************/
+void cmdEcho(char *args[], struct shell *sh) {
+	int position = 1;
+	int first;
+	int newline = 1;
+	int escapes = 0;
+	int stop = 0;
+	char *p;
+
+	// Read options, stopping at the first argument that is not one
+	while (args[position] != NULL && args[position][0] == '-'
+			&& args[position][1] != '\0'
+			&& strspn(args[position] + 1, "neE") == strlen(args[position] + 1)) {
+		for (p = args[position] + 1; *p; p++) {
+			if (*p == 'n')
+				newline = 0;
+			else
+				escapes = (*p == 'e');
+		}
+		position++;
+	}
+
+	for (first = position; args[position] != NULL && !stop; position++) {
+		if (position > first)
+			outWrite(sh, " ", 1);
+		p = args[position];
+
+		if (!escapes) {
+			outWrite(sh, p, strlen(p));
+			continue;
+		}
+
+		while (*p && !stop) {
+			if (*p == '\\')
+				p = outEscape(sh, p, 1, &stop);
+			else
+				outWrite(sh, p++, 1);
+		}
+	}
+
+	if (newline && !stop)
+		outWrite(sh, "\n", 1);
+
+	sh->status = EXIT_SUCCESS;
+	sh->termination = 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdPwd()
+ *
+ * Description: This function executes the built in command "pwd", which
+ *              writes the path of the working directory.
+ *
+ * Parameters:  sh - pointer to the shell state
+ *
+ * Returns:     None. status member of sh is altered.
+ *
+ ************************************************************************/
+void cmdPwd(struct shell *sh) {
+	char path[PATH_MAX];
+
+	sh->termination = 0;
+
+	if (getcwd(path, sizeof(path)) == NULL) {
+		outPrintf(sh, "pwd: %s\n", strerror(errno));
+		sh->status = EXIT_FAILURE;
+		return;
+	}
+
+	outPrintf(sh, "%s\n", path);
+	sh->status = EXIT_SUCCESS;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdTest()
+ *
+ * Description: This function executes the built in commands "test" and
+ *              "[", which evaluate a conditional expression. The
+ *              expression may test files, compare strings and integers,
+ *              and combine tests with "!", "-a", "-o" and parentheses.
+ *              When invoked as "[" the last argument must be "]".
+ *
+ * Parameters:  args - an array of char*
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status member of sh is set to 0 if the expression
+ *              is true, 1 if it is false, or 2 if it is not valid.
+ *
+ ************************************************************************/
+void cmdTest(char *args[], struct shell *sh) {
+	int end = 0;
+	int position = 1;
+	int error = 0;
+	int result;
+
+	while (args[end] != NULL)
+		end++;
+
+	sh->termination = 0;
+
+	if (strcmp(args[0], "[") == 0) {
+		if (strcmp(args[end - 1], "]") != 0) {
+			outPrintf(sh, "[: missing `]'\n");
+			sh->status = 2;
+			return;
+		}
+		end--;
+	}
+
+	// With no expression the result is false
+	if (position == end) {
+		sh->status = EXIT_FAILURE;
+		return;
+	}
+
+	result = testOr(args, &position, end, &error, sh);
+
+	if (!error && position != end) {
+		outPrintf(sh, "%s: %s: unexpected argument\n", args[0], args[position]);
+		error = 1;
+	}
+
+	sh->status = error ? 2 : !result;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    testOr()
+ *
+ * Description: This function evaluates expressions joined by "-o" for
+ *              the test command.
+ *
+ * Parameters:  args - an array of char*
+ *              position - pointer to the index of the next argument
+ *              end - index just past the last argument of the expression
+ *              error - pointer to an int set if the expression is invalid
+ *              sh - pointer to the shell state
+ *
+ * Returns:     1 if the expression is true, 0 if not. position and error
+ *              parameters may be altered.
+ *
+ ************************************************************************/
+int testOr(char *args[], int *position, int end, int *error, struct shell *sh) {
+	int result = testAnd(args, position, end, error, sh);
+
+	while (!*error && *position < end && strcmp(args[*position], "-o") == 0) {
+		(*position)++;
+		result = testAnd(args, position, end, error, sh) || result;
+	}
+
+	return result;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    testAnd()
+ *
+ * Description: This function evaluates expressions joined by "-a" for
+ *              the test command.
+ *
+ * Parameters:  args - an array of char*
+ *              position - pointer to the index of the next argument
+ *              end - index just past the last argument of the expression
+ *              error - pointer to an int set if the expression is invalid
+ *              sh - pointer to the shell state
+ *
+ * Returns:     1 if the expression is true, 0 if not. position and error
+ *              parameters may be altered.
+ *
+ ************************************************************************/
+int testAnd(char *args[], int *position, int end, int *error, struct shell *sh) {
+	int result = testPrimary(args, position, end, error, sh);
+
+	while (!*error && *position < end && strcmp(args[*position], "-a") == 0) {
+		(*position)++;
+		result = testPrimary(args, position, end, error, sh) && result;
+	}
+
+	return result;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    testPrimary()
+ *
+ * Description: This function evaluates a single test, a negated test or
+ *              a parenthesized expression for the test command. A binary
+ *              operator is recognized before a unary one, and an operator
+ *              without an operand is taken as a string, so that for
+ *              example "test -n" is true.
+ *
+ * Parameters:  args - an array of char*
+ *              position - pointer to the index of the next argument
+ *              end - index just past the last argument of the expression
+ *              error - pointer to an int set if the expression is invalid
+ *              sh - pointer to the shell state
+ *
+ * Returns:     1 if the test is true, 0 if not. position and error
+ *              parameters may be altered.
+ *
+ ************************************************************************/
+int testPrimary(char *args[], int *position, int end, int *error, struct shell *sh) {
+	struct stat fileInfo;
+	struct stat otherInfo;
+	char *op;
+	char *left;
+	char *right;
+	char *last;
+	long long leftValue;
+	long long rightValue;
+	int compare;
+	int result;
+
+	if (*position >= end) {
+		outPrintf(sh, "test: argument expected\n");
+		*error = 1;
+		return 0;
+	}
+
+	left = args[*position];
+
+	// Binary operators
+	if (*position + 2 < end) {
+		op = args[*position + 1];
+		right = args[*position + 2];
+		compare = testCompareOp(op);
+
+		if (compare != TEST_NONE)
+			*position += 3;
+
+		switch (compare) {
+		case TEST_NONE:
+			break;
+		case TEST_STRING_EQ:
+			return strcmp(left, right) == 0;
+		case TEST_STRING_NE:
+			return strcmp(left, right) != 0;
+		case TEST_STRING_LT:
+			return strcmp(left, right) < 0;
+		case TEST_STRING_GT:
+			return strcmp(left, right) > 0;
+		case TEST_NEWER:
+		case TEST_OLDER:
+		case TEST_SAME_FILE:
+			if (stat(left, &fileInfo) == -1 || stat(right, &otherInfo) == -1)
+				return 0;
+			if (compare == TEST_SAME_FILE)
+				return fileInfo.st_dev == otherInfo.st_dev
+					&& fileInfo.st_ino == otherInfo.st_ino;
+			if (fileInfo.st_mtim.tv_sec == otherInfo.st_mtim.tv_sec)
+				result = (fileInfo.st_mtim.tv_nsec > otherInfo.st_mtim.tv_nsec)
+					- (fileInfo.st_mtim.tv_nsec < otherInfo.st_mtim.tv_nsec);
+			else
+				result = (fileInfo.st_mtim.tv_sec > otherInfo.st_mtim.tv_sec) ? 1 : -1;
+			return (compare == TEST_NEWER) ? result > 0 : result < 0;
+		default:
+			// Integer comparisons
+			errno = 0;
+			leftValue = strtoll(left, &last, 10);
+			if (last == left || *last != '\0' || errno != 0) {
+				outPrintf(sh, "test: %s: integer expression expected\n", left);
+				*error = 1;
+				return 0;
+			}
+
+			rightValue = strtoll(right, &last, 10);
+			if (last == right || *last != '\0' || errno != 0) {
+				outPrintf(sh, "test: %s: integer expression expected\n", right);
+				*error = 1;
+				return 0;
+			}
+
+			switch (compare) {
+			case TEST_EQ: return leftValue == rightValue;
+			case TEST_NE: return leftValue != rightValue;
+			case TEST_LT: return leftValue < rightValue;
+			case TEST_LE: return leftValue <= rightValue;
+			case TEST_GT: return leftValue > rightValue;
+			default: return leftValue >= rightValue;
+			}
+		}
+	}
+
+	// Negation and parentheses
+	if (strcmp(left, "!") == 0 && *position + 1 < end) {
+		(*position)++;
+		return !testPrimary(args, position, end, error, sh);
+	}
+
+	if (strcmp(left, "(") == 0 && *position + 1 < end) {
+		(*position)++;
+		result = testOr(args, position, end, error, sh);
+
+		if (!*error && (*position >= end || strcmp(args[*position], ")") != 0)) {
+			outPrintf(sh, "test: `)' expected\n");
+			*error = 1;
+			return 0;
+		}
+		(*position)++;
+		return result;
+	}
+
+	// Unary operators
+	if (left[0] == '-' && left[1] != '\0' && left[2] == '\0'
+			&& *position + 1 < end && strchr("bcdefghLnprsStuwxz", left[1]) != NULL) {
+		right = args[*position + 1];
+		*position += 2;
+
+		switch (left[1]) {
+		case 'n': return right[0] != '\0';
+		case 'z': return right[0] == '\0';
+		case 't': return isatty(atoi(right));
+		case 'r': return access(right, R_OK) == 0;
+		case 'w': return access(right, W_OK) == 0;
+		case 'x': return access(right, X_OK) == 0;
+		case 'h':
+		case 'L': return lstat(right, &fileInfo) == 0 && S_ISLNK(fileInfo.st_mode);
+		}
+
+		if (stat(right, &fileInfo) == -1)
+			return 0;
+
+		switch (left[1]) {
+		case 'b': return S_ISBLK(fileInfo.st_mode);
+		case 'c': return S_ISCHR(fileInfo.st_mode);
+		case 'd': return S_ISDIR(fileInfo.st_mode);
+		case 'f': return S_ISREG(fileInfo.st_mode);
+		case 'g': return (fileInfo.st_mode & S_ISGID) != 0;
+		case 'p': return S_ISFIFO(fileInfo.st_mode);
+		case 's': return fileInfo.st_size > 0;
+		case 'S': return S_ISSOCK(fileInfo.st_mode);
+		case 'u': return (fileInfo.st_mode & S_ISUID) != 0;
+		default: return 1;
+		}
+	}
+
+	// A single string is true if it is not empty
+	(*position)++;
+	return left[0] != '\0';
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    testCompareOp()
+ *
+ * Description: This function identifies a binary operator of the test
+ *              command.
+ *
+ * Parameters:  op - the argument that may be an operator
+ *
+ * Returns:     The comparison the operator performs, or TEST_NONE if the
+ *              argument is not a binary operator.
+ *
+ ************************************************************************/
+int testCompareOp(char *op) {
+	if (op[0] != '-') {
+		if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+			return TEST_STRING_EQ;
+		if (strcmp(op, "!=") == 0)
+			return TEST_STRING_NE;
+		if (strcmp(op, "<") == 0)
+			return TEST_STRING_LT;
+		if (strcmp(op, ">") == 0)
+			return TEST_STRING_GT;
+		return TEST_NONE;
+	}
+
+	if (strlen(op) != 3)
+		return TEST_NONE;
+
+	switch (op[1] * 256 + op[2]) {
+	case 'e' * 256 + 'q': return TEST_EQ;
+	case 'n' * 256 + 'e': return TEST_NE;
+	case 'l' * 256 + 't': return TEST_LT;
+	case 'l' * 256 + 'e': return TEST_LE;
+	case 'g' * 256 + 't': return TEST_GT;
+	case 'g' * 256 + 'e': return TEST_GE;
+	case 'n' * 256 + 't': return TEST_NEWER;
+	case 'o' * 256 + 't': return TEST_OLDER;
+	case 'e' * 256 + 'f': return TEST_SAME_FILE;
+	default: return TEST_NONE;
+	}
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdPrintf()
+ *
+ * Description: This function executes the built in command "printf",
+ *              which writes its arguments under the control of a format.
+ *              The conversions d, i, u, o, x, X, c, s, e, f, g and b are
+ *              supported with flags, width and precision, and the format
+ *              is reused until every argument has been consumed. A
+ *              numeric argument beginning with a quote is the value of
+ *              the character that follows it.
+ *
+ * Parameters:  args - an array of char*
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status member of sh is altered.
+ *
+ ************************************************************************/
+void cmdPrintf(char *args[], struct shell *sh) {
+	char **values;
+	char spec[40];
+	char *format = args[1];
+	char *start;
+	char *p;
+	char *value;
+	char *last;
+	size_t specLength;
+	int stop = 0;
+	int used;
+
+	sh->termination = 0;
+	sh->status = EXIT_SUCCESS;
+
+	if (format == NULL) {
+		outPrintf(sh, "printf: usage: printf format [arguments]\n");
+		sh->status = EXIT_FAILURE;
+		return;
+	}
+
+	values = &args[2];
+	do {
+		used = 0;
+
+		for (p = format; *p && !stop; p++) {
+			if (*p == '\\') {
+				p = outEscape(sh, p, 0, &stop) - 1;
+				continue;
+			}
+
+			if (*p != '%') {
+				// Write plain text up to the next escape or conversion
+				start = p;
+				p += strcspn(p, "\\%");
+				outWrite(sh, start, p - start);
+				p--;
+				continue;
+			}
+
+			if (p[1] == '%') {
+				outWrite(sh, "%", 1);
+				p++;
+				continue;
+			}
+
+			// Copy the flags, width and precision of the conversion
+			start = p++;
+			p += strspn(p, "-+ #0");
+			p += strspn(p, "0123456789");
+			if (*p == '.') {
+				p++;
+				p += strspn(p, "0123456789");
+			}
+
+			specLength = p - start;
+			if (*p == '\0' || specLength + 3 >= sizeof(spec)) {
+				outPrintf(sh, "printf: %s: invalid conversion\n", start);
+				sh->status = EXIT_FAILURE;
+				return;
+			}
+			memcpy(spec, start, specLength);
+
+			value = *values ? *values++ : NULL;
+			used |= (value != NULL);
+
+			switch (*p) {
+			case 'd':
+			case 'i':
+				strcpy(spec + specLength, "lld");
+				outPrintf(sh, spec, (long long)printfNumber(value, sh));
+				break;
+			case 'u':
+			case 'o':
+			case 'x':
+			case 'X':
+				spec[specLength] = 'l';
+				spec[specLength + 1] = 'l';
+				spec[specLength + 2] = *p;
+				spec[specLength + 3] = '\0';
+				outPrintf(sh, spec, (unsigned long long)printfNumber(value, sh));
+				break;
+			case 'e':
+			case 'E':
+			case 'f':
+			case 'F':
+			case 'g':
+			case 'G':
+				spec[specLength] = *p;
+				spec[specLength + 1] = '\0';
+				outPrintf(sh, spec, value ? strtod(value, &last) : 0.0);
+				break;
+			case 'c':
+				strcpy(spec + specLength, "c");
+				if (value != NULL && value[0] != '\0')
+					outPrintf(sh, spec, value[0]);
+				break;
+			case 's':
+				strcpy(spec + specLength, "s");
+				outPrintf(sh, spec, value ? value : "");
+				break;
+			case 'b':
+				// The argument is written with its escapes interpreted
+				for (value = value ? value : ""; *value && !stop; ) {
+					if (*value == '\\')
+						value = outEscape(sh, value, 1, &stop);
+					else
+						outWrite(sh, value++, 1);
+				}
+				break;
+			default:
+				outPrintf(sh, "printf: %c: invalid conversion\n", *p);
+				sh->status = EXIT_FAILURE;
+				return;
+			}
+		}
+	} while (used && *values != NULL && !stop);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    printfNumber()
+ *
+ * Description: This function converts an argument of the printf command
+ *              to a number. A missing argument is 0, and an argument
+ *              beginning with a quote is the value of the character
+ *              after it. An invalid number is reported and its status
+ *              recorded, and the part that was valid is used.
+ *
+ * Parameters:  value - the argument, or NULL
+ *              sh - pointer to the shell state
+ *
+ * Returns:     The number.
+ *
+ ************************************************************************/
+long long printfNumber(char *value, struct shell *sh) {
+	long long number;
+	char *last;
+
+	if (value == NULL)
+		return 0;
+
+	if (value[0] == '\'' || value[0] == '"')
+		return (unsigned char)value[1];
+
+	errno = 0;
+	number = strtoll(value, &last, 0);
+
+	// Values too large for a signed number are still valid unsigned
+	if (errno == ERANGE && value[0] != '-') {
+		errno = 0;
+		number = (long long)strtoull(value, &last, 0);
+	}
+
+	if (last == value || *last != '\0' || errno != 0) {
+		outPrintf(sh, "printf: %s: invalid number\n", value);
+		sh->status = EXIT_FAILURE;
+	}
+
+	return number;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdExecute()
+ *
+ * Description: This function executes a command that is not built into
+ *              the shell. The command may be a pipeline of several
+ *              stages, in which case every stage is started at once with
+ *              the output of each connected to the input of the next.
+ *              Any stage may have its descriptors redirected, over the
+ *              pipes. A child process is created to execute each stage in
+ *              the foreground, or background if specified. The parent
+ *              process waits for every foreground process and evaluates
+ *              if the last one exited normally or was terminated. A job
+ *              of the parallel command is started like a background job
+ *              but keeps its output, and is counted by parallel. In the
+ *              foreground, the first stage that is a plain cat or tee is
+ *              run by the shell itself once the other stages are started,
+ *              moving the data between their descriptors in the kernel.
+ *              The processes of a job started with "&" share a process
+ *              group, so the job can be stopped or killed as a whole.
+ *
+ * Parameters:  cmd - pointer to a command
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status, termination, and jobs members of sh may
+ *              be altered.
+ *
+ ************************************************************************/
+void cmdExecute(struct command *cmd, struct shell *sh) {
+
+	pid_t cpid[MAX_STAGES];     // pids of child processes
+	pid_t wpid = 0;     // return value of waitpid() command
+	int waitStatus = 0; // value altered in waitpid() command
+	int pipeFds[2];
+	int pipeInput;      // read end of the pipe from the previous stage
+	int nextInput = -1; // read end of the pipe to the next stage
+	int runInBackground = cmd->background;
+	int stageCount = cmd->stageCount;
+	int stage;
+	int ready;
+	int capturing = 0;  // whether the output is a command substitution
+	int slot = NO_JOB;
+	int *status = &sh->status;
+	int *termination = &sh->termination;
+	struct launch job;
+	struct fdPlan plan;
+	struct rusage usage;
+	long long started = 0;      // When a traced stage started
+	int streamStage = -1;       // Stage run by the shell, if any
+	int streamFds[2];           // Its input and output
+	int streamStatus = EXIT_FAILURE;
+	int source;
+	int fd;
+	pid_t group = -1;           // Process group of the job, if any
+
+	if (sh->stats != NULL)
+		statsAdd(&sh->stats->commands, 1);
+
+	// Remember the command line of a background job
+	if (runInBackground)
+		slot = jobAdd(&sh->jobs, cmd);
+	if (slot != NO_JOB)
+		sh->jobs.jobs[slot].timed = cmd->timed || sh->timeJobs;
+
+	// A job started with "&" is led by its first process
+	if (runInBackground == 1)
+		group = 0;
+
+	// The last stage is read even if no stage was started
+	cpid[stageCount - 1] = -1;
+	*status = EXIT_FAILURE;
+	for (stage = 0; stage < stageCount; stage++) {
+		struct stage *current = &cmd->stages[stage];
+		int lastStage = (stage == stageCount - 1);
+
+		pipeInput = nextInput;
+		nextInput = -1;
+		cpid[stage] = -1;
+		ready = 1;
+
+		if (sh->trace != NULL)
+			started = traceClock();
+
+		planInit(&plan);
+		if (pipeInput != -1)
+			planSet(&plan, 0, pipeInput);
+
+		// Connect this stage to the next with a pipe. The larger
+		// capacity set by BABYSH_PIPESIZE keeps the writer from
+		// stalling on a slow reader. The output of a command
+		// substitution goes through a pipe that the shell reads.
+		capturing = lastStage && !runInBackground && sh->substituting > 0
+			&& sh->output.fd == 1;
+		if (!lastStage || capturing) {
+			if (pipe2(pipeFds, O_CLOEXEC) == -1) {
+				perror("pipe failed");
+				if (pipeInput != -1)
+					close(pipeInput);
+
+				// The remaining stages are not started
+				while (stage < stageCount)
+					cpid[stage++] = -1;
+				break;
+			}
+
+			if (sh->pipeSize > 0 && !capturing)
+				fcntl(pipeFds[1], F_SETPIPE_SZ, sh->pipeSize);
+
+			planSet(&plan, 1, pipeFds[1]);
+			nextInput = pipeFds[0];
+		}
+
+		// A process running in the background reads from "/dev/null",
+		// and one started with "&" writes to it, unless redirected.
+		// The shell keeps one descriptor of it open for every job.
+		if (runInBackground && runInBackground != RUN_REQUEST
+				&& (stage == 0 || (runInBackground == 1 && lastStage))) {
+			ready = (devNull(sh) != -1);
+			if (!ready)
+				outPrintf(sh, "cannot open /dev/null\n");
+		}
+
+		if (ready && runInBackground && runInBackground != RUN_REQUEST && stage == 0)
+			planSet(&plan, 0, sh->devNull);
+		if (ready && runInBackground == 1 && lastStage)
+			planSet(&plan, 1, sh->devNull);
+
+		// The output of a parallel job goes wherever the output of
+		// the parallel command was redirected
+		if (runInBackground == RUN_PARALLEL && lastStage && sh->output.fd != 1)
+			planSet(&plan, 1, sh->output.fd);
+
+		// The redirections of the stage are made over all of these
+		if (ready)
+			ready = (planRedirects(&plan, current, sh) == 0);
+
+		if (sh->trace != NULL)
+			traceRecord(sh->trace, TRACE_REDIRECT, started);
+
+		// A cat or tee stage keeps copies of its input and output,
+		// unless it would read from a terminal, where only a process
+		// of its own can be interrupted
+		if (ready && streamStage == -1 && !runInBackground && sh->substituting == 0
+				&& cmd->placement == NULL && isStream(current->argv)) {
+			source = (plan.changed & 1u) ? plan.fds[0] : 0;
+			if (source == -1 || !isatty(source)) {
+				for (fd = 0; fd < 2; fd++) {
+					source = (plan.changed & (1u << fd)) ? plan.fds[fd] : fd;
+					streamFds[fd] = (source == -1) ? -1
+						: fcntl(source, F_DUPFD_CLOEXEC, REDIRECT_FDS);
+				}
+				streamStage = stage;
+				ready = 0;
+			}
+		}
+
+		// Describe the process to start and start it
+		if (ready) {
+			job.argv = current->argv;
+			job.path = hashLookup(&sh->hash, current->argv[0]);
+			job.plan = &plan;
+			job.placement = cmd->placement;
+			job.background = (runInBackground == 1);
+			job.group = group;
+
+			cpid[stage] = launchProcess(&job, sh);
+			if (group == 0 && cpid[stage] != -1)
+				group = cpid[stage];
+		}
+
+		// The parent's copies of the redirected files are no longer
+		// needed
+		planClose(&plan);
+
+		// The parent's copies of the pipe ends are no longer needed
+		if (pipeInput != -1)
+			close(pipeInput);
+		if (!lastStage || capturing)
+			close(pipeFds[1]);
+	}
+
+	// The output of a command substitution is read before waiting, as
+	// it may not fit in the pipe. Otherwise close the read end of a
+	// pipe left over after an error.
+	if (nextInput != -1 && capturing)
+		captureRead(nextInput, sh);
+	if (nextInput != -1)
+		close(nextInput);
+
+	if (runInBackground) {
+		// Add the pid of each background process to the job, the last
+		// one being the pid that is reported
+		for (stage = 0; stage < stageCount && slot != NO_JOB; stage++) {
+			if (cpid[stage] != -1 && jobAddProcess(&sh->jobs, slot, cpid[stage]) == -1)
+				perror("job table");
+		}
+
+		if (slot != NO_JOB && sh->jobs.jobs[slot].processes == 0) {
+			jobRemove(&sh->jobs, slot);
+			slot = NO_JOB;
+		}
+
+		// A parallel job is counted rather than reported
+		if (runInBackground == RUN_PARALLEL) {
+			if (slot != NO_JOB) {
+				sh->jobs.jobs[slot].parallel = 1;
+				sh->parallel->running++;
+			}
+			return;
+		}
+
+		// A server request replies to its client when it is done
+		if (runInBackground == RUN_REQUEST) {
+			if (slot != NO_JOB) {
+				sh->jobs.jobs[slot].client = sh->client;
+				sh->clientJob = 1;
+			}
+			return;
+		}
+
+		if (slot != NO_JOB)
+			sh->jobs.jobs[slot].group = group;
+
+		// A job started inside a command substitution belongs to the
+		// child running it, and is not part of the output
+		if (cpid[stageCount - 1] != -1) {
+			if (sh->substituting == 0)
+				outPrintf(sh, "background pid is %d\n", cpid[stageCount - 1]);
+			sh->jobs.lastPid = cpid[stageCount - 1];
+		}
+		return;
+	}
+
+	// The stage run by the shell moves its data while the processes on
+	// either side of it run
+	if (streamStage != -1) {
+		if (sh->stats != NULL)
+			statsAdd(&sh->stats->builtins, 1);
+		streamStatus = runStream(cmd->stages[streamStage].argv, streamFds, sh);
+	}
+
+	// Wait for every foreground child process to finish. The result
+	// of the pipeline is the result of its last command.
+	if (sh->trace != NULL)
+		started = traceClock();
+	for (stage = 0; stage < stageCount; stage++) {
+		if (cpid[stage] != -1) {
+			wpid = wait4(cpid[stage], &waitStatus, 0,
+				(sh->usage || sh->stats) ? &usage : NULL);
+
+			// Add the usage of the process to a timed command
+			if (wpid > 0 && sh->usage != NULL)
+				usageAdd(sh->usage, &usage);
+			if (wpid > 0 && sh->stats != NULL)
+				statsUsage(sh->stats, &usage);
+		}
+
+		if (wpid == -1) {
+			perror("wait failed");
+		}
+	}
+	if (sh->trace != NULL)
+		traceRecord(sh->trace, TRACE_WAIT, started);
+
+	if (streamStage == stageCount - 1) {
+		*status = streamStatus;
+		*termination = 0;
+		return;
+	}
+
+	if (cpid[stageCount - 1] == -1) {
+		// The last process could not be started
+		*termination = 0;
+		return;
+	}
+
+	if (WIFEXITED(waitStatus)) {
+		// The foreground process finished execution.
+		// Save the exit status
+		*status = WEXITSTATUS(waitStatus);
+
+		// Ensure termination flag is set to non-valid signal value
+		*termination = 0;
+
+		// A failed command may have been removed from the location
+		// remembered for it, in which case the entry is dropped. A
+		// spawned process reports this to launchProcess() directly.
+		if (sh->useFork && *status == EXIT_FAILURE && job.path != NULL
+				&& job.path != job.argv[0] && access(job.path, X_OK) == -1)
+			hashRemove(&sh->hash, job.argv[0]);
+	}
+
+	if (WIFSIGNALED(waitStatus)) {
+		// The foreground process was terminated.
+		// Set termination flag for use in the status command
+		*termination = WTERMSIG(waitStatus);
+		outPrintf(sh, "terminated by signal %d\n", *termination);
+	}
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    isStream()
+ *
+ * Description: This function determines whether a stage is a cat or tee
+ *              that the shell can run itself. Only "cat" with files, "-"
+ *              for its input, or none, and "tee" with files and an
+ *              optional -a qualify. Any other option is left to the
+ *              programs.
+ *
+ * Parameters:  args - the arguments of the stage
+ *
+ * Returns:     1 if the shell can run the stage, or else 0.
+ *
+ ************************************************************************/
+int isStream(char *args[]) {
+	int tee = (strcmp(args[0], "tee") == 0);
+	int position = 1;
+
+	if (!tee && strcmp(args[0], "cat") != 0)
+		return 0;
+
+	if (tee && args[1] != NULL && strcmp(args[1], "-a") == 0)
+		position++;
+
+	for (; args[position] != NULL; position++) {
+		if (args[position][0] == '-' && (tee || args[position][1] != '\0'))
+			return 0;
+	}
+
+	return 1;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    runStream()
+ *
+ * Description: This function runs a cat or tee stage of a pipeline in
+ *              the shell. SIGPIPE is blocked while it runs, so a reader
+ *              that has gone away ends the stage with EPIPE instead of
+ *              the shell, and the signal is then discarded.
+ *
+ * Parameters:  args - the arguments of the stage
+ *              fds - the input and output of the stage, which are closed
+ *              sh - pointer to the shell state
+ *
+ * Returns:     The exit status of the stage.
+ *
+ ************************************************************************/
+int runStream(char *args[], int fds[], struct shell *sh) {
+	struct timespec none = { 0, 0 };
+	sigset_t pipeSignal;
+	sigset_t shellMask;
+	int result;
+
+	sigemptyset(&pipeSignal);
+	sigaddset(&pipeSignal, SIGPIPE);
+	sigprocmask(SIG_BLOCK, &pipeSignal, &shellMask);
+
+	// Messages already buffered come before the output of the stage
+	outFlush(sh);
+	if (args[0][0] == 'c')
+		result = streamCat(args, fds, sh);
+	else
+		result = streamTee(args, fds, sh);
+
+	while (sigtimedwait(&pipeSignal, NULL, &none) == SIGPIPE)
+		continue;
+	sigprocmask(SIG_SETMASK, &shellMask, NULL);
+
+	if (fds[0] != -1)
+		close(fds[0]);
+	if (fds[1] != -1)
+		close(fds[1]);
+
+	return result;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    streamCat()
+ *
+ * Description: This function copies each named file, or the input of
+ *              the stage for "-" or if none is named, to the output of
+ *              the stage with copyData(). A file that is also the output
+ *              is not copied.
+ *
+ * Parameters:  args - the arguments of the stage
+ *              fds - the input and output of the stage
+ *              sh - pointer to the shell state
+ *
+ * Returns:     EXIT_SUCCESS, or EXIT_FAILURE if a file could not be
+ *              copied.
+ *
+ ************************************************************************/
+int streamCat(char *args[], int fds[], struct shell *sh) {
+	static char *input[] = { "-", NULL };
+	char **files = (args[1] != NULL) ? args + 1 : input;
+	struct stat fromInfo;
+	struct stat toInfo;
+	int status = EXIT_SUCCESS;
+	int error = 0;
+	int from;
+
+	for (; *files != NULL; files++) {
+		from = fds[0];
+		errno = EBADF;
+		if (strcmp(*files, "-") != 0)
+			from = open(*files, O_RDONLY|O_CLOEXEC);
+
+		if (from == -1) {
+			outPrintf(sh, "cat: %s: %s\n", *files, strerror(errno));
+			status = EXIT_FAILURE;
+			continue;
+		}
+
+		if (fstat(from, &fromInfo) == 0 && S_ISREG(fromInfo.st_mode)
+				&& fds[1] != -1 && fstat(fds[1], &toInfo) == 0
+				&& fromInfo.st_dev == toInfo.st_dev && fromInfo.st_ino == toInfo.st_ino) {
+			outPrintf(sh, "cat: %s: input file is output file\n", *files);
+			status = EXIT_FAILURE;
+		}
+		else if (copyData(from, fds[1]) == -1) {
+			// A reader that has gone away is not an error to report
+			error = errno;
+			if (error != EPIPE)
+				outPrintf(sh, "cat: %s: %s\n", *files, strerror(error));
+			status = EXIT_FAILURE;
+		}
+
+		if (from != fds[0])
+			close(from);
+
+		// Nothing more is wanted once the reader has gone
+		if (error == EPIPE)
+			break;
+	}
+
+	return status;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    streamTee()
+ *
+ * Description: This function copies the input of the stage to its output
+ *              and to each named file, which is truncated, or appended
+ *              to with -a. The input is moved a block at a time into a
+ *              pipe of the shell with splice(), duplicated from there
+ *              into a second pipe with tee() for each file, and then
+ *              moved on to the file and the output, so the data is
+ *              never copied through the shell. An input that cannot be
+ *              spliced is read and written instead.
+ *
+ * Parameters:  args - the arguments of the stage
+ *              fds - the input and output of the stage
+ *              sh - pointer to the shell state
+ *
+ * Returns:     EXIT_SUCCESS, or EXIT_FAILURE if a file could not be
+ *              written.
+ *
+ ************************************************************************/
+int streamTee(char *args[], int fds[], struct shell *sh) {
+	char buffer[STREAM_CHUNK];      // Data that cannot be spliced
+	char **names = args + 1;
+	int *files;                     // Descriptors of the files, or -1
+	int block[2] = { -1, -1 };      // Holds the block being copied
+	int copy[2] = { -1, -1 };       // Holds a copy of it for a file
+	int flags = O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC;
+	int status = EXIT_SUCCESS;
+	int spliced = 1;                // Whether the input can be spliced
+	int count = 0;
+	int file;
+	ssize_t length;
+	ssize_t copied;
+
+	if (*names != NULL && strcmp(*names, "-a") == 0) {
+		flags = O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC;
+		names++;
+	}
+
+	while (names[count] != NULL)
+		count++;
+	files = malloc((count + 1) * sizeof(*files));
+	if (files == NULL) {
+		perror("tee");
+		return EXIT_FAILURE;
+	}
+
+	for (file = 0; file < count; file++) {
+		files[file] = open(names[file], flags, 0666);
+		if (files[file] == -1) {
+			outPrintf(sh, "tee: %s: %s\n", names[file], strerror(errno));
+			status = EXIT_FAILURE;
+		}
+	}
+
+	if (pipe2(block, O_CLOEXEC) == -1 || pipe2(copy, O_CLOEXEC) == -1)
+		spliced = 0;
+
+	for (;;) {
+		length = -1;
+		if (spliced) {
+			length = splice(fds[0], NULL, block[1], NULL, STREAM_CHUNK, SPLICE_F_MOVE);
+			if (length == -1 && errno == EINTR)
+				continue;
+			if (length == -1 && errno == EINVAL)
+				spliced = 0;
+		}
+		if (!spliced) {
+			length = read(fds[0], buffer, sizeof(buffer));
+			if (length == -1 && errno == EINTR)
+				continue;
+		}
+
+		if (length <= 0) {
+			if (length == -1) {
+				outPrintf(sh, "tee: %s\n", strerror(errno));
+				status = EXIT_FAILURE;
+			}
+			break;
+		}
+
+		// The block in the pipe is only ever duplicated whole, as the
+		// pipe for the copies is empty and at least as large
+		for (file = 0; file < count; file++) {
+			if (files[file] == -1)
+				continue;
+
+			if (spliced) {
+				while ((copied = tee(block[0], copy[1], length, 0)) == -1 && errno == EINTR)
+					continue;
+				if (copied == length && drainPipe(copy[0], files[file], length, buffer) == 0)
+					continue;
+
+				// A partial copy is dropped, as the file would be short
+				if (copied > 0 && copied != length) {
+					drainPipe(copy[0], -1, copied, buffer);
+					errno = EIO;
+				}
+			}
+			else if (writeAll(files[file], buffer, length) == 0) {
+				continue;
+			}
+
+			outPrintf(sh, "tee: %s: %s\n", names[file], strerror(errno));
+			status = EXIT_FAILURE;
+			close(files[file]);
+			files[file] = -1;
+		}
+
+		if (spliced ? drainPipe(block[0], fds[1], length, buffer)
+				: writeAll(fds[1], buffer, length)) {
+			if (errno != EPIPE)
+				outPrintf(sh, "tee: %s\n", strerror(errno));
+			status = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	for (file = 0; file < count; file++) {
+		if (files[file] != -1)
+			close(files[file]);
+	}
+	for (file = 0; file < 2; file++) {
+		if (block[file] != -1)
+			close(block[file]);
+		if (copy[file] != -1)
+			close(copy[file]);
+	}
+	free(files);
+
+	return status;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    copyData()
+ *
+ * Description: This function copies everything left to read from one
+ *              descriptor to another in the kernel. Two regular files are
+ *              copied with copy_file_range(), which may share their
+ *              blocks, a pipe at either end with splice(), and another
+ *              regular file with sendfile(). A descriptor that does not
+ *              support one of these, such as an output opened to append,
+ *              falls back to the next, and finally to read() and write().
+ *
+ * Parameters:  from - the descriptor to read from
+ *              to - the descriptor to write to
+ *
+ * Returns:     0 at the end of the input, or -1 with errno set.
+ *
+ ************************************************************************/
+int copyData(int from, int to) {
+	char buffer[STREAM_CHUNK];
+	struct stat fromInfo;
+	struct stat toInfo;
+	ssize_t count;
+	int method;
+
+	if (fstat(from, &fromInfo) == -1 || fstat(to, &toInfo) == -1)
+		return -1;
+
+	// 0 is copy_file_range(), 1 splice(), 2 sendfile(), 3 read()
+	method = 3;
+	if (S_ISREG(fromInfo.st_mode))
+		method = S_ISREG(toInfo.st_mode) ? 0 : 2;
+	if (S_ISFIFO(fromInfo.st_mode) || S_ISFIFO(toInfo.st_mode))
+		method = 1;
+
+	for (;;) {
+		if (method == 0)
+			count = copy_file_range(from, NULL, to, NULL, STREAM_CHUNK * 16, 0);
+		else if (method == 1)
+			count = splice(from, NULL, to, NULL, STREAM_CHUNK, SPLICE_F_MOVE|SPLICE_F_MORE);
+		else if (method == 2)
+			count = sendfile(to, from, NULL, STREAM_CHUNK * 16);
+		else if ((count = read(from, buffer, sizeof(buffer))) > 0
+				&& writeAll(to, buffer, count) == -1)
+			return -1;
+
+		if (count == 0)
+			return 0;
+		if (count > 0 || errno == EINTR)
+			continue;
+
+		if (method == 3 || (errno != EINVAL && errno != ENOSYS && errno != EXDEV
+				&& errno != EOPNOTSUPP && errno != EBADF))
+			return -1;
+
+		// copy_file_range() falls back to sendfile(), and the others
+		// to read()
+		method = (method == 0) ? 2 : 3;
+	}
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    drainPipe()
+ *
+ * Description: This function moves a number of bytes out of a pipe of
+ *              the shell to a descriptor with splice(), or reads and
+ *              writes them if the descriptor cannot take a splice. On an
+ *              error the rest of the bytes are read and dropped, so the
+ *              pipe is left empty.
+ *
+ * Parameters:  pipeFd - the read end of the pipe
+ *              to - the descriptor to write to
+ *              length - the number of bytes in the pipe
+ *              buffer - STREAM_CHUNK bytes for data that is read
+ *
+ * Returns:     0 on success, or -1 with errno set.
+ *
+ ************************************************************************/
+int drainPipe(int pipeFd, int to, size_t length, char *buffer) {
+	int spliced = 1;
+	int error = 0;
+	ssize_t count;
+
+	while (length > 0) {
+		if (spliced && !error) {
+			count = splice(pipeFd, NULL, to, NULL, length, SPLICE_F_MOVE|SPLICE_F_MORE);
+			if (count == -1 && errno == EINTR)
+				continue;
+			if (count == -1 && (errno == EINVAL || errno == EBADF) && to != -1) {
+				spliced = 0;
+				continue;
+			}
+			if (count == -1) {
+				error = errno;
+				continue;
+			}
+		}
+		else {
+			count = read(pipeFd, buffer, (length < STREAM_CHUNK) ? length : STREAM_CHUNK);
+			if (count == -1 && errno == EINTR)
+				continue;
+			if (count <= 0)
+				return -1;
+			if (!error && writeAll(to, buffer, count) == -1)
+				error = errno;
+		}
+
+		length -= count;
+	}
+
+	errno = error;
+	return error ? -1 : 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    planInit()
+ *
+ * Description: This function starts a plan of the descriptors of a
+ *              process with every descriptor left as it is.
+ *
+ * Parameters:  plan - pointer to the plan
+ *
+ * Returns:     None. plan is altered.
+ *
+ ************************************************************************/
+void planInit(struct fdPlan *plan) {
+	int fd;
+
+	for (fd = 0; fd < REDIRECT_FDS; fd++)
+		plan->fds[fd] = fd;
+	plan->changed = 0;
+	plan->openedCount = 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    planSet()
+ *
+ * Description: This function plans for a descriptor of a process to be
+ *              replaced with another of the shell's descriptors, or to
+ *              be closed.
+ *
+ * Parameters:  plan - pointer to the plan
+ *              fd - the descriptor replaced, below REDIRECT_FDS
+ *              replacement - the descriptor it becomes, or -1 to close it
+ *
+ * Returns:     None. plan is altered.
+ *
+ ************************************************************************/
+void planSet(struct fdPlan *plan, int fd, int replacement) {
+	plan->fds[fd] = replacement;
+	plan->changed |= 1u << fd;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    planRedirects()
+ *
+ * Description: This function makes the redirections of a stage in the
+ *              order they were written, over what is already planned.
+ *              Files are opened close-on-exec in a single call, so the
+ *              shell keeps them only until the process is started. A
+ *              copy of a descriptor, as in "2>&1", takes whatever that
+ *              descriptor is planned to be, and opens nothing. Finally a
+ *              replacement that is itself to be replaced, as in
+ *              "2>&1 >file", is copied above REDIRECT_FDS, so the process
+ *              still gets the descriptor it was meant to.
+ *
+ * Parameters:  plan - pointer to the plan
+ *              stage - pointer to the stage
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0 on success, or -1 after printing a message, with every
+ *              descriptor opened for the plan closed. plan is altered.
+ *
+ ************************************************************************/
+int planRedirects(struct fdPlan *plan, struct stage *stage, struct shell *sh) {
+	struct redirect *redirect;
+	int flags;
+	int source;
+	int fd;
+
+	for (redirect = stage->redirects; redirect < stage->redirects + stage->redirectCount;
+			redirect++) {
+		switch (redirect->kind) {
+		case REDIRECT_DUP:
+			// "-" closes the descriptor
+			if (strcmp(redirect->target, "-") == 0) {
+				planSet(plan, redirect->fd, -1);
+				continue;
+			}
+
+			// One of the shell's own descriptors must be open
+			source = redirect->target[0] - '0';
+			if (source < 0 || source > 9 || redirect->target[1] != '\0'
+					|| plan->fds[source] == -1
+					|| (!(plan->changed & (1u << source)) && source > 2
+					&& fcntl(source, F_GETFD) == -1)) {
+				outPrintf(sh, "%s: bad file descriptor\n", redirect->target);
+				planClose(plan);
+				return -1;
+			}
+
+			planSet(plan, redirect->fd, plan->fds[source]);
+			continue;
+		case HERE_DOC:
+		case HERE_DOC_TABS:
+		case HERE_STRING:
+			// The contents are already open, and are closed by the caller
+			planSet(plan, redirect->fd, redirect->hereFd);
+			continue;
+		case REDIRECT_INPUT:
+			flags = O_RDONLY;
+			break;
+		case REDIRECT_OUTPUT:
+		case REDIRECT_BOTH:
+			flags = O_WRONLY|O_CREAT|O_TRUNC;
+			break;
+		default:
+			flags = O_WRONLY|O_CREAT|O_APPEND;
+			break;
+		}
+
+		source = open(redirect->target, flags|O_CLOEXEC, 0644);
+		if (source == -1) {
+			outPrintf(sh, "File Error: cannot open %s for %s\n", redirect->target,
+				(flags == O_RDONLY) ? "input" : "ouput");
+			planClose(plan);
+			return -1;
+		}
+
+		plan->opened[plan->openedCount++] = source;
+		planSet(plan, redirect->fd, source);
+		if (redirect->kind == REDIRECT_BOTH || redirect->kind == REDIRECT_BOTH_APPEND)
+			planSet(plan, 2, source);
+	}
+
+	// A replacement that is also replaced, or that is the descriptor
+	// it replaces and so would stay close-on-exec, is moved out of the
+	// way
+	for (fd = 0; fd < REDIRECT_FDS; fd++) {
+		source = plan->fds[fd];
+		if (!(plan->changed & (1u << fd)) || source < 0 || source >= REDIRECT_FDS
+				|| (source != fd && !(plan->changed & (1u << source))))
+			continue;
+
+		source = fcntl(source, F_DUPFD_CLOEXEC, REDIRECT_FDS);
+		if (source == -1) {
+			perror("redirection failed");
+			planClose(plan);
+			return -1;
+		}
+
+		plan->opened[plan->openedCount++] = source;
+		plan->fds[fd] = source;
+	}
+
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    planClose()
+ *
+ * Description: This function closes the descriptors opened for a plan,
+ *              once the process has been started with them.
+ *
+ * Parameters:  plan - pointer to the plan
+ *
+ * Returns:     None. plan is altered.
+ *
+ ************************************************************************/
+void planClose(struct fdPlan *plan) {
+	while (plan->openedCount > 0)
+		close(plan->opened[--plan->openedCount]);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    devNull()
+ *
+ * Description: This function returns a descriptor of "/dev/null", which
+ *              background processes read from and write to. It is opened
+ *              the first time it is needed and kept open after that.
+ *
+ * Parameters:  sh - pointer to the shell state
+ *
+ * Returns:     A close-on-exec descriptor, or -1 if it cannot be opened.
+ *              devNull member of sh may be altered.
+ *
+ ************************************************************************/
+int devNull(struct shell *sh) {
+	if (sh->devNull == -1)
+		sh->devNull = open("/dev/null", O_RDWR|O_CLOEXEC);
+
+	return sh->devNull;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    launchProcess()
+ *
+ * Description: This function starts the process described by job. By
+ *              default the process is created with posix_spawn(), which
+ *              does not copy the shell's page tables. The redirections
+ *              are given to it as file actions, and foreground processes
+ *              have SIGINT reset to its default behavior while
+ *              background processes inherit the shell's SIG_IGN. A job
+ *              started with "&" is put in a process group of its own,
+ *              which its first process leads. Setting
+ *              BABYSH_SPAWN=fork in the environment selects a fork() and
+ *              exec() in the child instead. If the remembered location
+ *              of the command no longer exists, the command is looked
+ *              up on PATH again. A placed process is forked if it has
+ *              limits or a cgroup, which cannot be undone in the shell,
+ *              while its CPUs and memory policy are inherited from the
+ *              shell, which takes them on only while spawning. When
+ *              tracing, the time taken to start the process and for it
+ *              to exec are recorded, and BABYSH_STATS counts the process
+ *              and the time it took to reach exec.
+ *
+ * Parameters:  job - pointer to the description of the process
+ *              sh - pointer to the shell state
+ *
+ * Returns:     The pid of the new process, or -1 if it was not started.
+ *              The path member of job may be altered.
+ *
+ ************************************************************************/
+pid_t launchProcess(struct launch *job, struct shell *sh) {
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attributes;
+	sigset_t defaultSignals;
+	sigset_t childMask;
+	cpu_set_t shellCpus;            // The shell's own placement
+	unsigned long shellNodes = 0;
+	int shellPolicy = MPOL_DEFAULT;
+	pid_t cpid = -1;
+	int result = ENOENT;
+	int placed = 1;
+	int fd;
+	long long started = 0;          // When a traced launch started
+	int execPipe[2] = { -1, -1 };   // Closed when a traced child executes
+	short flags = POSIX_SPAWN_SETSIGMASK;
+
+	// Send buffered output first, so that it is neither copied into a
+	// forked child nor shown after the output of the new process
+	outFlush(sh);
+
+	// The child holds the write end of a close-on-exec pipe, which
+	// shows when the exec has happened
+	if (sh->trace != NULL || sh->stats != NULL)
+		started = traceClock();
+	if (sh->trace != NULL && pipe2(execPipe, O_CLOEXEC) == -1)
+		execPipe[0] = execPipe[1] = -1;
+
+	if (sh->useFork || (job->placement != NULL
+			&& (job->placement->limitCount > 0 || job->placement->cgroup != NULL))) {
+		// Fork processes
+		cpid = fork();
+
+		if (cpid == -1) {
+			perror("fork failed");
+			if (sh->trace != NULL)
+				traceLaunched(sh, cpid, started, execPipe);
+			return -1;
+		}
+		else if (cpid == 0) {
+			// Set up singnal handler to catch SIGINT in
+			// the foreground processes. sigfillset() ensures
+			// that other signals will be blocked while this
+			// signal is being processed.
+			struct sigaction act;
+			act.sa_handler = SIG_DFL;
+			act.sa_flags = 0;
+			sigfillset(&(act.sa_mask));
+
+			if (job->background) {
+				// Ensure a background process is not terminated by SIGINT
+				act.sa_handler = SIG_IGN;
+			}
+
+			// Perform the default behavior of SIGINT for foreground processes
+			sigaction(SIGINT, &act, NULL);
+
+			// Unblock SIGCHLD, which the shell keeps blocked
+			sigemptyset(&childMask);
+			sigprocmask(SIG_SETMASK, &childMask, NULL);
+
+			// Messages of the child are written, not captured
+			sh->substituting = 0;
+
+			// The shell sets the group as well, so that neither can run
+			// ahead of the other
+			if (job->group != -1)
+				setpgid(0, job->group);
+
+			// Replace the redirected descriptors
+			for (fd = 0; fd < REDIRECT_FDS; fd++) {
+				if (!(job->plan->changed & (1u << fd)))
+					continue;
+
+				if (job->plan->fds[fd] == -1) {
+					close(fd);
+				}
+				else if (dup2(job->plan->fds[fd], fd) == -1) {
+					perror("dup2 failed");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			if (job->placement != NULL && placeProcess(job->placement, 1) == -1) {
+				perror("placement failed");
+				exit(EXIT_FAILURE);
+			}
+
+			// The child counts itself, as only it sees the exec
+			if (sh->stats != NULL)
+				statsLatency(sh->stats, started);
+
+			// Execute the process. If the command was not found on PATH,
+			// or the remembered file has since been removed, fall back to
+			// letting execvp() search for it.
+			if (job->path != NULL)
+				execve(job->path, job->argv, environ);
+			if (job->path == NULL || errno == ENOENT)
+				execvp(job->argv[0], job->argv);
+
+			// This is only reached if exec() fails
+			if (sh->stats != NULL)
+				statsAdd(&sh->stats->execFailures, 1);
+			outPrintf(sh, "Execution Error: %s is not a valid command\n", job->argv[0]);
+			outFlush(sh);
+			exit(EXIT_FAILURE);
+		}
+
+		if (job->group != -1)
+			setpgid(cpid, job->group ? job->group : cpid);
+
+		if (sh->stats != NULL)
+			statsAdd(&sh->stats->forks, 1);
+		if (sh->trace != NULL)
+			traceLaunched(sh, cpid, started, execPipe);
+		return cpid;
+	}
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawnattr_init(&attributes);
+
+	// Replace the redirected descriptors
+	for (fd = 0; fd < REDIRECT_FDS; fd++) {
+		if (!(job->plan->changed & (1u << fd)))
+			continue;
+
+		if (job->plan->fds[fd] == -1)
+			posix_spawn_file_actions_addclose(&actions, fd);
+		else
+			posix_spawn_file_actions_adddup2(&actions, job->plan->fds[fd], fd);
+	}
+
+	// Unblock SIGCHLD, which the shell keeps blocked
+	sigemptyset(&childMask);
+	posix_spawnattr_setsigmask(&attributes, &childMask);
+
+	// Perform the default behavior of SIGINT for foreground processes
+	if (!job->background) {
+		sigemptyset(&defaultSignals);
+		sigaddset(&defaultSignals, SIGINT);
+		posix_spawnattr_setsigdefault(&attributes, &defaultSignals);
+		flags |= POSIX_SPAWN_SETSIGDEF;
+	}
+
+	if (job->group != -1) {
+		posix_spawnattr_setpgroup(&attributes, job->group);
+		flags |= POSIX_SPAWN_SETPGROUP;
+	}
+	posix_spawnattr_setflags(&attributes, flags);
+
+	if (job->placement != NULL) {
+		sched_getaffinity(0, sizeof(shellCpus), &shellCpus);
+		syscall(SYS_get_mempolicy, &shellPolicy, &shellNodes, NUMA_NODES + 1, NULL, 0);
+		placed = (placeProcess(job->placement, 0) == 0);
+		if (!placed)
+			perror("placement failed");
+	}
+
+	if (placed && job->path != NULL)
+		result = posix_spawn(&cpid, job->path, &actions, &attributes,
+			job->argv, environ);
+
+	if (placed && result == ENOENT && job->path != NULL && job->path != job->argv[0]) {
+		// The remembered file has been removed, so search PATH again
+		hashRemove(&sh->hash, job->argv[0]);
+		job->path = hashLookup(&sh->hash, job->argv[0]);
+
+		if (job->path != NULL)
+			result = posix_spawn(&cpid, job->path, &actions, &attributes,
+				job->argv, environ);
+	}
+
+	if (job->placement != NULL) {
+		if (job->placement->pinned)
+			sched_setaffinity(0, sizeof(shellCpus), &shellCpus);
+		if (job->placement->node != -1)
+			syscall(SYS_set_mempolicy, shellPolicy, &shellNodes, NUMA_NODES + 1);
+	}
+
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attributes);
+
+	// posix_spawn() only returns once the child has executed
+	if (sh->stats != NULL && result == 0) {
+		statsAdd(&sh->stats->forks, 1);
+		statsLatency(sh->stats, started);
+	}
+	else if (sh->stats != NULL && placed) {
+		statsAdd(&sh->stats->execFailures, 1);
+	}
+
+	if (sh->trace != NULL)
+		traceLaunched(sh, (result == 0) ? cpid : -1, started, execPipe);
+
+	if (result != 0) {
+		if (placed)
+			outPrintf(sh, "Execution Error: %s is not a valid command\n", job->argv[0]);
+		return -1;
+	}
+
+	return cpid;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    traceLaunched()
+ *
+ * Description: This function records the time launchProcess() took to
+ *              start a process, then waits for the close-on-exec pipe
+ *              held by the child to reach its end, which happens when
+ *              the child executes or exits, and records that time too.
+ *
+ * Parameters:  sh - pointer to the shell state
+ *              cpid - pid of the new process, or -1 if it was not started
+ *              start - when the launch started, from traceClock()
+ *              execPipe - the pipe held by the child, or -1 entries
+ *
+ * Returns:     None. trace member of sh is altered.
+ *
+ ************************************************************************/
+void traceLaunched(struct shell *sh, pid_t cpid, long long start, int execPipe[]) {
+	char unused;
+
+	if (execPipe[1] != -1)
+		close(execPipe[1]);
+
+	if (cpid != -1) {
+		traceRecord(sh->trace, TRACE_SPAWN, start);
+
+		if (execPipe[0] != -1) {
+			while (read(execPipe[0], &unused, 1) == -1 && errno == EINTR)
+				continue;
+			traceRecord(sh->trace, TRACE_EXEC, start);
+		}
+	}
+
+	if (execPipe[0] != -1)
+		close(execPipe[0]);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    traceClock()
+ *
+ * Description: This function reads the monotonic clock.
+ *
+ * Parameters:  None.
+ *
+ * Returns:     The time in nanoseconds.
+ *
+ ************************************************************************/
+long long traceClock(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    traceRecord()
+ *
+ * Description: This function adds the time since start to the histogram
+ *              of a stage. Times under 8ns have a bucket each, and every
+ *              larger power of two is split into eight buckets by the
+ *              three bits below its leading bit.
+ *
+ * Parameters:  trace - pointer to the histograms
+ *              stage - the traceStage that was timed
+ *              start - when the stage started, from traceClock()
+ *
+ * Returns:     None. trace is altered.
+ *
+ ************************************************************************/
+void traceRecord(struct trace *trace, int stage, long long start) {
+	long long elapsed = traceClock() - start;
+	int bucket = 0;
+	int exponent;
+
+	if (elapsed >= 8) {
+		exponent = 63 - __builtin_clzll(elapsed);
+		bucket = (exponent - 2) * 8 + ((elapsed >> (exponent - 3)) & 7);
+	}
+	else if (elapsed > 0) {
+		bucket = elapsed;
+	}
+
+	trace->counts[stage][bucket]++;
+	trace->samples[stage]++;
+	if (elapsed > trace->max[stage])
+		trace->max[stage] = elapsed;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    traceBucketLimit()
+ *
+ * Description: This function finds the largest time that is counted in
+ *              a bucket of the trace histograms.
+ *
+ * Parameters:  bucket - the bucket
+ *
+ * Returns:     The time in nanoseconds.
+ *
+ ************************************************************************/
+long long traceBucketLimit(int bucket) {
+	int exponent;
+
+	if (bucket < 8)
+		return bucket;
+
+	exponent = bucket / 8 + 2;
+	return ((9LL + bucket % 8) << (exponent - 3)) - 1;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    traceReport()
+ *
+ * Description: This function writes the number of times each stage was
+ *              timed and its median, 99th percentile, and longest time,
+ *              in microseconds. Percentiles are the upper limit of the
+ *              bucket they fall in.
+ *
+ * Parameters:  sh - pointer to the shell state
+ *
+ * Returns:     None.
+ *
+ ************************************************************************/
+void traceReport(struct shell *sh) {
+	static const char *names[TRACE_STAGES] = {
+		"read", "parse", "redirect", "spawn", "exec", "wait"
+	};
+	static const char *results[] = {
+		"unused", "hit", "miss", "saved", "failed"
+	};
+	struct trace *trace = sh->trace;
+	unsigned long seen;
+	unsigned long wanted[2];        // Samples at or below p50 and p99
+	long long found[2];
+	int stage;
+	int bucket;
+	int level;
+
+	outFlush(sh);
+	sh->output.fd = trace->fd;
+
+	outPrintf(sh, "%-10s %10s %12s %12s %12s\n", "stage", "count",
+		"p50(us)", "p99(us)", "max(us)");
+
+	for (stage = 0; stage < TRACE_STAGES; stage++) {
+		if (trace->samples[stage] == 0) {
+			outPrintf(sh, "%-10s %10d %12s %12s %12s\n", names[stage], 0,
+				"-", "-", "-");
+			continue;
+		}
+
+		wanted[0] = (trace->samples[stage] + 1) / 2;
+		wanted[1] = trace->samples[stage] - trace->samples[stage] / 100;
+		seen = 0;
+		level = 0;
+
+		for (bucket = 0; bucket < TRACE_BUCKETS && level < 2; bucket++) {
+			seen += trace->counts[stage][bucket];
+			while (level < 2 && seen >= wanted[level]) {
+				found[level] = traceBucketLimit(bucket);
+				if (found[level] > trace->max[stage])
+					found[level] = trace->max[stage];
+				level++;
+			}
+		}
+
+		outPrintf(sh, "%-10s %10lu %12.1f %12.1f %12.1f\n", names[stage],
+			trace->samples[stage], found[0] / 1000.0, found[1] / 1000.0,
+			trace->max[stage] / 1000.0);
+	}
+
+	if (trace->cache != CACHE_UNUSED)
+		outPrintf(sh, "%-10s %10s\n", "cache", results[trace->cache]);
+
+	outFlush(sh);
+	sh->output.fd = 1;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    statsOpen()
+ *
+ * Description: This function creates the shared memory segment that the
+ *              counters of BABYSH_STATS are kept in. The value "on"
+ *              names it after the pid of the shell, and removes it when
+ *              the shell exits, while any other value is the name of a
+ *              segment that is reset and left behind for later reading.
+ *              The shell exits if the segment cannot be set up.
+ *
+ * Parameters:  name - the value of BABYSH_STATS
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. stats and statsOwned members of sh are altered.
+ *
+ ************************************************************************/
+void statsOpen(char *name, struct shell *sh) {
+	char path[NAME_MAX];
+	char pid[24];
+	struct stats *stats;
+	int fd;
+
+	if (strcmp(name, "on") == 0) {
+		snprintf(pid, sizeof(pid), "%d", (int) getpid());
+		name = pid;
+		sh->statsOwned = 1;
+	}
+	statsPath(path, sizeof(path), name);
+
+	fd = shm_open(path, O_RDWR|O_CREAT, 0600);
+	stats = MAP_FAILED;
+	if (fd != -1 && ftruncate(fd, sizeof(*stats)) == 0)
+		stats = mmap(NULL, sizeof(*stats), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (fd != -1)
+		close(fd);
+
+	if (stats == MAP_FAILED) {
+		outPrintf(sh, "File Error: cannot create stats %s\n", path);
+		outFlush(sh);
+		exit(EXIT_FAILURE);
+	}
+
+	// A reader only trusts the counters once the magic is in place
+	memset(stats, 0, sizeof(*stats));
+	stats->version = STATS_VERSION;
+	stats->pid = getpid();
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(stats->magic, STATS_MAGIC, sizeof(stats->magic));
+
+	sh->stats = stats;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    statsPath()
+ *
+ * Description: This function finds the name of the shared memory segment
+ *              of BABYSH_STATS. A number is the pid of a shell that was
+ *              given "on", and any other name has a '/' put before it if
+ *              it has none.
+ *
+ * Parameters:  path - where the name is written
+ *              size - the size of path
+ *              name - a pid or a segment name
+ *
+ * Returns:     None. path is altered.
+ *
+ ************************************************************************/
+void statsPath(char *path, size_t size, char *name) {
+	if (name[strspn(name, "0123456789")] == '\0')
+		snprintf(path, size, "/babysh.%s", name);
+	else
+		snprintf(path, size, "%s%s", (name[0] == '/') ? "" : "/", name);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    statsAdd()
+ *
+ * Description: This function adds to one of the counters of BABYSH_STATS.
+ *              The add is a relaxed atomic, as the counters only need to
+ *              be exact once the shell and its children stop updating
+ *              them, and it makes no system call.
+ *
+ * Parameters:  counter - pointer to the counter
+ *              amount - the amount added
+ *
+ * Returns:     None. counter is altered.
+ *
+ ************************************************************************/
+void statsAdd(unsigned long long *counter, unsigned long long amount) {
+	__atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    statsUsage()
+ *
+ * Description: This function adds the CPU time of a child that was
+ *              waited for to the counters of BABYSH_STATS.
+ *
+ * Parameters:  stats - pointer to the counters
+ *              usage - pointer to the resources used by the child
+ *
+ * Returns:     None. stats is altered.
+ *
+ ************************************************************************/
+void statsUsage(struct stats *stats, struct rusage *usage) {
+	statsAdd(&stats->childUser, usage->ru_utime.tv_sec * 1000000000ULL
+		+ usage->ru_utime.tv_usec * 1000ULL);
+	statsAdd(&stats->childSystem, usage->ru_stime.tv_sec * 1000000000ULL
+		+ usage->ru_stime.tv_usec * 1000ULL);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    statsLatency()
+ *
+ * Description: This function counts the time since a process started to
+ *              be launched in the histogram of BABYSH_STATS. Bucket n
+ *              counts the times of n bits of nanoseconds, so the last
+ *              bucket counts every time over a second.
+ *
+ * Parameters:  stats - pointer to the counters
+ *              start - when the launch started, from traceClock()
+ *
+ * Returns:     None. stats is altered.
+ *
+ ************************************************************************/
+void statsLatency(struct stats *stats, long long start) {
+	long long elapsed = traceClock() - start;
+	int bucket = 0;
+
+	if (elapsed > 0)
+		bucket = 64 - __builtin_clzll(elapsed);
+	if (bucket >= STATS_BUCKETS)
+		bucket = STATS_BUCKETS - 1;
+
+	statsAdd(&stats->latency[bucket], 1);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdStats()
+ *
+ * Description: This function executes the built in command "stats",
+ *              which shows the counters of BABYSH_STATS. With no
+ *              argument the counters of this shell are shown. Otherwise
+ *              the argument is the pid of another shell or the name of
+ *              its segment, which is mapped read only while it is shown.
+ *              Times are in microseconds, and the launch histogram lists
+ *              the number of processes that took less than each time to
+ *              reach exec.
+ *
+ * Parameters:  args - an array of char*
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status and termination members of sh are altered.
+ *
+ ************************************************************************/
+void cmdStats(char *args[], struct shell *sh) {
+	static const char *names[] = {
+		"commands", "forks", "exec failures", "builtins", "jobs active",
+		"jobs peak"
+	};
+	struct stats *stats = sh->stats;
+	unsigned long long *counters[6];
+	unsigned long long count;
+	char path[NAME_MAX];
+	struct stat info;
+	int bucket;
+	int fd;
+
+	sh->status = EXIT_FAILURE;
+	sh->termination = 0;
+
+	if (args[1] == NULL && stats == NULL) {
+		outPrintf(sh, "stats: BABYSH_STATS is not set\n");
+		return;
+	}
+
+	if (args[1] != NULL) {
+		statsPath(path, sizeof(path), args[1]);
+		stats = MAP_FAILED;
+		fd = shm_open(path, O_RDONLY, 0);
+		if (fd != -1 && fstat(fd, &info) == 0 && info.st_size >= (off_t) sizeof(*stats))
+			stats = mmap(NULL, sizeof(*stats), PROT_READ, MAP_SHARED, fd, 0);
+		if (fd != -1)
+			close(fd);
+
+		if (stats == MAP_FAILED) {
+			outPrintf(sh, "stats: cannot open %s\n", path);
+			return;
+		}
+
+		if (memcmp(stats->magic, STATS_MAGIC, sizeof(stats->magic)) != 0
+				|| stats->version != STATS_VERSION) {
+			outPrintf(sh, "stats: %s does not hold babysh stats\n", path);
+			munmap(stats, sizeof(*stats));
+			return;
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}
+
+	counters[0] = &stats->commands;
+	counters[1] = &stats->forks;
+	counters[2] = &stats->execFailures;
+	counters[3] = &stats->builtins;
+	counters[4] = &stats->jobsActive;
+	counters[5] = &stats->jobsPeak;
+
+	outPrintf(sh, "%-14s %12d\n", "pid", (int) stats->pid);
+	for (bucket = 0; bucket < 6; bucket++)
+		outPrintf(sh, "%-14s %12llu\n", names[bucket],
+			__atomic_load_n(counters[bucket], __ATOMIC_RELAXED));
+	outPrintf(sh, "%-14s %12llu\n", "user(us)",
+		__atomic_load_n(&stats->childUser, __ATOMIC_RELAXED) / 1000);
+	outPrintf(sh, "%-14s %12llu\n", "sys(us)",
+		__atomic_load_n(&stats->childSystem, __ATOMIC_RELAXED) / 1000);
+
+	outPrintf(sh, "%-14s %12s\n", "exec in(us)", "count");
+	for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+		count = __atomic_load_n(&stats->latency[bucket], __ATOMIC_RELAXED);
+		if (count == 0)
+			continue;
+
+		if (bucket == STATS_BUCKETS - 1)
+			outPrintf(sh, ">= %-11.1f %12llu\n", (1LL << (bucket - 1)) / 1000.0, count);
+		else
+			outPrintf(sh, "< %-12.1f %12llu\n", (1LL << bucket) / 1000.0, count);
+	}
+
+	if (stats != sh->stats)
+		munmap(stats, sizeof(*stats));
+
+	sh->status = EXIT_SUCCESS;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    historyOpen()
+ *
+ * Description: This function opens the history file, ~/.babysh_history
+ *              unless another is named, and maps it into memory. Nothing
+ *              in the file is read, so starting takes the same time
+ *              however long the history has grown. As its lines are not
+ *              counted, a file is taken to have grown well beyond the
+ *              lines kept once it holds more than HISTORY_COMPACT bytes
+ *              for each of them, far more than a command line usually
+ *              takes, and it is then compacted by historyCompact() in
+ *              the background. Lines are only added when the shell reads
+ *              from a terminal. If the file cannot be opened the shell
+ *              runs without history.
+ *
+ * Parameters:  file - the name of the history file, or NULL
+ *              size - the number of lines kept
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. history member of sh is altered.
+ *
+ ************************************************************************/
+void historyOpen(char *file, int size, struct shell *sh) {
+	struct history *history = &sh->history;
+	char *home = getenv("HOME");
+
+	if (file == NULL && (home == NULL || *home == '\0'))
+		return;
+
+	history->path = (file != NULL) ? strdup(file)
+		: malloc(strlen(home) + sizeof("/.babysh_history"));
+	if (history->path == NULL)
+		return;
+	if (file == NULL)
+		stpcpy(stpcpy(history->path, home), "/.babysh_history");
+
+	history->size = size;
+	if (historyReopen(history) == -1 || historyMap(history) == -1) {
+		outPrintf(sh, "File Error: cannot open %s for history\n", history->path);
+		if (history->fd != -1)
+			close(history->fd);
+		history->fd = -1;
+		free(history->path);
+		history->path = NULL;
+		return;
+	}
+
+	history->record = sh->interactive;
+
+	// HISTORY_COMPACT is in bytes per line kept, an upper bound on the
+	// usual length of a line, as counting the lines would read the file
+	if (history->mapped > (size_t)size * HISTORY_COMPACT)
+		historyCompact(sh);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    historyReopen()
+ *
+ * Description: This function opens the history file by its name, in
+ *              place of a file another shell has since replaced with a
+ *              compacted copy. The file is opened with O_APPEND, so that
+ *              each write goes to the end of the file, however many
+ *              shells share it. The old mapping and ring are dropped.
+ *
+ * Parameters:  history - pointer to the history
+ *
+ * Returns:     0 on success, or -1 if the file cannot be opened.
+ *
+ ************************************************************************/
+int historyReopen(struct history *history) {
+	int fd;
+
+	fd = open(history->path, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC, 0600);
+	if (fd == -1)
+		return -1;
+
+	if (history->fd != -1)
+		close(history->fd);
+	history->fd = fd;
+
+	if (history->data != NULL)
+		munmap(history->data, history->mapped);
+	history->data = NULL;
+	history->mapped = 0;
+	free(history->offsets);
+	history->offsets = NULL;
+
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    historyMap()
+ *
+ * Description: This function maps the whole history file, including the
+ *              lines other shells have added since it was last mapped.
+ *              A file left unlinked by a compaction is reopened by name,
+ *              and one that has shrunk is indexed again from the start.
+ *
+ * Parameters:  history - pointer to the history
+ *
+ * Returns:     0 on success, or -1 on an error.
+ *
+ ************************************************************************/
+int historyMap(struct history *history) {
+	struct stat info;
+
+	if (fstat(history->fd, &info) == -1)
+		return -1;
+
+	if (info.st_nlink == 0
+			&& (historyReopen(history) == -1 || fstat(history->fd, &info) == -1))
+		return -1;
+
+	if ((size_t)info.st_size < history->mapped) {
+		munmap(history->data, history->mapped);
+		history->data = NULL;
+		history->mapped = 0;
+		free(history->offsets);
+		history->offsets = NULL;
+	}
+
+	if ((size_t)info.st_size == history->mapped)
+		return 0;
+
+	if (history->data != NULL)
+		munmap(history->data, history->mapped);
+	history->data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, history->fd, 0);
+	if (history->data == MAP_FAILED) {
+		history->data = NULL;
+		history->mapped = 0;
+		free(history->offsets);
+		history->offsets = NULL;
+		return -1;
+	}
+
+	history->mapped = info.st_size;
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    historyIndex()
+ *
+ * Description: This function brings the ring of line offsets up to date
+ *              with the mapped file. The first time, only the lines the
+ *              ring holds are found, by searching back from the end of
+ *              the file, so the older lines are never touched. After
+ *              that only the bytes added since are looked through, each
+ *              new line taking the place of the oldest.
+ *
+ * Parameters:  history - pointer to the history
+ *
+ * Returns:     0 on success, or -1 if memory ran out.
+ *
+ ************************************************************************/
+int historyIndex(struct history *history) {
+	char *data = history->data;
+	char *newline;
+	size_t position;
+
+	if (history->offsets == NULL) {
+		history->offsets = malloc(history->size * sizeof(*history->offsets));
+		if (history->offsets == NULL)
+			return -1;
+
+		history->first = 0;
+		history->count = 0;
+		history->indexed = historyStart(data, history->mapped, history->size);
+	}
+
+	// Lines begin at the start of the file and after each newline
+	position = history->indexed;
+	while (position < history->mapped) {
+		if (position == 0 || data[position - 1] == '\n') {
+			if (history->count < history->size) {
+				history->offsets[(history->first + history->count) % history->size]
+					= position;
+				history->count++;
+			}
+			else {
+				history->offsets[history->first] = position;
+				history->first = (history->first + 1) % history->size;
+			}
+		}
+
+		newline = memchr(data + position, '\n', history->mapped - position);
+		position = newline ? (size_t)(newline - data) + 1 : history->mapped;
+	}
+
+	history->indexed = history->mapped;
+	return 0;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    historyStart()
+ *
+ * Description: This function finds where the last lines of the history
+ *              begin, searching back from the end with memrchr().
+ *
+ * Parameters:  data - the history
+ *              size - the number of bytes in data
+ *              lines - the number of lines wanted
+ *
+ * Returns:     The offset of the first of the last lines, or 0 if there
+ *              are no more lines than that.
+ *
+ ************************************************************************/
+size_t historyStart(char *data, size_t size, int lines) {
+	char *newline;
+	size_t end = size;
+
+	// The newline ending the last line does not begin another
+	if (end > 0 && data[end - 1] == '\n')
+		end--;
+
+	while (lines-- > 0) {
+		newline = (end > 0) ? memrchr(data, '\n', end) : NULL;
+		if (newline == NULL)
+			return 0;
+		end = newline - data;
+	}
+
+	return end + 1;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    historyCompact()
+ *
+ * Description: This function starts a process that rewrites the history
+ *              file with only the lines the ring holds, while the shell
+ *              carries on. The process takes an exclusive lock on the
+ *              file, copies the last lines to a new file and renames it
+ *              over the old one. Shells add lines under a shared lock,
+ *              so no line is lost, and a shell still holding the old file
+ *              finds it unlinked and opens the new one. The process is
+ *              collected by reapBackground() like any other child, but
+ *              is not a job.
+ *
+ * Parameters:  sh - pointer to the shell state
+ *
+ * Returns:     None.
+ *
+ ************************************************************************/
+void historyCompact(struct shell *sh) {
+	struct history *history = &sh->history;
+	struct stat info;
+	char temporary[PATH_MAX];
+	char *data;
+	size_t start;
+	pid_t cpid;
+	int fd;
+	int copy = -1;
+
+	// Buffered output is not copied into the child
+	outFlush(sh);
+
+	cpid = fork();
+	if (cpid == -1)
+		perror("fork failed");
+	if (cpid != 0)
+		return;
+
+	// The file is checked again once it is locked, as another shell may
+	// have compacted it first
+	fd = open(history->path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1 || flock(fd, LOCK_EX) == -1 || fstat(fd, &info) == -1
+			|| info.st_nlink == 0 || info.st_size == 0)
+		_exit(EXIT_FAILURE);
+
+	data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED)
+		_exit(EXIT_FAILURE);
+
+	start = historyStart(data, info.st_size, history->size);
+	if (start == 0)
+		_exit(EXIT_SUCCESS);
+
+	if (snprintf(temporary, sizeof(temporary), "%s.%d", history->path,
+			(int) getpid()) < (int)sizeof(temporary))
+		copy = open(temporary, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+	if (copy == -1)
+		_exit(EXIT_FAILURE);
+
+	if (writeAll(copy, data + start, info.st_size - start) == -1
+			|| fsync(copy) == -1 || rename(temporary, history->path) == -1) {
+		unlink(temporary);
+		_exit(EXIT_FAILURE);
+	}
+
+	_exit(EXIT_SUCCESS);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    historyAdd()
+ *
+ * Description: This function adds a line read from the terminal to the
+ *              history file. The line is written together with its
+ *              newline in a single write(), which O_APPEND places at the
+ *              end of the file, so lines of shells sharing the file are
+ *              never mixed. Blank lines are left out.
+ *
+ * Parameters:  line - the line, terminated in place of its newline
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. history member of sh may be altered.
+ *
+ ************************************************************************/
+void historyAdd(char *line, struct shell *sh) {
+	struct history *history = &sh->history;
+	struct stat info;
+	size_t length = strlen(line);
+
+	if (line[strspn(line, " \t")] == '\0')
+		return;
+
+	// The shared lock keeps a compaction from copying the file while
+	// the line is added, and a file compacted already is followed
+	if (flock(history->fd, LOCK_SH) == -1)
+		return;
+	if (fstat(history->fd, &info) == 0 && info.st_nlink == 0) {
+		flock(history->fd, LOCK_UN);
+		if (historyReopen(history) == -1 || flock(history->fd, LOCK_SH) == -1)
+			return;
+	}
+
+	// The newline is put back only for the write
+	line[length] = '\n';
+	if (write(history->fd, line, length + 1) == -1)
+		perror("history");
+	line[length] = '\0';
+
+	flock(history->fd, LOCK_UN);
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    cmdHistory()
+ *
+ * Description: This function executes the built in command "history",
+ *              which lists the lines kept in the history, numbered from
+ *              the oldest. Given a word, only the lines beginning with it
+ *              are listed, and with -s, the lines containing it. Lines
+ *              added by other shells sharing the file are included. The
+ *              search runs over the mapped file with memmem(), from the
+ *              oldest line kept, rather than over each line in turn.
+ *
+ * Parameters:  args - an array of char*
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status member of sh is altered.
+ *
+ ************************************************************************/
+void cmdHistory(char *args[], struct shell *sh) {
+	struct history *history = &sh->history;
+	int substring = (args[1] != NULL && strcmp(args[1], "-s") == 0);
+	char *pattern = args[1 + substring];
+	size_t length = pattern ? strlen(pattern) : 0;
+	size_t start;
+	size_t end;
+	size_t from;
+	char *found;
+	int entry;
+
+	sh->status = EXIT_FAILURE;
+	sh->termination = 0;
+
+	if (history->path == NULL) {
+		outPrintf(sh, "history: history is off\n");
+		return;
+	}
+
+	if ((substring && pattern == NULL) || (pattern != NULL && args[2 + substring] != NULL)) {
+		outPrintf(sh, "history: usage: history [[-s] text]\n");
+		return;
+	}
+
+	if (historyMap(history) == -1 || historyIndex(history) == -1) {
+		perror("history");
+		return;
+	}
+	sh->status = EXIT_SUCCESS;
+
+	// Each match found is listed with the line it is in, and the search
+	// goes on after that line
+	from = history->count ? history->offsets[history->first] : history->mapped;
+	entry = 0;
+	while (from < history->mapped) {
+		if (substring) {
+			found = memmem(history->data + from, history->mapped - from, pattern, length);
+			if (found == NULL)
+				break;
+			from = found - history->data;
+
+			// Move on to the line holding the match
+			while (entry + 1 < history->count && history->offsets[(history->first
+					+ entry + 1) % history->size] <= from)
+				entry++;
+		}
+
+		start = history->offsets[(history->first + entry) % history->size];
+		found = memchr(history->data + start, '\n', history->mapped - start);
+		end = found ? (size_t)(found - history->data) : history->mapped;
+
+		if (substring || pattern == NULL || (end - start >= length
+				&& memcmp(history->data + start, pattern, length) == 0))
+			outPrintf(sh, "%5d  %.*s\n", entry + 1, (int)(end - start),
+				history->data + start);
+
+		from = end + 1;
+		if (++entry >= history->count)
+			break;
+	}
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    hashLookup()
+ *
+ * Description: This function finds the file to execute for a command.
+ *              Names containing a '/' are used as given. Otherwise the
+ *              command hash is checked first, and only if the command is
+ *              not there is each directory of PATH searched. A command
+ *              that is found is remembered in the hash. All remembered
+ *              commands are forgotten if PATH has changed since they
+ *              were found.
+ *
+ * Parameters:  hash - pointer to the command hash
+ *              name - the command name
+ *
+ * Returns:     The path to execute, or NULL if the command is not found.
+ *
+ ************************************************************************/
+char *hashLookup(struct pathHash *hash, char *name) {
+	char *pathVar = getenv("PATH");
+	char *dir;
+	char *end;
+	char candidate[PATH_MAX];
+	struct hashEntry *entry;
+	struct stat fileInfo;
+	unsigned int bucket;
+	size_t nameLen;
+
+	if (strchr(name, '/') != NULL)
+		return name;
 
+	if (pathVar == NULL)
+		pathVar = DEFAULT_PATH;
 
-	// Show the command prompt until user enters "exit"
-	while (TRUE) {
-		// Check for background processes
-		while (bgOpen[bgCounter] != PROCESS_INVALID) {
-			pid_t curPid = bgOpen[bgCounter];
-			pid_t wpid;
+	// Forget everything found with a previous value of PATH
+	if (hash->pathCopy == NULL || strcmp(hash->pathCopy, pathVar) != 0) {
+		hashClear(hash);
+		hash->pathCopy = strdup(pathVar);
+	}
 
-			if (curPid != PROCESS_IS_FINISHED) {
-				// Current process has not been marked completed
+	bucket = hashBucket(name);
+	for (entry = hash->buckets[bucket]; entry; entry = entry->next) {
+		if (strcmp(entry->name, name) == 0) {
+			entry->hits++;
+			return entry->path;
+		}
+	}
 
-				// Check for process completion
-				wpid = waitpid(curPid, &bgStatus, WNOHANG);
+	// Search each directory in PATH. An empty entry is the current
+	// directory.
+	nameLen = strlen(name);
+	for (dir = pathVar; ; dir = end + 1) {
+		end = strchrnul(dir, ':');
 
-				if (wpid == -1) {
-					perror("wait failed\n");
-					status = EXIT_FAILURE;
-				}
-				else if (wpid > 0) {
-					// The process has completed
-					printf("background pid %d is done: ", curPid);
-					fflush(stdout);
-
-					// Print exit value of process
-					if (WIFEXITED(bgStatus)) {
-						printf("exit value %d\n", WEXITSTATUS(bgStatus));
-						fflush(stdout);
-					}
+		if (end == dir)
+			snprintf(candidate, sizeof(candidate), "./%s", name);
+		else
+			snprintf(candidate, sizeof(candidate), "%.*s/%s",
+				(int)(end - dir), dir, name);
 
-					// Print termination if foreground process is terminated.
-					// Set termination flag for use in the status command.
-					if (WIFSIGNALED(bgStatus)) {
-						printf("terminated by signal %d\n", WTERMSIG(bgStatus));
-						fflush(stdout);
-					}
+		if (stat(candidate, &fileInfo) == 0 && S_ISREG(fileInfo.st_mode)
+				&& access(candidate, X_OK) == 0) {
+			// Store the entry, name and path in a single allocation
+			entry = malloc(sizeof(*entry) + nameLen + strlen(candidate) + 2);
+			if (entry == NULL)
+				return NULL;
 
-					// Mark current position in array as completed
-					bgOpen[bgCounter] = PROCESS_IS_FINISHED;
-				}
-			}
-			bgCounter++;
+			entry->name = (char *)(entry + 1);
+			entry->path = entry->name + nameLen + 1;
+			strcpy(entry->name, name);
+			strcpy(entry->path, candidate);
+			entry->hits = 1;
+			entry->next = hash->buckets[bucket];
+			hash->buckets[bucket] = entry;
+			return entry->path;
 		}
 
-		// Reset counter for background processes
-		bgCounter = 0;
+		if (*end == '\0')
+			return NULL;
+	}
+}
 
-		// Show command prompt
-		printf(": ");
-		fflush(stdout);
 
-		// Get input from user
-		getInput(userInput);
 
-		// Parse user input into list of arguments
-		parseInput(userInput, inputArgs);
+/*************************************************************************
+ *
+ * Function:    hashRemove()
+ *
+ * Description: This function forgets the remembered location of a
+ *              single command.
+ *
+ * Parameters:  hash - pointer to the command hash
+ *              name - the command name
+ *
+ * Returns:     None. hash parameter may be altered.
+ *
+ ************************************************************************/
+void hashRemove(struct pathHash *hash, char *name) {
+	struct hashEntry **link;
+	struct hashEntry *entry;
 
-		// Process the arguments and attempt to execute any commands found
-		processArgs(inputArgs, &status, &termination, bgOpen);
+	for (link = &hash->buckets[hashBucket(name)]; (entry = *link); link = &entry->next) {
+		if (strcmp(entry->name, name) == 0) {
+			*link = entry->next;
+			free(entry);
+			return;
+		}
 	}
-
-	exit(EXIT_SUCCESS);
 }
 
 
 
 /*************************************************************************
  *
- * Function:    getInput()
+ * Function:    hashBucket()
  *
- * Description: This function gets a line of input from the user and
- *              removes any newline character.
+ * Description: This function computes the FNV-1a hash of a command name
+ *              to select its bucket in the command hash.
  *
- * Parameters:  input - a char array
+ * Parameters:  name - the command name
  *
- * Returns:     None. input parameter is altered.
+ * Returns:     The bucket index for the name.
  *
  ************************************************************************/
-void getInput(char input[]) {
-	char *p;
+unsigned int hashBucket(char *name) {
+	unsigned int value = 2166136261u;
 
-	fgets(input, MAX_LINE_LENGTH, stdin);
+	while (*name)
+		value = (value ^ (unsigned char)*name++) * 16777619u;
 
-	// Remove newline character if there is one
-	if ((p = strchr(input, '\n')) != 0)
-		*p = '\0';
+	return value % HASH_BUCKETS;
 }
 
 
 
 /*************************************************************************
  *
- * Function:    parseInput()
+ * Function:    hashClear()
  *
- * Description:	This function evaluates a line of user input and parses
- *              it into an array of arguments.
+ * Description: This function forgets every remembered command.
  *
- * Parameters:  input - a char array
- *              args - an array of char*
+ * Parameters:  hash - pointer to the command hash
  *
- * Returns:     None. args parameter will be altered.
+ * Returns:     None. hash parameter is altered.
  *
  ************************************************************************/
-void parseInput(char input[], char *args[]) {
-	int position = 0;
-	char *token;
-
-	token = strtok(input, " ");
+void hashClear(struct pathHash *hash) {
+	struct hashEntry *entry;
+	int bucket;
 
-	while (token != NULL) {
-		// Add parsed value to array of arguments
-		args[position++] = token;
-		token = strtok(NULL, " ");
+	for (bucket = 0; bucket < HASH_BUCKETS; bucket++) {
+		while ((entry = hash->buckets[bucket]) != NULL) {
+			hash->buckets[bucket] = entry->next;
+			free(entry);
+		}
 	}
 
-	// Ensure that the final value in the array is set to null.
- 	// This will help account for blank input, and provide for a
- 	// stopping point when evaluating the arguments.
-	args[position] = NULL;
-
+	free(hash->pathCopy);
+	hash->pathCopy = NULL;
 }
 
 
 
 /*************************************************************************
  *
- * Function: 	processArgs()
+ * Function:    jobAdd()
  *
- * Description: This function evaluates the first string in an array of
- *              arguments. An empty string (representing a blank line of
- *              input) and a string beginning with '#' (the comment
- *              symbol) are ignored. All other strings are commands and
- *              the function determines whether the command is built in
- *              or not. The command is sent to the appropriate function
- *              for execution.
+ * Description: This function adds a job to the job table, growing the
+ *              table if there is no free slot. The job's start time and
+ *              its command line, rebuilt from the parsed command, are
+ *              saved.
+ *              Processes are added to the job with jobAddProcess().
  *
- * Parameters:	args - an array of char*
- *              status - pointer to an int
- *              termination - pointer to an int
- *              bgOpen - an array of pid_t
+ * Parameters:  table - pointer to the job table
+ *              cmd - pointer to a command
  *
- * Returns:     None.
+ * Returns:     The slot of the new job, or NO_JOB if memory ran out.
  *
  ************************************************************************/
-void processArgs(char *args[], int *status, int *termination, pid_t bgOpen[]) {
-	// int position = 0;   //rvw: un-used variable
+int jobAdd(struct jobTable *table, struct command *cmd) {
+	struct job *job;
+	struct job *grown;
+	struct stage *stage;
+	struct redirect *redirect;
+	static const char *operators[] = {
+		"<", ">", ">>", "&>", "&>>", ">&", "<<", "<<-", "<<<"
+	};
+	size_t length = 1;
+	char *end;
+	unsigned long long active;      // Jobs counted by BABYSH_STATS
+	int newCapacity;
+	int position;
+	int slot;
 
+	if (table->freeSlot == NO_JOB) {
+		// Double the number of slots and chain the new ones together
+		newCapacity = table->capacity ? table->capacity * 2 : JOBS_INITIAL;
+		grown = realloc(table->jobs, newCapacity * sizeof(*grown));
+		if (grown == NULL)
+			return NO_JOB;
 
-	if (args[0] == NULL || args[0][0] == '#') {
-		// If the user input is a blank line or a commented line
-		// (beginning with #), do nothing and return to the shell prompt.
-		return;
-	}
+		for (slot = table->capacity; slot < newCapacity; slot++) {
+			grown[slot].pid = 0;
+			grown[slot].nextFree = (slot + 1 < newCapacity) ? slot + 1 : NO_JOB;
+		}
 
-	if (strcmp(args[0], "cd") == 0) {
-		// Execute the change directory command
-		cmdChangeDir(args, status);
+		table->jobs = grown;
+		table->freeSlot = table->capacity;
+		table->capacity = newCapacity;
 	}
-	else if (strcmp(args[0], "status") == 0) {
-		// Execute the status command
-		cmdStatus(*status, *termination);
+
+	slot = table->freeSlot;
+	job = &table->jobs[slot];
+
+	// Rebuild the command line from the stages
+	for (stage = cmd->stages; stage < cmd->stages + cmd->stageCount; stage++) {
+		for (position = 0; stage->argv[position] != NULL; position++)
+			length += strlen(stage->argv[position]) + 1;
+		length += 3;
+		for (redirect = stage->redirects;
+				redirect < stage->redirects + stage->redirectCount; redirect++)
+			length += strlen(redirect->target) + 7;
 	}
-	else if (strcmp(args[0], "exit") == 0) {
-		// Execute the exit command
-		cmdExit(bgOpen);
+
+	job->command = malloc(length);
+	if (job->command == NULL)
+		return NO_JOB;
+
+	end = job->command;
+	for (stage = cmd->stages; stage < cmd->stages + cmd->stageCount; stage++) {
+		if (stage > cmd->stages)
+			end = stpcpy(end, " | ");
+		for (position = 0; stage->argv[position] != NULL; position++) {
+			if (position > 0)
+				*end++ = ' ';
+			end = stpcpy(end, stage->argv[position]);
+		}
+		// The descriptor is only written when it is not the usual one
+		for (redirect = stage->redirects;
+				redirect < stage->redirects + stage->redirectCount; redirect++) {
+			*end++ = ' ';
+			if (redirect->fd != ((redirect->kind == REDIRECT_INPUT
+					|| redirect->kind >= HERE_DOC) ? 0 : 1))
+				*end++ = '0' + redirect->fd;
+			end = stpcpy(end, operators[redirect->kind]);
+			if (redirect->kind != REDIRECT_DUP)
+				*end++ = ' ';
+			end = stpcpy(end, redirect->target);
+		}
 	}
-	else {
-		// Attempt to execute the given command
-		cmdExecute(args, status, termination, bgOpen);
+	*end = '\0';
+
+	table->freeSlot = job->nextFree;
+	job->pid = 0;
+	job->processes = 0;
+	job->waitStatus = 0;
+	job->parallel = 0;
+	job->client = -1;
+	job->timed = 0;
+	job->group = 0;
+	job->stopped = 0;
+	memset(&job->usage, 0, sizeof(job->usage));
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+	// Only the shell adds jobs, so the peak needs no compare and swap
+	if (table->stats != NULL) {
+		active = __atomic_add_fetch(&table->stats->jobsActive, 1, __ATOMIC_RELAXED);
+		if (active > table->stats->jobsPeak)
+			__atomic_store_n(&table->stats->jobsPeak, active, __ATOMIC_RELAXED);
 	}
+
+	return slot;
 }
 
 
 
 /*************************************************************************
  *
- * Function:    cmdChangeDir()
+ * Function:    jobAddProcess()
  *
- * Description: This function changes the working directory to a path
- *              specified by the user. The function supports absolute
- *              and relative paths. If the path is not valid, an error
- *              message is printed.
+ * Description: This function adds a process to a job and enters the
+ *              process in the index of pids, which is doubled in size
+ *              whenever it becomes half full. The last process added is
+ *              the one whose pid and status are reported for the job.
  *
- * Parameters:  args - an array of char*
- *              status - pointer to an int
+ * Parameters:  table - pointer to the job table
+ *              slot - the slot of the job
+ *              pid - the process id
  *
- * Returns:     None. status parameter may be altered.
+ * Returns:     0 on success, or -1 if memory ran out.
  *
  ************************************************************************/
-void cmdChangeDir(char *args[], int *status) {
-	// Find the users home directory
-	char *homeDir = getenv("HOME");
+int jobAddProcess(struct jobTable *table, int slot, pid_t pid) {
+	struct jobIndex *oldIndex = table->index;
+	struct jobIndex *newIndex;
+	unsigned int oldSize = table->index ? 1u << table->indexBits : 0;
+	unsigned int mask;
+	unsigned int position;
+	int bits = table->indexBits;
 
-	if (args[1] == NULL) {
-		// If no destination directory is specified change to home directory
-		chdir(homeDir);
-	}
-	else {
-		// Attempt to change to specified directory
-		if (chdir(args[1]) == -1) {
-			printf("cd: %s: No such file or directory\n", args[1]);
-			fflush(stdout);
-			*status = EXIT_FAILURE;
+	if (2 * (table->indexCount + 1) > (int)oldSize) {
+		// Rehash every process into an index twice the size
+		bits = oldIndex ? bits + 1 : JOB_INDEX_BITS;
+		newIndex = calloc(1u << bits, sizeof(*newIndex));
+		if (newIndex == NULL)
+			return -1;
+
+		mask = (1u << bits) - 1;
+		for (position = 0; position < oldSize; position++) {
+			unsigned int home;
+
+			if (oldIndex[position].pid == 0)
+				continue;
+
+			home = jobIndexHash(oldIndex[position].pid, bits);
+			while (newIndex[home].pid != 0)
+				home = (home + 1) & mask;
+			newIndex[home] = oldIndex[position];
 		}
+
+		free(oldIndex);
+		table->index = newIndex;
+		table->indexBits = bits;
 	}
+
+	// Linear probing for an empty entry
+	mask = (1u << table->indexBits) - 1;
+	position = jobIndexHash(pid, table->indexBits);
+	while (table->index[position].pid != 0)
+		position = (position + 1) & mask;
+
+	table->index[position].pid = pid;
+	table->index[position].slot = slot;
+	table->indexCount++;
+
+	table->jobs[slot].pid = pid;
+	table->jobs[slot].processes++;
+
+	return 0;
 }
 
 
 
 /*************************************************************************
  *
- * Function:    cmdStatus()
+ * Function:    jobTakeProcess()
  *
- * Description: This function executes the build in command "status". If
- *              the previous command exited normally, its exit status
- *              is displayed. Otherwise, if it was terminated by a signal,
- *              a message with the signal number is displayed.
+ * Description: This function finds the job a process belongs to and
+ *              removes the process from the index of pids. Entries after
+ *              the removed one are shifted back so that no probe
+ *              sequence is broken.
  *
- * Parameters:  status - int
- *              termination - int
+ * Parameters:  table - pointer to the job table
+ *              pid - the process id
  *
- * Returns:     None.
+ * Returns:     The slot of the process's job, or NO_JOB if the process
+ *              is not in the table.
  *
  ************************************************************************/
-void cmdStatus(int status, int termination) {
-	if (termination > 0) {
-		// Previous process was terminated and the termination flag was
-		// set to a valid signal, so show termination signal
-		printf("terminated by signal %d\n", termination);
+int jobTakeProcess(struct jobTable *table, pid_t pid) {
+	unsigned int mask = (1u << table->indexBits) - 1;
+	unsigned int position;
+	unsigned int next;
+	unsigned int home;
+	int slot;
+
+	if (table->index == NULL)
+		return NO_JOB;
+
+	position = jobIndexHash(pid, table->indexBits);
+	while (table->index[position].pid != pid) {
+		if (table->index[position].pid == 0)
+			return NO_JOB;
+		position = (position + 1) & mask;
 	}
-	else {
-		// Previous process exited normally, so show exit status
-		printf("exit value %d\n", status);
+
+	slot = table->index[position].slot;
+	table->indexCount--;
+
+	// Move back any entry that would no longer be found
+	for (next = (position + 1) & mask; table->index[next].pid != 0;
+			next = (next + 1) & mask) {
+		home = jobIndexHash(table->index[next].pid, table->indexBits);
+
+		if (((next - home) & mask) >= ((next - position) & mask)) {
+			table->index[position] = table->index[next];
+			position = next;
+		}
 	}
-	fflush(stdout);
+	table->index[position].pid = 0;
+
+	return slot;
 }
 
 
 
 /*************************************************************************
  *
- * Function:    cmdExit()
+ * Function:    jobFindProcess()
  *
- * Description: This function executes the build in command "exit". Before
- *              exiting the program, all background processes are killed.
+ * Description: This function finds the job a process belongs to, leaving
+ *              the process in the index of pids.
  *
- * Parameters:  bgOpen - an array of pid_t
+ * Parameters:  table - pointer to the job table
+ *              pid - the process id
  *
- * Returns:     None.
+ * Returns:     The slot of the process's job, or NO_JOB if the process
+ *              is not in the table.
  *
  ************************************************************************/
-void cmdExit(pid_t bgOpen[]) {
-	int bgCounter = 0;
-	pid_t curPid;
+int jobFindProcess(struct jobTable *table, pid_t pid) {
+	unsigned int mask = (1u << table->indexBits) - 1;
+	unsigned int position;
 
-	// Kill running background processes
-	while (bgOpen[bgCounter] != PROCESS_INVALID) {
-		curPid = bgOpen[bgCounter++];
+	if (table->index == NULL)
+		return NO_JOB;
 
-		// Attempt to kill the current process
-		if (curPid != PROCESS_IS_FINISHED) {
-			if (kill(curPid, SIGKILL) < 0) {
-				perror("kill failed");
-			}
-		}
+	position = jobIndexHash(pid, table->indexBits);
+	while (table->index[position].pid != pid) {
+		if (table->index[position].pid == 0)
+			return NO_JOB;
+		position = (position + 1) & mask;
 	}
 
-	exit(EXIT_SUCCESS);
+	return table->index[position].slot;
 }
 
 
 
 /*************************************************************************
  *
- * Function:    cmdExecute()
+ * Function:    jobRemove()
  *
- * Description: This function executes a command that is not built into
- *              the shell. It determines if the process should be run in
- *              the background, and if the input or output need to be
- *              redirected. A child process is created to execute the
- *              command in the foreground, or background if specified.
- *              The parent process evaluates if a foreground process
- *              exited normally or was terminated.
+ * Description: This function frees the slot of a job that has finished.
  *
- * Parameters:  args - an array of char*
- *              status - pointer to an int
- *              termination - pointer to an int
- *              bgOpen - an array of pid_t
+ * Parameters:  table - pointer to the job table
+ *              slot - the slot of the job
  *
- * Returns:     None. status, termination, and bgOpen parameters may
- *              be altered.
+ * Returns:     None. table parameter is altered.
  *
  ************************************************************************/
-void cmdExecute(char *args[], int *status, int *termination, pid_t bgOpen[]) {
+void jobRemove(struct jobTable *table, int slot) {
+	struct job *job = &table->jobs[slot];
 
-	pid_t cpid;         // pid of child process
-	pid_t wpid;         // return value of waitpid() command
-	int waitStatus;     // value altered in waitpid() command
-	int inputFile;
-	int outputFile;
-	int redirectInput = isInputRedirected(args);
-	int redirectOutput = isOutputRedirected(args);
-	int runInBackground = isBackground(args);
-	int bgCounter = 0;
+	free(job->command);
+	job->command = NULL;
+	job->pid = 0;
+	job->nextFree = table->freeSlot;
+	table->freeSlot = slot;
 
+	if (table->stats != NULL)
+		__atomic_sub_fetch(&table->stats->jobsActive, 1, __ATOMIC_RELAXED);
+}
 
-	// Set input and output files for process running in background
-	// without input or output redirection. The file location of
-	// "/dev/null" suppresses any input or output to the process.
-	*status = EXIT_FAILURE;
-	if (runInBackground) {
-		if (!redirectInput)
-			inputFile = open("/dev/null", O_RDONLY);
-		if (!redirectOutput)
-			outputFile = open("/dev/null", O_WRONLY);
-
-		if (inputFile == -1 || outputFile == -1) {
-			printf("cannot open /dev/null\n");
-			fflush(stdout);
-			return;
-		}
 
-		// Ensure files are closed on exec
-		fcntl(inputFile, F_SETFD, FD_CLOEXEC);
-		fcntl(outputFile, F_SETFD, FD_CLOEXEC);
-	}
 
-	// For commands with redirection, the file to open will be the
-	// third element in args[].
+/*************************************************************************
+ *
+ * Function:    jobFind()
+ *
+ * Description: This function finds a job started with "&" from the way a
+ *              user refers to it: %n for the job numbered n by jobs, the
+ *              pid of any of its processes, or %, %% or %+, like no job
+ *              at all, for the one started last.
+ *
+ * Parameters:  table - pointer to the job table
+ *              spec - the job as given by the user, or NULL
+ *
+ * Returns:     The slot of the job, or NO_JOB if there is no such job.
+ *
+ ************************************************************************/
+int jobFind(struct jobTable *table, char *spec) {
+	struct job *job;
+	struct job *latest = NULL;
+	char *digits;
+	char *end;
+	long number;
+	int slot = NO_JOB;
 
-	// Set input file for redirected input
-	if (redirectInput) {
-		inputFile = open(args[2], O_RDONLY);
+	if (spec == NULL || strcmp(spec, "%") == 0 || strcmp(spec, "%%") == 0
+			|| strcmp(spec, "%+") == 0) {
+		for (job = table->jobs; job < table->jobs + table->capacity; job++) {
+			if (job->pid == 0 || job->group == 0)
+				continue;
 
-		if (inputFile == -1) {
-			printf("File Error: cannot open %s for input\n", args[2]);
-			fflush(stdout);
-			return;
+			if (latest == NULL || job->start.tv_sec > latest->start.tv_sec
+					|| (job->start.tv_sec == latest->start.tv_sec
+					&& job->start.tv_nsec > latest->start.tv_nsec))
+				latest = job;
 		}
 
-		// Ensure file is closed on exec
-		fcntl(inputFile, F_SETFD, FD_CLOEXEC);
+		return latest ? (int)(latest - table->jobs) : NO_JOB;
 	}
 
-	// Set output file for redirected output
-	if (redirectOutput) {
-		outputFile = open(args[2], O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	digits = spec + (spec[0] == '%');
+	errno = 0;
+	number = strtol(digits, &end, 10);
+	if (end == digits || *end != '\0' || errno != 0 || number <= 0
+			|| number > INT_MAX)
+		return NO_JOB;
 
-		if (outputFile == -1) {
-			printf("File Error: cannot open %s for ouput\n", args[2]);
-			fflush(stdout);
-			return;
+	if (spec[0] == '%')
+		slot = (number <= table->capacity) ? (int)number - 1 : NO_JOB;
+	else
+		slot = jobFindProcess(table, (pid_t)number);
+
+	if (slot == NO_JOB || table->jobs[slot].pid == 0 || table->jobs[slot].group == 0)
+		return NO_JOB;
+	return slot;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    jobWait()
+ *
+ * Description: This function sleeps until the job in the watchPid member
+ *              of the job table, or any job started with "&" if it is -1,
+ *              has finished, or with stops set has been stopped. Finished
+ *              children are collected by reapBackground(), which hands
+ *              the status of the job over in watchStatus. SIGINT, which
+ *              the shell ignores, is blocked while waiting, so that it is
+ *              queued and can be read from a signalfd to end the wait.
+ *
+ * Parameters:  stops - whether a stopped job also ends the wait
+ *              sh - pointer to the shell state
+ *
+ * Returns:     0 once the job is done, or -1 if the wait was interrupted,
+ *              in which case status and termination members of sh are
+ *              altered. jobs member of sh is altered.
+ *
+ ************************************************************************/
+int jobWait(int stops, struct shell *sh) {
+	struct pollfd waited[2];
+	struct timespec none = { 0, 0 };
+	sigset_t interrupt;
+	sigset_t savedMask;
+	int result = 0;
+
+	sigemptyset(&interrupt);
+	sigaddset(&interrupt, SIGINT);
+	sigprocmask(SIG_BLOCK, &interrupt, &savedMask);
+
+	waited[0].fd = sh->childFd;
+	waited[0].events = POLLIN;
+	waited[1].fd = signalfd(-1, &interrupt, SFD_CLOEXEC);
+	waited[1].events = POLLIN;
+	waited[1].revents = 0;
+	sh->jobs.watchStops = stops;
+
+	// The job may have finished before the wait began
+	reapBackground(sh);
+
+	while (sh->jobs.watchPid != 0) {
+		if (poll(waited, 2, -1) == -1 && errno != EINTR) {
+			perror("poll failed");
+			result = -1;
+			break;
+		}
+
+		if (waited[1].revents & POLLIN) {
+			sh->termination = SIGINT;
+			result = -1;
+			break;
 		}
 
-		// Ensure file is closed on exec
-		fcntl(outputFile, F_SETFD, FD_CLOEXEC);
+		reapBackground(sh);
 	}
 
+	sh->jobs.watchPid = 0;
+	sh->jobs.watchStops = 0;
+	if (waited[1].fd != -1)
+		close(waited[1].fd);
 
-	// Fork processes
-	cpid = fork();
+	// Drop the interrupt before SIGINT is ignored again
+	while (sigtimedwait(&interrupt, NULL, &none) > 0)
+		continue;
+	sigprocmask(SIG_SETMASK, &savedMask, NULL);
 
-	if (cpid == -1) {
-		perror("fork failed");
+	return result;
+}
+
+
+
+/*************************************************************************
+ *
+ * Function:    jobSignal()
+ *
+ * Description: This function sends a signal to every background process.
+ *              A job started with "&" is signalled with one killpg() to
+ *              its process group, which also reaches any process the job
+ *              started itself, and other jobs have each of their
+ *              processes signalled. Unless the signal is SIGKILL the
+ *              processes are continued too, so that a stopped one can
+ *              act on it. A process that is already gone is ignored.
+ *
+ * Parameters:  table - pointer to the job table
+ *              signal - the signal to send
+ *
+ * Returns:     None.
+ *
+ ************************************************************************/
+void jobSignal(struct jobTable *table, int signal) {
+	struct job *job;
+	unsigned int position;
+	pid_t pid;
+
+	for (job = table->jobs; job < table->jobs + table->capacity; job++) {
+		if (job->pid == 0 || job->group == 0)
+			continue;
+
+		killpg(job->group, signal);
+		if (signal != SIGKILL)
+			killpg(job->group, SIGCONT);
 	}
-	else if (cpid == 0) {
-		// Set up singnal handler to catch SIGINT in
-		// the foreground processes. sigfillset() ensures
-		// that other signals will be blocked while this
-		// signal is being processed.
-		struct sigaction act;
-		act.sa_handler = SIG_DFL;
-		act.sa_flags = 0;
-		sigfillset(&(act.sa_mask));
 
-		if (runInBackground) {
-			// Ensure a background process is not terminated by SIGINT
-			act.sa_handler = SIG_IGN;
-		}
+	for (position = 0; table->index && position < (1u << table->indexBits);
+			position++) {
+		pid = table->index[position].pid;
+		if (pid == 0 || table->jobs[table->index[position].slot].group != 0)
+			continue;
 
-		// Perform the default behavior of SIGINT for foreground processes
-		sigaction(SIGINT, &act, NULL);
+		kill(pid, signal);
+		if (signal != SIGKILL)
+			kill(pid, SIGCONT);
+	}
+}
 
 
-		if (runInBackground) {
-			// Change input and output for processes running in background
 
-			if (dup2(inputFile, 0) == -1) {
-				perror("dup2 failed");
-				exit(EXIT_FAILURE);
-			}
+/*************************************************************************
+ *
+ * Function:    jobStatus()
+ *
+ * Description: This function sets the status of the shell from that of a
+ *              job that was waited for. A stopped job has the status 128
+ *              plus the signal that stopped it.
+ *
+ * Parameters:  waitStatus - the status the job ended or stopped with
+ *              sh - pointer to the shell state
+ *
+ * Returns:     None. status and termination members of sh are altered.
+ *
+ ************************************************************************/
+void jobStatus(int waitStatus, struct shell *sh) {
+	sh->status = EXIT_FAILURE;
+	sh->termination = 0;
 
-			if (dup2(outputFile, 1) == -1) {
-				perror("dup2 failed");
-				exit(EXIT_FAILURE);
-			}
-		}
-		else if (redirectInput || redirectOutput) {
-			// Change input or output if redirected in foreground
+	if (WIFEXITED(waitStatus))
+		sh->status = WEXITSTATUS(waitStatus);
+	else if (WIFSIGNALED(waitStatus))
+		sh->termination = WTERMSIG(waitStatus);
+	else if (WIFSTOPPED(waitStatus))
+		sh->status = 128 + WSTOPSIG(waitStatus);
+}
 
-			int redirectFd;
 
-			if (redirectInput)
-				redirectFd = dup2(inputFile, 0);
 
-			if (redirectOutput)
-				redirectFd = dup2(outputFile, 1);
+/*************************************************************************
+ *
+ * Function:    jobIndexHash()
+ *
+ * Description: This function computes the home position of a pid in the
+ *              index of the job table by Fibonacci hashing.
+ *
+ * Parameters:  pid - the process id
+ *              bits - the index holds 1 << bits entries
+ *
+ * Returns:     The home position of the pid.
+ *
+ ************************************************************************/
+unsigned int jobIndexHash(pid_t pid, int bits) {
+	return ((unsigned int)pid * 2654435769u) >> (32 - bits);
+}
 
-			if (redirectFd == -1) {
-				perror("dup2");
-				exit(EXIT_FAILURE);
-			}
-		}
 
 
-		// Execute the process
-		if (redirectInput || redirectOutput) {
-			// Execute the program without arguments
-			execlp(args[0], args[0], NULL);
-		}
-		else {
-			// Execute the program with full list of arguments
-			execvp(args[0], args);
-		}
+/*************************************************************************
+ *
+ * Function:    outPrintf()
+ *
+ * Description: This function formats a message for the user into the
+ *              shell's output buffer. Messages are collected there and
+ *              sent with a single write() by outFlush(), which is done
+ *              before the prompt, before a process is started, and when
+ *              the buffer is full. A message too large for the buffer is
+ *              written directly.
+ *
+ * Parameters:  sh - pointer to the shell state
+ *              format - a printf() format string, followed by its values
+ *
+ * Returns:     None. output member of sh is altered.
+ *
+ ************************************************************************/
+void outPrintf(struct shell *sh, const char *format, ...) {
+	struct outputBuffer *out = &sh->output;
+	size_t room = sizeof(out->data) - out->length;
+	char *text;
+	va_list values;
+	int length;
 
-		// This is only reached if exec() fails
-		printf("Execution Error: %s is not a valid command\n", args[0]);
-		fflush(stdout);
-		exit(EXIT_FAILURE);
-	}
-	else if (cpid > 0) {
+	va_start(values, format);
+	length = vsnprintf(out->data + out->length, room, format, values);
+	va_end(values);
 
-		if (runInBackground) {
-			printf("background pid is %d\n", cpid);
-			fflush(stdout);
+	if (length < 0)
+		return;
 
-			while (bgCounter < MAX_PROCESSES) {
-				if (bgOpen[bgCounter] < 1) {                //rvw: magic number
-					// Add pid of background process to array.
-					// If value is 0, insert at that position.
-					// A value of -1 indicates there are no finished
-					// processes in the list.
-					bgOpen[bgCounter] = cpid;               //rvw: for the above suggestion to set *status = EXIT_FAILURE up above, think you would need to make it valid at this return.
-					return;
-				}
-				bgCounter++;
-			}
+	if ((size_t)length >= room) {
+		// The message did not fit, so send what is waiting first
+		outFlush(sh);
+
+		va_start(values, format);
+		if ((size_t)length < sizeof(out->data)) {
+			vsnprintf(out->data, sizeof(out->data), format, values);
 		}
-		else {
-			// Wait for the foreground child process to finish
-			wpid = waitpid(cpid, &waitStatus, 0);
+		else if (vasprintf(&text, format, values) != -1) {
+			outSend(sh, text, length);
+			free(text);
+			length = 0;
 		}
+		va_end(values);
+	}
 
-		if (wpid == -1) {
-			perror("wait failed");
-		}
+	out->length += length;
+}
 
 
-		if (WIFEXITED(waitStatus)) {
-			// The foreground process finished execution.
-			// Save the exit status
-			*status = WEXITSTATUS(waitStatus);
 
-			// Ensure termination flag is set to non-valid signal value
-			*termination = 0;
-		}
+/*************************************************************************
+ *
+ * Function:    outWrite()
+ *
+ * Description: This function adds bytes to the shell's output buffer
+ *              without formatting them. Data too large for the buffer is
+ *              written directly.
+ *
+ * Parameters:  sh - pointer to the shell state
+ *              data - the bytes to add
+ *              length - the number of bytes
+ *
+ * Returns:     None. output member of sh is altered.
+ *
+ ************************************************************************/
+void outWrite(struct shell *sh, const char *data, size_t length) {
+	struct outputBuffer *out = &sh->output;
+
+	if (length > sizeof(out->data) - out->length) {
+		outFlush(sh);
 
-		if (WIFSIGNALED(waitStatus)) {
-			// The foreground process was terminated.
-			// Set termination flag for use in the status command
-			*termination = WTERMSIG(waitStatus);
-			printf("terminated by signal %d\n", *termination);
-			fflush(stdout);
+		if (length >= sizeof(out->data)) {
+			outSend(sh, data, length);
+			return;
 		}
 	}
+
+	memcpy(out->data + out->length, data, length);
+	out->length += length;
 }
 
 
 
 /*************************************************************************
  *
- * Function:    isInputRedirected()
+ * Function:    outEscape()
  *
- * Description: This function searches for the "<" character to determine
- *              if a process should have its output redirected.
+ * Description: This function adds the character named by a backslash
+ *              escape to the shell's output buffer. The escapes \\, \a,
+ *              \b, \e, \f, \n, \r, \t, \v, \xHH and octal values are
+ *              understood, and \c stops all further output. Octal values
+ *              are written \0NNN for echo and %b, or \NNN in a printf
+ *              format. Any other backslash is written as it is.
  *
- * Parameters:  args - an array of char*
+ * Parameters:  sh - pointer to the shell state
+ *              text - pointer to the backslash
+ *              zeroOctal - whether octal values begin with \0
+ *              stop - pointer to an int set when \c is found
  *
- * Returns:     1 if "<" is found, 0 if not.
+ * Returns:     Pointer to the character after the escape.
  *
  ************************************************************************/
-int isInputRedirected(char *args[]) {
-	int position = 0;
+char *outEscape(struct shell *sh, char *text, int zeroOctal, int *stop) {
+	char *p = text + 1;
+	char c;
+	int digits;
 
-	while (args[position] != NULL) {
-		if (strcmp(args[position], "<") == 0) {
-			return 1;
+	switch (*p) {
+	case '\\': c = '\\'; break;
+	case 'a': c = '\a'; break;
+	case 'b': c = '\b'; break;
+	case 'e': c = 033; break;
+	case 'f': c = '\f'; break;
+	case 'n': c = '\n'; break;
+	case 'r': c = '\r'; break;
+	case 't': c = '\t'; break;
+	case 'v': c = '\v'; break;
+	case 'c':
+		*stop = 1;
+		return p + 1;
+	case 'x':
+		if (!isxdigit((unsigned char)p[1]))
+			goto literal;
+		for (c = 0, digits = 0; digits < 2 && isxdigit((unsigned char)p[1]); digits++) {
+			p++;
+			c = c * 16 + (isdigit((unsigned char)*p) ? *p - '0'
+				: tolower((unsigned char)*p) - 'a' + 10);
 		}
-
-		position++;
+		break;
+	default:
+		if (*p < '0' || *p > '7' || (zeroOctal && *p != '0'))
+			goto literal;
+		if (zeroOctal)
+			p++;
+		for (c = 0, digits = 0; digits < 3 && *p >= '0' && *p <= '7'; digits++)
+			c = c * 8 + (*p++ - '0');
+		outWrite(sh, &c, 1);
+		return p;
 	}
 
-	return 0;
+	outWrite(sh, &c, 1);
+	return p + 1;
+
+literal:
+	outWrite(sh, text, 1);
+	return p;
 }
 
 
 
 /*************************************************************************
  *
- * Function:    isOutputRedirected()
+ * Function:    outFlush()
  *
- * Description: This function searches for the ">" character to determine
- *              if a process should have its output redirected.
+ * Description: This function writes everything waiting in the shell's
+ *              output buffer to stdout, or to the file the output of a
+ *              built in command is redirected to.
  *
- * Parameters:  args - an array of char*
+ * Parameters:  sh - pointer to the shell state
  *
- * Returns:     1 if ">" is found, 0 if not.
+ * Returns:     None. output member of sh is altered.
  *
  ************************************************************************/
-int isOutputRedirected(char *args[]) {
-	int position = 0;
+void outFlush(struct shell *sh) {
+	if (sh->output.length > 0) {
+		outSend(sh, sh->output.data, sh->output.length);
+		sh->output.length = 0;
+	}
+}
 
-	while (args[position] != NULL) {
-		if (strcmp(args[position], ">") == 0) {
-			return 1;
-		}
 
-		position++;
+
+/*************************************************************************
+ *
+ * Function:    outSend()
+ *
+ * Description: This function sends output of the shell on from its
+ *              output buffer. While a command substitution runs, stdout
+ *              is added to the capture buffer in place of being written.
+ *
+ * Parameters:  sh - pointer to the shell state
+ *              data - the output
+ *              length - the number of bytes in data
+ *
+ * Returns:     None. capture member of sh may be altered.
+ *
+ ************************************************************************/
+void outSend(struct shell *sh, const char *data, size_t length) {
+	struct capture *capture = &sh->capture;
+
+	if (sh->substituting == 0 || sh->output.fd != 1) {
+		writeAll(sh->output.fd, data, length);
+		return;
 	}
 
-	return 0;
+	if (capture->size - capture->length < length
+			&& captureGrow(capture, length) == -1) {
+		perror("command substitution");
+		return;
+	}
+
+	memcpy(capture->data + capture->length, data, length);
+	capture->length += length;
 }
 
 
 
 /*************************************************************************
  *
- * Function:    isBackground()
+ * Function:    writeAll()
  *
- * Description: This function searches for the "&" character to determine
- *              if a process should run in the background.
+ * Description: This function writes all of a block of data to a file
+ *              descriptor, continuing after partial writes and signals.
  *
- * Parameters:  args - an array of char*
+ * Parameters:  fd - the file descriptor
+ *              data - the bytes to write
+ *              length - the number of bytes
  *
- * Returns:     1 if "&" is found, 0 if not.
+ * Returns:     0 on success, or -1 if a write failed.
  *
  ************************************************************************/
-int isBackground(char *args[]) {
-	int position = 0;
+int writeAll(int fd, const char *data, size_t length) {
+	ssize_t count;
 
-	while (args[position] != NULL) {
-		if (strcmp(args[position], "&") == 0) {
-			return 1;
+	while (length > 0) {
+		count = write(fd, data, length);
+
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
 		}
 
-		position++;
- 	}
+		data += count;
+		length -= count;
+	}
 
 	return 0;
 }
@@ -0,0 +1,95 @@
+#!/bin/sh
+#
+# Runs the same workloads under each shell and prints one CSV line per
+# shell and workload, keeping the fastest of several runs:
+#
+#   shell,workload,iterations,seconds,usec_per_op
+#
+# Usage: run.sh [-n iterations] [-r repeats] shell...
+#
+# A shell is a path or a name found on PATH. Shells that cannot be found
+# are skipped with a note on stderr.
+
+iterations=1000
+repeats=5
+
+while getopts n:r: option; do
+	case $option in
+	n) iterations=$OPTARG ;;
+	r) repeats=$OPTARG ;;
+	*) echo "usage: $0 [-n iterations] [-r repeats] shell..." >&2; exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/babysh-bench.XXXXXX") || exit 1
+trap 'rm -rf "$work"' EXIT INT TERM
+
+# Write a script that repeats a line the given number of times
+repeat() {
+	count=$1
+	line=$2
+	awk -v n="$count" -v line="$line" 'BEGIN { for (i = 0; i < n; i++) print line }'
+}
+
+# Scripts for the workloads run in batch mode
+repeat "$iterations" "/bin/true" > "$work/spawn"
+repeat "$iterations" "true" > "$work/builtin"
+repeat "$iterations" "echo line > $work/out" > "$work/redirect"
+repeat "$iterations" "/bin/cat < $work/in > $work/out" > "$work/external-redirect"
+echo "input" > "$work/in"
+
+# Background jobs are started all at once and then waited for. A shell
+# without a wait command has its remaining jobs stopped at exit instead.
+{ repeat "$iterations" "/bin/true &"; echo "wait"; } > "$work/background"
+
+now() {
+	date +%s%N
+}
+
+# Time one run of a workload and print the elapsed nanoseconds
+run() {
+	shell=$1
+	workload=$2
+	start=$(now)
+	case $workload in
+	startup)
+		i=0
+		while [ "$i" -lt "$iterations" ]; do
+			"$shell" < /dev/null > /dev/null 2>&1
+			i=$((i + 1))
+		done
+		;;
+	*)
+		"$shell" "$work/$workload" > /dev/null 2>&1
+		;;
+	esac
+	echo $(($(now) - start))
+}
+
+echo "shell,workload,iterations,seconds,usec_per_op"
+
+for shell in "$@"; do
+	path=$(command -v "$shell") || {
+		echo "$0: $shell: not found, skipped" >&2
+		continue
+	}
+
+	for workload in startup spawn builtin redirect external-redirect background; do
+		best=
+		pass=0
+		while [ "$pass" -lt "$repeats" ]; do
+			elapsed=$(run "$path" "$workload")
+			if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+				best=$elapsed
+			fi
+			pass=$((pass + 1))
+		done
+
+		awk -v shell="$(basename "$shell")" -v workload="$workload" \
+			-v n="$iterations" -v ns="$best" 'BEGIN {
+			printf "%s,%s,%d,%.6f,%.2f\n", shell, workload, n,
+				ns / 1e9, ns / 1e3 / n
+		}'
+	done
+done
@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# Measures how fast babysh splits long lines into words with each of the
+# kernels BABYSH_SCAN can choose, "off" being the character at a time
+# loop the other kernels replace. Prints one CSV line per kernel and
+# workload, keeping the fastest of several runs:
+#
+#   scan,workload,bytes,seconds,mb_per_s
+#
+# Usage: tokenize.sh [-n lines] [-r repeats] [shell]
+#
+# Every line runs the built in true, so that the time is spent reading
+# and parsing the line rather than starting a process.
+
+lines=200
+repeats=5
+
+while getopts n:r: option; do
+	case $option in
+	n) lines=$OPTARG ;;
+	r) repeats=$OPTARG ;;
+	*) echo "usage: $0 [-n lines] [-r repeats] [shell]" >&2; exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+shell=${1:-../babysh}
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/babysh-tokenize.XXXXXX") || exit 1
+trap 'rm -rf "$work"' EXIT INT TERM
+
+# Write the given number of lines of words made by a printf format
+wordLines() {
+	count=$1
+	words=$2
+	format=$3
+	awk -v n="$count" -v words="$words" -v format="$format" 'BEGIN {
+		for (i = 0; i < n; i++) {
+			printf "true"
+			for (j = 0; j < words; j++)
+				printf " " format, j
+			printf "\n"
+		}
+	}'
+}
+
+# Lines of about 100KB with words of different lengths and quoting
+wordLines "$lines" 15000 "w%d" > "$work/short"
+wordLines "$lines" 2500 "/usr/share/doc/package-%d/changelog.Debian.gz" > "$work/paths"
+wordLines "$lines" 3500 "'quoted word %d'" > "$work/quoted"
+wordLines "$lines" 250 "%d-$(printf '%0400d' 0)" > "$work/long"
+
+now() {
+	date +%s%N
+}
+
+echo "scan,workload,bytes,seconds,mb_per_s"
+
+for workload in short paths quoted long; do
+	bytes=$(wc -c < "$work/$workload")
+
+	for scan in off scalar sse2 avx2; do
+		best=
+		pass=0
+		while [ "$pass" -lt "$repeats" ]; do
+			start=$(now)
+			BABYSH_SCAN=$scan "$shell" "$work/$workload" > /dev/null 2>&1
+			elapsed=$(($(now) - start))
+			if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+				best=$elapsed
+			fi
+			pass=$((pass + 1))
+		done
+
+		awk -v scan="$scan" -v workload="$workload" -v bytes="$bytes" \
+			-v ns="$best" 'BEGIN {
+			printf "%s,%s,%d,%.6f,%.1f\n", scan, workload, bytes,
+				ns / 1e9, bytes / 1e6 / (ns / 1e9)
+		}'
+	done
+done